@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ethdev.h>
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+#include <rte_mbuf.h>
+#include <rte_memcpy.h>
+#include <rte_hash_crc.h>
+#include <rte_log.h>
+
+#include "common.h"
+#include "nsh.h"
+#include "rcu.h"
+#include "bench.h"
+
+#define PCAP_MAGIC          0xA1B2C3D4  /* Microsecond timestamps */
+#define PCAP_MAGIC_NS       0xA1B23C4D  /* Nanosecond timestamps */
+#define PCAP_LINKTYPE_ETHER 1
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_pkt_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+static struct bench_stream bench_streams[MAX_NB_PORTS];
+
+/* TSC cycles each worker took to handle its packets */
+static uint64_t bench_cycles[RTE_MAX_LCORE];
+
+static const char *const bench_role_names[] = {
+    [SFC_PROXY] = "proxy",
+    [SFC_CLASSIFIER] = "classifier",
+    [SFC_FORWARDER] = "forwarder",
+    [SFC_LOOPBACK] = "loopback",
+    [SFC_GENERATOR] = "generator",
+};
+
+extern struct sfcapp_config sfcapp_cfg;
+extern struct rte_mempool *sfcapp_pktmbuf_pools[RTE_MAX_NUMA_NODES];
+
+static void bench_stream_add(struct bench_stream *s, const void *pkt, uint16_t len){
+
+    if(s->nb_pkts == s->max_pkts){
+        s->max_pkts = s->max_pkts == 0 ? 1024 : 2*s->max_pkts;
+        s->off = realloc(s->off,s->max_pkts*sizeof(*s->off));
+        s->len = realloc(s->len,s->max_pkts*sizeof(*s->len));
+        if(s->off == NULL || s->len == NULL)
+            rte_exit(EXIT_FAILURE,"Failed to allocate benchmark packets.\n");
+    }
+
+    if(s->data_len + len > s->data_size){
+        s->data_size = RTE_MAX(2*s->data_size,s->data_len + len);
+        s->data = realloc(s->data,s->data_size);
+        if(s->data == NULL)
+            rte_exit(EXIT_FAILURE,"Failed to allocate benchmark packets.\n");
+    }
+
+    memcpy(s->data + s->data_len,pkt,len);
+    s->off[s->nb_pkts] = s->data_len;
+    s->len[s->nb_pkts] = len;
+    s->data_len += len;
+    s->nb_pkts++;
+}
+
+static void bench_load_pcap(const char *pcap_file, struct bench_stream *s){
+    struct pcap_file_hdr file_hdr;
+    struct pcap_pkt_hdr pkt_hdr;
+    uint8_t pkt[RTE_MBUF_DEFAULT_DATAROOM];
+    uint32_t skipped = 0;
+    int swapped;
+    FILE *f;
+
+    f = fopen(pcap_file,"rb");
+    if(f == NULL)
+        rte_exit(EXIT_FAILURE,"Failed to open %s.\n",pcap_file);
+
+    if(fread(&file_hdr,sizeof(file_hdr),1,f) != 1)
+        rte_exit(EXIT_FAILURE,"%s is not a pcap file.\n",pcap_file);
+
+    if(file_hdr.magic == PCAP_MAGIC || file_hdr.magic == PCAP_MAGIC_NS)
+        swapped = 0;
+    else if(file_hdr.magic == rte_bswap32(PCAP_MAGIC) ||
+            file_hdr.magic == rte_bswap32(PCAP_MAGIC_NS))
+        swapped = 1;
+    else
+        rte_exit(EXIT_FAILURE,"%s is not a pcap file.\n",pcap_file);
+
+    if((swapped ? rte_bswap32(file_hdr.linktype) : file_hdr.linktype) != PCAP_LINKTYPE_ETHER)
+        rte_exit(EXIT_FAILURE,"%s does not hold Ethernet frames.\n",pcap_file);
+
+    while(fread(&pkt_hdr,sizeof(pkt_hdr),1,f) == 1){
+        if(swapped)
+            pkt_hdr.caplen = rte_bswap32(pkt_hdr.caplen);
+
+        /* Mbufs are not chained, larger packets are left out */
+        if(pkt_hdr.caplen > sizeof(pkt)){
+            if(fseek(f,pkt_hdr.caplen,SEEK_CUR) != 0)
+                break;
+            skipped++;
+            continue;
+        }
+
+        if(fread(pkt,pkt_hdr.caplen,1,f) != 1)
+            break;
+
+        bench_stream_add(s,pkt,pkt_hdr.caplen);
+    }
+
+    fclose(f);
+
+    if(s->nb_pkts == 0)
+        rte_exit(EXIT_FAILURE,"No packets in %s.\n",pcap_file);
+
+    printf("Read %" PRIu32 " packets from %s, %" PRIu32 " too large skipped\n",
+        s->nb_pkts,pcap_file,skipped);
+}
+
+/* Writes the len bytes long UDP packet of flow into mbuf */
+static int bench_build_udp(struct rte_mbuf *mbuf, const struct ether_addr *dst_mac,
+    uint32_t flow, uint16_t len){
+    static const struct ether_addr src_mac = {{ 0x02, 0, 0, 0, 0, 0x01 }};
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ipv4_hdr;
+    struct udp_hdr *udp_hdr;
+
+    eth_hdr = (struct ether_hdr *) rte_pktmbuf_append(mbuf,len);
+    if(eth_hdr == NULL)
+        return -1;
+
+    memset(eth_hdr,0,len);
+    ipv4_hdr = (struct ipv4_hdr *) (eth_hdr + 1);
+    udp_hdr = (struct udp_hdr *) (ipv4_hdr + 1);
+
+    ether_addr_copy(dst_mac,&eth_hdr->d_addr);
+    ether_addr_copy(&src_mac,&eth_hdr->s_addr);
+    eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+    ipv4_hdr->version_ihl = 0x45;
+    ipv4_hdr->time_to_live = 64;
+    ipv4_hdr->next_proto_id = IP_PROTO_UDP;
+    ipv4_hdr->total_length = rte_cpu_to_be_16(len - sizeof(struct ether_hdr));
+    ipv4_hdr->src_addr = rte_cpu_to_be_32(IPv4(10,0,0,0) + flow);
+    ipv4_hdr->dst_addr = rte_cpu_to_be_32(IPv4(10,1,0,1));
+    ipv4_hdr->hdr_checksum = rte_ipv4_cksum(ipv4_hdr);
+
+    udp_hdr->src_port = rte_cpu_to_be_16(1024 + flow % 64512);
+    udp_hdr->dst_port = rte_cpu_to_be_16(80);
+    udp_hdr->dgram_len = rte_cpu_to_be_16(len - sizeof(struct ether_hdr) -
+        sizeof(struct ipv4_hdr));
+
+    return 0;
+}
+
+/* Prepends the outer headers of tmpl, with lengths set and the source
+ * port taken from flow_hash */
+static int bench_build_vxlan(struct rte_mbuf *mbuf, const struct vxlan_tmpl *tmpl,
+    uint32_t flow_hash){
+    struct ipv4_hdr *ipv4_hdr;
+    struct udp_hdr *udp_hdr;
+    uint16_t inner_len = mbuf->pkt_len;
+    char *hdr;
+
+    hdr = rte_pktmbuf_prepend(mbuf,VXLAN_OUTER_HDR_LEN);
+    if(hdr == NULL)
+        return -1;
+
+    memcpy(hdr,tmpl->hdr,VXLAN_OUTER_HDR_LEN);
+    ipv4_hdr = (struct ipv4_hdr *) (hdr + sizeof(struct ether_hdr));
+    udp_hdr = (struct udp_hdr *) (ipv4_hdr + 1);
+
+    ipv4_hdr->total_length = rte_cpu_to_be_16(inner_len + VXLAN_OUTER_HDR_LEN -
+        sizeof(struct ether_hdr));
+    udp_hdr->dgram_len = rte_cpu_to_be_16(inner_len + sizeof(struct udp_hdr) +
+        sizeof(struct vxlan_hdr));
+    common_vxlan_set_src_port(mbuf,flow_hash);
+
+    return 0;
+}
+
+void bench_generate(struct bench_stream *s, const struct ether_addr *dst_mac,
+    const struct vxlan_tmpl *tmpl, int nsh, uint32_t nb_paths){
+    struct rte_mbuf *mbuf;
+    struct nsh_hdr nsh_header;
+    struct ipv4_hdr *ipv4_hdr;
+    uint32_t flow, sph, flow_hash;
+    int ret;
+
+    for(flow = 0 ; flow < sfcapp_cfg.params.bench_flows ; flow++){
+        /* Flows spread among nb_paths consecutive SPIs */
+        sph = sfcapp_cfg.params.bench_sph + ((flow % nb_paths) << 8);
+
+        mbuf = rte_pktmbuf_alloc(sfcapp_pktmbuf_pools[rte_socket_id()]);
+        if(mbuf == NULL)
+            rte_exit(EXIT_FAILURE,"Failed to allocate benchmark packet.\n");
+
+        ret = bench_build_udp(mbuf,dst_mac,flow,sfcapp_cfg.params.bench_pkt_len);
+
+        /* Every <SPI, flow> gets its own source port, and RSS hash,
+         * as classified packets do */
+        if(ret == 0 && tmpl != NULL){
+            flow_hash = common_flow_hash(mbuf);
+            ret = bench_build_vxlan(mbuf,tmpl,
+                rte_hash_crc_4byte(nsh ? sph >> 8 : 0,flow_hash));
+        }
+
+        if(ret == 0 && nsh){
+            nsh_init_header(&nsh_header);
+            nsh_header.serv_path = sph;
+            ret = nsh_encap(mbuf,&nsh_header,NULL);
+        }
+
+        if(ret < 0)
+            rte_exit(EXIT_FAILURE,"Failed to build benchmark packet.\n");
+
+        if(tmpl != NULL){
+            ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,struct ipv4_hdr *,
+                sizeof(struct ether_hdr));
+            ipv4_hdr->hdr_checksum = 0;
+            ipv4_hdr->hdr_checksum = rte_ipv4_cksum(ipv4_hdr);
+        }
+
+        bench_stream_add(s,rte_pktmbuf_mtod(mbuf,void *),rte_pktmbuf_data_len(mbuf));
+        rte_pktmbuf_free(mbuf);
+    }
+
+    printf("Generated %" PRIu32 " packets of %" PRIu16 " bytes\n",s->nb_pkts,s->len[0]);
+}
+
+void bench_setup(const char *pcap_file){
+    const struct ether_addr *mac = &sfcapp_cfg.ports[0].mac;
+    struct vxlan_tmpl tmpl;
+
+    if(pcap_file != NULL){
+        bench_load_pcap(pcap_file,&bench_streams[0]);
+        return;
+    }
+
+    /* Tunneled packets come from the SFF, to the local VTEP */
+    common_vxlan_tmpl_init(&tmpl,0,mac,sfcapp_cfg.ports[0].ip,sfcapp_cfg.sff_vni);
+
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+        case SFC_LOOPBACK:
+            bench_generate(&bench_streams[0],mac,NULL,0,1);
+            break;
+        case SFC_FORWARDER:
+            bench_generate(&bench_streams[0],mac,&tmpl,1,1);
+            break;
+        case SFC_PROXY:
+            /* From the SFF, then back from the SF */
+            bench_generate(&bench_streams[0],mac,&tmpl,1,1);
+            bench_generate(&bench_streams[1],mac,&tmpl,0,1);
+            break;
+        default:
+            rte_exit(EXIT_FAILURE,"No benchmark for this type of application.\n");
+    }
+}
+
+/* Frees whatever the ports sent back, so that loopback devices never
+ * fill up */
+static void bench_drain(struct lcore_cfg *lcore){
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+    uint16_t i, nb_rx;
+    int p;
+
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+        nb_rx = rte_eth_rx_burst(sfcapp_cfg.ports[p].id,lcore->queue_id,pkts,
+            MAX_BURST_SIZE);
+
+        for(i = 0 ; i < nb_rx ; i++)
+            rte_pktmbuf_free(pkts[i]);
+    }
+}
+
+void bench_main_loop(struct lcore_cfg *lcore){
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+    const uint16_t burst_size = sfcapp_cfg.params.burst_size;
+    const uint64_t budget = sfcapp_cfg.params.bench_pkts;
+    const unsigned lcore_id = rte_lcore_id();
+    struct bench_stream *s;
+    struct port_cfg *p_cfg;
+    uint32_t next[MAX_NB_PORTS];
+    uint64_t handled, start_tsc, burst_tsc;
+    uint16_t i;
+    int p;
+
+    /* Workers start at different points of the streams */
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++)
+        next[p] = bench_streams[p].nb_pkts == 0 ? 0 :
+            (uint64_t) lcore->queue_id * bench_streams[p].nb_pkts / sfcapp_cfg.nb_queues;
+
+    rcu_online(lcore_id);
+
+    handled = 0;
+    start_tsc = rte_rdtsc();
+
+    while(handled < budget){
+        for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+            s = &bench_streams[p];
+            p_cfg = &sfcapp_cfg.ports[p];
+
+            if(s->nb_pkts == 0 || p_cfg->handle_pkts == NULL)
+                continue;
+
+            /* Packets still queued for TX, try again later */
+            if(rte_pktmbuf_alloc_bulk(sfcapp_pktmbuf_pools[lcore->socket_id],pkts,burst_size) != 0)
+                continue;
+
+            for(i = 0 ; i < burst_size ; i++){
+                rte_memcpy(rte_pktmbuf_mtod(pkts[i],void *),s->data + s->off[next[p]],
+                    s->len[next[p]]);
+                pkts[i]->data_len = pkts[i]->pkt_len = s->len[next[p]];
+
+                if(++next[p] == s->nb_pkts)
+                    next[p] = 0;
+            }
+
+            lcore->stats.port[p].rx_pkts += burst_size;
+
+            burst_tsc = rte_rdtsc();
+            p_cfg->handle_pkts(lcore,pkts,burst_size);
+            common_stats_burst(lcore,rte_rdtsc() - burst_tsc);
+
+            handled += burst_size;
+        }
+
+        common_flush_tx_buffers(lcore);
+        bench_drain(lcore);
+
+        if(sfcapp_cfg.housekeeping != NULL)
+            sfcapp_cfg.housekeeping(lcore);
+
+        rcu_quiescent(lcore_id);
+    }
+
+    bench_cycles[lcore_id] = rte_rdtsc() - start_tsc;
+
+    rcu_offline(lcore_id);
+}
+
+void bench_report(void){
+    struct lcore_stats total;
+    const volatile struct lcore_stats *st;
+    const double hz = rte_get_tsc_hz();
+    uint64_t rx, tx, drops, lcore_rx;
+    double mpps;
+    unsigned lcore_id;
+    int i;
+
+    common_stats_read(&total);
+
+    mpps = 0;
+    RTE_LCORE_FOREACH(lcore_id){
+        st = &sfcapp_cfg.lcores[lcore_id].stats;
+
+        for(i = 0, lcore_rx = 0 ; i < sfcapp_cfg.nb_ports ; i++)
+            lcore_rx += st->port[i].rx_pkts;
+
+        /* Workers run in parallel, their rates add up */
+        if(bench_cycles[lcore_id] > 0)
+            mpps += lcore_rx * hz / bench_cycles[lcore_id] / 1e6;
+    }
+
+    rx = tx = drops = 0;
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        rx += total.port[i].rx_pkts;
+        tx += total.port[i].tx_pkts;
+    }
+
+    for(i = 0 ; i < DROP_NB_REASONS ; i++)
+        drops += total.drops[i];
+
+    printf("\nBenchmark of %s on %u lcore(s), prefetch distance %" PRIu32 "\n"
+        "%" PRIu64 " packets handled, %" PRIu64 " transmitted, %" PRIu64 " dropped\n"
+        "%.2f Mpps\n"
+        "%.1f cycles per packet in handlers\n",
+        bench_role_names[sfcapp_cfg.type],rte_lcore_count(),
+        sfcapp_cfg.params.prefetch_distance,rx,tx,drops,mpps,
+        rx > 0 ? (double) total.busy_cycles / rx : 0.0);
+
+    for(i = 0 ; i < DROP_NB_REASONS ; i++)
+        printf("  %" PRIu64 " %s\n",total.drops[i],common_drop_reason_names[i]);
+}
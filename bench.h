@@ -0,0 +1,56 @@
+#ifndef SFCAPP_BENCH_
+#define SFCAPP_BENCH_
+
+#include "common.h"
+
+/* Benchmark mode, enabled by the bench_pkts parameter.
+ *
+ * Instead of polling the RX queues, every worker feeds its role's
+ * packet handlers with copies of packets kept in memory, as fast as
+ * it can, until it handled bench_pkts packets. Transmitted packets
+ * go to the ports as usual and whatever comes back on RX is freed,
+ * so virtual devices such as net_ring, whose TX queues loop back to
+ * RX, give results on any machine:
+ *
+ *   sfcapp -l 1 --vdev net_ring0 --vdev net_ring1 -- -p 3 -t forwarder \
+ *       -f forwarder.cfg --bench_pkts 100000000
+ *
+ * Packets are read from a pcap file, fed to port 0, or generated:
+ * bench_flows UDP flows of bench_pkt_len bytes, encapsulated as the
+ * role expects them. NSH packets carry <SPI,SI> bench_sph. The proxy
+ * also gets the packets coming back from the SF on port 1.
+ */
+
+#define BENCH_FLOWS     1024        /* Default bench_flows */
+#define BENCH_SPH       0x000001FF  /* Default bench_sph, SPI 1 SI 255 */
+#define BENCH_PKT_LEN   64          /* Default bench_pkt_len */
+
+/* Packets fed to one port, stored back to back in data */
+struct bench_stream {
+    uint32_t nb_pkts;
+    uint32_t max_pkts;
+    uint32_t *off;
+    uint16_t *len;
+    uint8_t *data;
+    size_t data_len;
+    size_t data_size;
+};
+
+/* Appends one packet per flow to s: UDP frames to dst_mac, inside
+ * the outer headers of tmpl unless NULL and an NSH header if nsh is
+ * set. Flows are spread among nb_paths SPIs, starting at the one of
+ * bench_sph. Exits on failure. */
+void bench_generate(struct bench_stream *s, const struct ether_addr *dst_mac,
+    const struct vxlan_tmpl *tmpl, int nsh, uint32_t nb_paths);
+
+/* Builds the packets to be replayed, from pcap_file if not NULL.
+ * Exits on failure. */
+void bench_setup(const char *pcap_file);
+
+/* Runs on every worker, returns once bench_pkts packets are handled */
+void bench_main_loop(struct lcore_cfg *lcore);
+
+/* Prints the results once all workers returned */
+void bench_report(void);
+
+#endif
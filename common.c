@@ -1,5 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
+#include <arpa/inet.h>
 
 #include <rte_ether.h>
 #include <rte_ethdev.h>
@@ -8,44 +10,137 @@
 #include <rte_hash_crc.h>
 #include <rte_ip.h>
 #include <rte_udp.h>
+#include <rte_memcpy.h>
+#include <rte_ring.h>
 
 #include "common.h"
+#include "latency.h"
+#include "nsh.h"
+#include "pipeline.h"
 #include "vxlan_gpe.h"
 
 extern struct sfcapp_config sfcapp_cfg;
-extern long int n_rx, n_tx;
 
 #define PORT_MIN	49152
 #define PORT_MAX	65535
 #define PORT_RANGE ((PORT_MAX - PORT_MIN) + 1)
-#define SFCAPP_DEFAULT_VNI 1000
 #define IP_VERSION 0x40
 #define IP_HDRLEN  0x05 
 #define IP_DEFTTL  64
 #define IP_VHL_DEF (IP_VERSION | IP_HDRLEN)
 
-void common_flush_tx_buffers(void){
+const char *const common_drop_reason_names[DROP_NB_REASONS] = {
+    [DROP_NO_MATCH]     = "no table match",
+    [DROP_SI_EXHAUSTED] = "SI exhausted",
+    [DROP_NOT_IPV4]     = "not IPv4",
+    [DROP_TX_FULL]      = "TX full",
+    [DROP_ENCAP_ERROR]  = "encap/decap error",
+    [DROP_RING_FULL]    = "pipeline ring full",
+    [DROP_BAD_NSH]      = "malformed NSH",
+};
+
+uint16_t common_flush_tx_ring(struct lcore_cfg *lcore, uint16_t port_idx){
+    struct ring_buffer *rb = lcore->tx_ring[port_idx];
+    unsigned n, i;
+
+    if(rb->length == 0)
+        return 0;
+
+    n = rte_ring_enqueue_burst(rb->ring,(void * const *) rb->pkts,rb->length,NULL);
+
+    for(i = n ; i < rb->length ; i++)
+        common_drop_pkt(lcore,rb->pkts[i],DROP_RING_FULL);
+
+    rb->length = 0;
+
+    return n;
+}
+
+void common_flush_tx_buffers(struct lcore_cfg *lcore){
     int i;
     for( i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
-        sfcapp_cfg.tx_pkts += rte_eth_tx_buffer_flush(sfcapp_cfg.ports[i].id,0,sfcapp_cfg.ports[i].tx_buffer);
+        if(lcore->tx_ring[i] != NULL){
+            common_flush_tx_ring(lcore,i);
+            continue;
+        }
+
+        lcore->stats.port[i].tx_pkts += rte_eth_tx_buffer_flush(sfcapp_cfg.ports[i].id,
+            lcore->queue_id,lcore->tx_buffer[i]);
     }
 }
 
-void send_pkts(struct rte_mbuf **mbufs, uint8_t tx_port, uint16_t tx_q, 
-    struct rte_eth_dev_tx_buffer* tx_buffer, uint16_t nb_pkts, uint64_t drop_mask){
-    uint16_t i;
-    uint16_t sent=0;
+void common_stats_read(struct lcore_stats *total){
+    const volatile struct lcore_stats *st;
+    unsigned lcore_id;
+    int i;
 
-    for(i = 0 ; i < nb_pkts ; i++){
-        if( (drop_mask & (1<<i)) == 0 ){
-            sent = rte_eth_tx_buffer(tx_port,tx_q,tx_buffer,mbufs[i]);
-            if(sent)
-                sfcapp_cfg.tx_pkts += sent;
-        }else
-            sfcapp_cfg.dropped_pkts++;
+    memset(total,0,sizeof(*total));
+
+    RTE_LCORE_FOREACH(lcore_id){
+        st = &sfcapp_cfg.lcores[lcore_id].stats;
+
+        for(i = 0 ; i < MAX_NB_PORTS ; i++){
+            total->port[i].rx_pkts += st->port[i].rx_pkts;
+            total->port[i].tx_pkts += st->port[i].tx_pkts;
+        }
+
+        for(i = 0 ; i < DROP_NB_REASONS ; i++)
+            total->drops[i] += st->drops[i];
+
+        for(i = 0 ; i < STATS_CYCLES_BUCKETS ; i++)
+            total->burst_cycles[i] += st->burst_cycles[i];
+
+        total->nb_bursts += st->nb_bursts;
+        total->busy_cycles += st->busy_cycles;
     }
 }
 
+/* Counters at the last reset. Workers' counters are never written
+ * by anyone else; a reset only moves this baseline. */
+static struct lcore_stats stats_base;
+
+void common_stats_print(FILE *f){
+    struct lcore_stats now;
+    uint64_t rx, tx, drops;
+    int i;
+
+    common_stats_read(&now);
+
+    rx = tx = drops = 0;
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        fprintf(f,"Port %" PRIu32 ": %" PRIu64 " packets received, %" PRIu64 " transmitted\n",
+            sfcapp_cfg.ports[i].id,
+            now.port[i].rx_pkts - stats_base.port[i].rx_pkts,
+            now.port[i].tx_pkts - stats_base.port[i].tx_pkts);
+        rx += now.port[i].rx_pkts - stats_base.port[i].rx_pkts;
+        tx += now.port[i].tx_pkts - stats_base.port[i].tx_pkts;
+    }
+
+    for(i = 0 ; i < DROP_NB_REASONS ; i++)
+        drops += now.drops[i] - stats_base.drops[i];
+
+    fprintf(f,"%" PRIu64 " packets received\n%" PRIu64 " packets transmitted\n"
+        "%" PRIu64 " packets dropped\n",rx,tx,drops);
+
+    for(i = 0 ; i < DROP_NB_REASONS ; i++)
+        fprintf(f,"  %" PRIu64 " %s\n",now.drops[i] - stats_base.drops[i],
+            common_drop_reason_names[i]);
+
+    if(rx > 0)
+        fprintf(f,"%" PRIu64 " cycles per packet handled\n",
+            (now.busy_cycles - stats_base.busy_cycles) / rx);
+
+    latency_print(f);
+    pipeline_print(f);
+
+    if(sfcapp_cfg.print_stats != NULL)
+        sfcapp_cfg.print_stats(f);
+}
+
+void common_stats_reset(void){
+    common_stats_read(&stats_base);
+}
+
 static void sprint_ipv4(uint32_t ip, char* buffer){
     uint8_t a,b,c,d;
     a = (ip>>24);
@@ -66,19 +161,28 @@ void common_print_ipv4_5tuple(struct ipv4_5tuple *tuple){
            tuple->src_port,tuple->dst_port);
 }
 
+void common_print_ipv6_5tuple(struct ipv6_5tuple *tuple){
+    char ip1[INET6_ADDRSTRLEN],ip2[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6,tuple->src_ip,ip1,sizeof(ip1));
+    inet_ntop(AF_INET6,tuple->dst_ip,ip2,sizeof(ip2));
+
+    printf("<ipsrc: %s, ipdst: %s, proto: %02" PRIu8 ", psrc: %" PRIu16 
+           ", pdst: %" PRIu16 ">",ip1,ip2,tuple->proto,
+           tuple->src_port,tuple->dst_port);
+}
+
 int common_ipv4_get_5tuple(struct rte_mbuf *mbuf, struct ipv4_5tuple *tuple, uint16_t offset){
     struct ipv4_hdr *ipv4_hdr;
     struct tcp_hdr *tcp_hdr;
     struct udp_hdr *udp_hdr;
     struct ether_hdr *eth_hdr;
 
-    eth_hdr = rte_pktmbuf_mtod(mbuf,struct ether_hdr *);
+    eth_hdr = rte_pktmbuf_mtod_offset(mbuf,struct ether_hdr *,offset);
 
     if(rte_be_to_cpu_16(eth_hdr->ether_type) != ETHER_TYPE_IPv4)
         return -1;
 
-    ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,struct ipv4_hdr *,
-                    (offset + sizeof(struct ether_hdr)));
+    ipv4_hdr = (struct ipv4_hdr *) (eth_hdr + 1);
 
 
     tuple->src_ip = rte_be_to_cpu_32(ipv4_hdr->src_addr);
@@ -105,7 +209,166 @@ int common_ipv4_get_5tuple(struct rte_mbuf *mbuf, struct ipv4_5tuple *tuple, uin
     return 0;
 }
 
-void common_mac_update(struct rte_mbuf *mbuf, struct ether_addr *src, struct ether_addr *dst){
+uint64_t common_ipv4_get_5tuple_bulk(struct rte_mbuf **mbufs, struct ipv4_5tuple *tuples, 
+    const void **tuple_ptrs, uint16_t nb_pkts, uint16_t offset){
+    uint16_t i;
+    uint64_t valid_mask = 0;
+
+    common_prefetch_burst(mbufs,nb_pkts);
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        common_prefetch_next(mbufs,i,nb_pkts);
+        tuple_ptrs[i] = &tuples[i];
+
+        if(likely(common_ipv4_get_5tuple(mbufs[i],&tuples[i],offset) == 0))
+            valid_mask |= (1ULL << i);
+        else
+            memset(&tuples[i],0,sizeof(struct ipv4_5tuple));
+    }
+
+    return valid_mask;
+}
+
+int common_ipv6_get_5tuple(struct rte_mbuf *mbuf, struct ipv6_5tuple *tuple, uint16_t offset){
+    const struct ether_hdr *eth_hdr;
+    const struct ipv6_hdr *ipv6_hdr;
+    const uint8_t *l4, *end;
+    uint16_t frag_off;
+    int n;
+
+    if(unlikely(rte_pktmbuf_data_len(mbuf) < offset + sizeof(struct ether_hdr) +
+                sizeof(struct ipv6_hdr)))
+        return -1;
+
+    eth_hdr = rte_pktmbuf_mtod_offset(mbuf,struct ether_hdr *,offset);
+
+    if(rte_be_to_cpu_16(eth_hdr->ether_type) != ETHER_TYPE_IPv6)
+        return -1;
+
+    ipv6_hdr = (const struct ipv6_hdr *) (eth_hdr + 1);
+    end = rte_pktmbuf_mtod(mbuf,const uint8_t *) + rte_pktmbuf_data_len(mbuf);
+
+    memcpy(tuple->src_ip,ipv6_hdr->src_addr,IPV6_ADDR_LEN);
+    memcpy(tuple->dst_ip,ipv6_hdr->dst_addr,IPV6_ADDR_LEN);
+    tuple->proto = ipv6_hdr->proto;
+    tuple->src_port = 0;
+    tuple->dst_port = 0;
+
+    /* Every extension header starts with the next header and, except
+     * for fragments, its length */
+    l4 = (const uint8_t *) (ipv6_hdr + 1);
+    for(n = 0 ; n < IPV6_MAX_EXT_HDRS && l4 + 8 <= end ; n++){
+        switch(tuple->proto){
+            case IPV6_EXT_HOPOPTS:
+            case IPV6_EXT_ROUTING:
+            case IPV6_EXT_DSTOPTS:
+                tuple->proto = l4[0];
+                l4 += (l4[1] + 1) * 8;
+                continue;
+            case IPV6_EXT_AH:
+                tuple->proto = l4[0];
+                l4 += (l4[1] + 2) * 4;
+                continue;
+            case IPV6_EXT_FRAGMENT:
+                tuple->proto = l4[0];
+                frag_off = rte_be_to_cpu_16(*(const uint16_t *) (l4 + 2)) & 0xFFF8;
+                l4 += 8;
+                if(frag_off != 0)   /* No L4 header in this one */
+                    return 0;
+                continue;
+            default:
+                break;
+        }
+        break;
+    }
+
+    if((tuple->proto == IP_PROTO_UDP || tuple->proto == IP_PROTO_TCP) && l4 + 4 <= end){
+        tuple->src_port = rte_be_to_cpu_16(*(const uint16_t *) l4);
+        tuple->dst_port = rte_be_to_cpu_16(*(const uint16_t *) (l4 + 2));
+    }
+
+    return 0;
+}
+
+uint16_t common_ipv6_get_5tuple_bulk(struct rte_mbuf **mbufs, struct ipv6_5tuple *tuples,
+    const void **tuple_ptrs, uint16_t *idx, uint64_t *mask_v6, uint16_t nb_pkts,
+    uint64_t mask, uint16_t offset){
+    uint16_t i, n;
+
+    *mask_v6 = 0;
+
+    for(i = 0, n = 0 ; i < nb_pkts ; i++){
+        if((mask & (1ULL << i)) == 0 ||
+           common_ipv6_get_5tuple(mbufs[i],&tuples[i],offset) < 0)
+            continue;
+
+        tuple_ptrs[n] = &tuples[i];
+        idx[n++] = i;
+        *mask_v6 |= (1ULL << i);
+    }
+
+    return n;
+}
+
+uint16_t common_inner_offset(struct rte_mbuf *mbuf){
+    const struct ether_hdr *eth_hdr;
+    const struct ipv4_hdr *ipv4_hdr;
+    const struct udp_hdr *udp_hdr;
+    const struct vxlan_hdr *vxlan_hdr;
+    const struct nsh_hdr *nsh_hdr;
+    uint16_t nsh_len;
+    uint32_t flags;
+
+    if(unlikely(rte_pktmbuf_data_len(mbuf) < VXLAN_OUTER_HDR_LEN + sizeof(struct ether_hdr)))
+        return 0;
+
+    eth_hdr   = rte_pktmbuf_mtod(mbuf,struct ether_hdr *);
+    ipv4_hdr  = (const struct ipv4_hdr *) (eth_hdr + 1);
+    udp_hdr   = (const struct udp_hdr *) (ipv4_hdr + 1);
+    vxlan_hdr = (const struct vxlan_hdr *) (udp_hdr + 1);
+
+    if(eth_hdr->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+       ipv4_hdr->next_proto_id != IP_PROTO_UDP ||
+       udp_hdr->dst_port != rte_cpu_to_be_16(VXLAN_PORT))
+        return 0;
+
+    flags = rte_be_to_cpu_32(vxlan_hdr->vx_flags);
+    if(!(flags & VXLAN_NEXT_PROTOCOL_FLAG) || (flags & VXLAN_NEXT_MASK) != VXLAN_NEXT_NSH)
+        return VXLAN_OUTER_HDR_LEN;
+
+    /* Past the NSH metadata too */
+    nsh_hdr = (const struct nsh_hdr *) (vxlan_hdr + 1);
+    nsh_len = (rte_be_to_cpu_16(nsh_hdr->basic_info) & NSH_LENGTH_MASK) << 2;
+    if(unlikely(nsh_len < sizeof(struct nsh_hdr) ||
+                rte_pktmbuf_data_len(mbuf) < VXLAN_OUTER_HDR_LEN + nsh_len + sizeof(struct ether_hdr)))
+        return 0;
+
+    return VXLAN_OUTER_HDR_LEN + nsh_len;
+}
+
+/* The SPI is left out: packets coming back from an SF through the
+ * proxy carry no NSH header */
+uint32_t common_flow_hash(struct rte_mbuf *mbuf){
+    struct ipv4_5tuple tuple;
+    struct ipv6_5tuple tuple6;
+    uint16_t offset;
+
+    offset = common_inner_offset(mbuf);
+
+    if(likely(common_ipv4_get_5tuple(mbuf,&tuple,offset) == 0))
+        return common_ipv4_5tuple_hash(&tuple,0);
+
+    if(common_ipv6_get_5tuple(mbuf,&tuple6,offset) == 0)
+        return common_ipv6_5tuple_hash(&tuple6,0);
+
+    /* Tunneled non-IP traffic hashes on its outer headers */
+    if(offset != 0 && common_ipv4_get_5tuple(mbuf,&tuple,0) == 0)
+        return common_ipv4_5tuple_hash(&tuple,0);
+
+    return 0;
+}
+
+void common_mac_update(struct rte_mbuf *mbuf, const struct ether_addr *src, const struct ether_addr *dst){
     struct ether_hdr *eth_hdr;
 
     eth_hdr = rte_pktmbuf_mtod(mbuf,struct ether_hdr *);
@@ -152,51 +415,159 @@ int common_check_destination(struct rte_mbuf *mbuf, struct ether_addr *mac){
     */return res;
 }
 
-void common_vxlan_encap(struct rte_mbuf *mbuf){
-    struct ether_hdr *eth_hdr, *inner_ether;
+/* Incremental update of a checksum when a 16b field changes from
+ * old_val to new_val (RFC 1624). Values in network order. */
+static inline uint16_t cksum_update16(uint16_t cksum, uint16_t old_val, uint16_t new_val){
+    uint32_t sum;
+
+    sum = (uint16_t) ~cksum + (uint16_t) ~old_val + new_val;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
+
+void common_vxlan_tmpl_init(struct vxlan_tmpl *tmpl, uint16_t port_idx,
+    const struct ether_addr *dst_mac, uint32_t dst_ip, uint32_t vni){
+    const struct port_cfg *port = &sfcapp_cfg.ports[port_idx];
+    struct ether_hdr *eth_hdr;
     struct ipv4_hdr *ipv4_hdr;
     struct udp_hdr *udp_hdr;
     struct vxlan_hdr *vxlan_hdr;
-    uint16_t old_pkt_len;
-    uint32_t hash;
 
-    old_pkt_len = mbuf->pkt_len;
-    inner_ether = rte_pktmbuf_mtod(mbuf,struct ether_hdr *);
-    hash = rte_hash_crc(inner_ether,2*ETHER_ADDR_LEN,inner_ether->ether_type);
+    memset(tmpl,0,sizeof(*tmpl));
 
-    eth_hdr = (struct ether_hdr *) rte_pktmbuf_prepend(mbuf,sizeof(struct ether_hdr) + 
-        sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr) + 
-        sizeof(struct vxlan_hdr));
-    
+    eth_hdr   = (struct ether_hdr *) tmpl->hdr;
     ipv4_hdr  = (struct ipv4_hdr *) (((char*) eth_hdr) + sizeof(struct ether_hdr));
     udp_hdr   = (struct udp_hdr *) (((char*) ipv4_hdr) + sizeof(struct ipv4_hdr));
     vxlan_hdr = (struct vxlan_hdr *) ( ((char*) udp_hdr) + sizeof(struct udp_hdr));
 
-    /* Outer Ethernet must be updated by caller function later */
+    ether_addr_copy(&port->mac,&eth_hdr->s_addr);
+    ether_addr_copy(dst_mac,&eth_hdr->d_addr);
     eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
 
-    /* These are just placeholders for now.
-     * Currently all communication is done in L2.
-     */
     ipv4_hdr->version_ihl = IP_VHL_DEF;
-    ipv4_hdr->type_of_service = 0;
-    ipv4_hdr->fragment_offset = 0;
     ipv4_hdr->time_to_live = IP_DEFTTL;
-    ipv4_hdr->packet_id = 0;
-    ipv4_hdr->hdr_checksum = 0;
-    ipv4_hdr->src_addr = rte_cpu_to_be_32(IPv4(10,10,10,10));
-    ipv4_hdr->dst_addr = rte_cpu_to_be_32(IPv4(10,10,10,11));
     ipv4_hdr->next_proto_id = IP_PROTO_UDP;
-    ipv4_hdr->total_length = rte_cpu_to_be_16(mbuf->pkt_len - 
-        sizeof(struct ether_hdr));
+    ipv4_hdr->src_addr = rte_cpu_to_be_32(port->ip);
+    ipv4_hdr->dst_addr = rte_cpu_to_be_32(dst_ip);
+
+    /* Computed with total_length 0, patched per packet */
+    tmpl->ip_cksum = rte_ipv4_cksum(ipv4_hdr);
 
-    udp_hdr->dgram_cksum = 0;
-    udp_hdr->dgram_len = rte_cpu_to_be_16(old_pkt_len + 
-        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr));
     udp_hdr->dst_port = rte_cpu_to_be_16(VXLAN_PORT);
-    udp_hdr->src_port = rte_cpu_to_be_16((((uint64_t) hash * PORT_RANGE) >> 32)
-					+ PORT_MIN);
 
     vxlan_hdr->vx_flags = rte_cpu_to_be_32(VXLAN_INSTANCE_FLAG);
-    vxlan_hdr->vx_vni = rte_cpu_to_be_32(SFCAPP_DEFAULT_VNI << 8);
+    vxlan_hdr->vx_vni = rte_cpu_to_be_32(vni << 8);
+}
+
+void common_vxlan_build_tmpl(uint16_t port_idx, const struct ether_addr *dst_mac,
+    uint32_t dst_ip, uint32_t vni){
+    common_vxlan_tmpl_init(&sfcapp_cfg.ports[port_idx].vxlan_tmpl,port_idx,
+        dst_mac,dst_ip,vni);
+}
+
+/* Sets the outer IPv4 checksum of a packet whose header was copied
+ * from tmpl and has total_length ip_len (network order) */
+static inline void vxlan_set_cksum(struct rte_mbuf *mbuf, struct ipv4_hdr *ipv4_hdr,
+    const struct vxlan_tmpl *tmpl, uint16_t port_idx, uint16_t ip_len){
+
+    if(sfcapp_cfg.ports[port_idx].tx_ip_cksum){
+        mbuf->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+        mbuf->l2_len = sizeof(struct ether_hdr);
+        mbuf->l3_len = sizeof(struct ipv4_hdr);
+        ipv4_hdr->hdr_checksum = 0;
+    }else{
+        mbuf->ol_flags &= ~PKT_TX_IP_CKSUM;
+        ipv4_hdr->hdr_checksum = cksum_update16(tmpl->ip_cksum,0,ip_len);
+    }
+}
+
+static inline uint16_t vxlan_src_port(uint32_t flow_hash){
+    return rte_cpu_to_be_16((((uint64_t) flow_hash * PORT_RANGE) >> 32)
+					+ PORT_MIN);
+}
+
+int common_vxlan_encap(struct rte_mbuf *mbuf, uint16_t port_idx, uint32_t flow_hash){
+    const struct port_cfg *port = &sfcapp_cfg.ports[port_idx];
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ipv4_hdr;
+    struct udp_hdr *udp_hdr;
+    uint16_t inner_len, ip_len;
+
+    inner_len = mbuf->pkt_len;
+
+    eth_hdr = (struct ether_hdr *) rte_pktmbuf_prepend(mbuf,VXLAN_OUTER_HDR_LEN);
+    if(unlikely(eth_hdr == NULL))
+        return -1;
+
+    rte_memcpy(eth_hdr,port->vxlan_tmpl.hdr,VXLAN_OUTER_HDR_LEN);
+
+    ipv4_hdr  = (struct ipv4_hdr *) (((char*) eth_hdr) + sizeof(struct ether_hdr));
+    udp_hdr   = (struct udp_hdr *) (((char*) ipv4_hdr) + sizeof(struct ipv4_hdr));
+
+    ip_len = rte_cpu_to_be_16(inner_len + VXLAN_OUTER_HDR_LEN - sizeof(struct ether_hdr));
+    ipv4_hdr->total_length = ip_len;
+
+    udp_hdr->dgram_len = rte_cpu_to_be_16(inner_len + 
+        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr));
+    udp_hdr->src_port = vxlan_src_port(flow_hash);
+
+    vxlan_set_cksum(mbuf,ipv4_hdr,&port->vxlan_tmpl,port_idx,ip_len);
+
+    return 0;
+}
+
+/* The UDP checksum of VXLAN packets is always 0 */
+void common_vxlan_set_src_port(struct rte_mbuf *mbuf, uint32_t flow_hash){
+    struct udp_hdr *udp_hdr;
+
+    udp_hdr = rte_pktmbuf_mtod_offset(mbuf,struct udp_hdr *,
+        sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+    udp_hdr->src_port = vxlan_src_port(flow_hash);
+}
+
+void common_vxlan_rewrite(struct rte_mbuf *mbuf, const struct vxlan_tmpl *tmpl, uint16_t port_idx){
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ipv4_hdr;
+    struct vxlan_hdr *vxlan_hdr;
+    const struct vxlan_hdr *tmpl_vxlan;
+    uint16_t ip_len;
+
+    eth_hdr   = rte_pktmbuf_mtod(mbuf,struct ether_hdr *);
+    ipv4_hdr  = (struct ipv4_hdr *) (((char*) eth_hdr) + sizeof(struct ether_hdr));
+    vxlan_hdr = (struct vxlan_hdr *) (((char*) ipv4_hdr) + sizeof(struct ipv4_hdr) +
+        sizeof(struct udp_hdr));
+    tmpl_vxlan = (const struct vxlan_hdr *) (tmpl->hdr + VXLAN_OUTER_HDR_LEN -
+        sizeof(struct vxlan_hdr));
+
+    ip_len = ipv4_hdr->total_length;
+
+    rte_memcpy(eth_hdr,tmpl->hdr,sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+    ipv4_hdr->total_length = ip_len;
+    vxlan_hdr->vx_vni = tmpl_vxlan->vx_vni;
+
+    vxlan_set_cksum(mbuf,ipv4_hdr,tmpl,port_idx,ip_len);
+}
+
+void common_vxlan_adjust_len(struct rte_mbuf *mbuf, int16_t delta){
+    struct ipv4_hdr *ipv4_hdr;
+    struct udp_hdr *udp_hdr;
+    uint16_t old_len, new_len;
+
+    ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,struct ipv4_hdr *,sizeof(struct ether_hdr));
+    udp_hdr  = (struct udp_hdr *) (((char*) ipv4_hdr) + sizeof(struct ipv4_hdr));
+
+    old_len = ipv4_hdr->total_length;
+    new_len = rte_cpu_to_be_16(rte_be_to_cpu_16(old_len) + delta);
+    ipv4_hdr->total_length = new_len;
+
+    /* Left to the NIC if set by common_vxlan_encap(), not used if 0 */
+    if((mbuf->ol_flags & PKT_TX_IP_CKSUM) == 0 && ipv4_hdr->hdr_checksum != 0)
+        ipv4_hdr->hdr_checksum = cksum_update16(ipv4_hdr->hdr_checksum,old_len,new_len);
+
+    /* VXLAN senders should not set the UDP checksum anyway,
+     * just drop it instead of recomputing over the payload. */
+    udp_hdr->dgram_len = rte_cpu_to_be_16(rte_be_to_cpu_16(udp_hdr->dgram_len) + delta);
+    udp_hdr->dgram_cksum = 0;
 }
\ No newline at end of file
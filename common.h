@@ -1,41 +1,65 @@
 #ifndef SFCAPP_COMMON_
 #define SFCAPP_COMMON_
 
+#include <stdio.h>
+
 #include <rte_cfgfile.h>
+#include <rte_common.h>
+#include <rte_lcore.h>
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
 #include <rte_tcp.h>
 #include <rte_udp.h>
+#include <rte_hash_crc.h>
+#include <rte_prefetch.h>
 
 #define MEMPOOL_CACHE_SIZE 256
 
 #define NB_MBUF 4096 /* I might change this value later*/
-#define NB_RX_QS 1
-#define NB_TX_QS 1
+/* Defaults of the runtime parameters, see struct sfcapp_params */
 #define NB_RX_DESC 2048
 #define NB_TX_DESC 2048
 #define BURST_SIZE 64
+/* Upper bound of the burst size. Handlers keep per-burst state in
+ * MAX_BURST_SIZE arrays and 64-bit packet masks. */
+#define MAX_BURST_SIZE 64
+#define PREFETCH_DISTANCE 4 /* Packets prefetched ahead of the one handled */
 #define BURST_TX_DRAIN_US 100
-#define MAX_NB_PORTS 2
+#define MAX_NB_PORTS 8
+#define SFF_PORT_DEFAULT UINT16_MAX /* sff_port not set, see the types' setup */
 
 #define TX_BUFFER_SIZE 1024
 
 #define IP_PROTO_UDP 0x11
 #define IP_PROTO_TCP 0x06
 
+/* IPv6 extension headers skipped to reach the L4 ports */
+#define IPV6_EXT_HOPOPTS  0
+#define IPV6_EXT_ROUTING  43
+#define IPV6_EXT_FRAGMENT 44
+#define IPV6_EXT_AH       51
+#define IPV6_EXT_DSTOPTS  60
+#define IPV6_MAX_EXT_HDRS 4     /* Longer chains are not parsed */
+#define IPV6_ADDR_LEN     16
+
 #define VXLAN_PORT 4789
 
+/* Outer Ethernet + IPv4 + UDP + VXLAN(-GPE) headers */
+#define VXLAN_OUTER_HDR_LEN (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + \
+        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr))
+
+/* Outer tunnel used when no VTEP is configured */
+#define VXLAN_DEFAULT_SRC_IP IPv4(10,10,10,10)
+#define VXLAN_DEFAULT_DST_IP IPv4(10,10,10,11)
+#define VXLAN_DEFAULT_VNI 1000
+#define VXLAN_MAX_VNI 0xFFFFFF
+
 #define CFG_FILE_MAX_SECTIONS 1024
+#define CFG_SECTION_MAX_ENTRIES 32
 
 #define SFCAPP_CHECK_FAIL_LT(var,val,msg) do { if(var < val) rte_exit(EXIT_FAILURE,msg); } while(0)
 
-#define COND_MARK_DROP(lkp,drop) \
-        if(unlikely(lkp < 0)){ \
-            /*printf("Dropping packet!\n");*/ \
-            drop = 1; \
-            continue; \
-        }
 
 struct ipv4_5tuple {
     uint8_t proto;
@@ -45,15 +69,127 @@ struct ipv4_5tuple {
     uint16_t  dst_port;
 } __attribute__((__packed__));
 
+/* Keys of the IPv6 tables, kept apart so that IPv4 lookups hash and
+ * compare 13 bytes only */
+struct ipv6_5tuple {
+    uint8_t proto;              /* Upper-layer protocol, past extension headers */
+    uint8_t src_ip[IPV6_ADDR_LEN];
+    uint8_t dst_ip[IPV6_ADDR_LEN];
+    uint16_t src_port;
+    uint16_t dst_port;
+} __attribute__((__packed__));
+
+/* Reasons a packet is dropped, counted separately */
+enum sfcapp_drop_reason {
+    DROP_NO_MATCH,          /* No table entry for the flow or <SPI,SI> */
+    DROP_SI_EXHAUSTED,      /* Service Index reached 0 */
+    DROP_NOT_IPV4,          /* Inner packet is neither IPv4 nor IPv6 */
+    DROP_TX_FULL,           /* TX queue full when flushing */
+    DROP_ENCAP_ERROR,       /* NSH encap/decap failed */
+    DROP_RING_FULL,         /* Pipeline ring full */
+    DROP_BAD_NSH,           /* NSH length not valid for its MD type */
+    DROP_NB_REASONS
+};
+
+#define STATS_CYCLES_BUCKETS 24
+
+struct port_stats {
+    uint64_t rx_pkts;
+    uint64_t tx_pkts;
+};
+
+/* Counters of one worker. Only the owning lcore writes them, so no
+ * atomics are needed; other lcores may read them at any time, which
+ * is safe since aligned 64-bit loads and stores are not torn. */
+struct lcore_stats {
+    struct port_stats port[MAX_NB_PORTS];
+    uint64_t drops[DROP_NB_REASONS];
+    uint64_t nb_bursts;                 /* Non-empty bursts handled */
+    uint64_t busy_cycles;               /* TSC cycles spent handling them */
+    uint64_t burst_cycles[STATS_CYCLES_BUCKETS];
+    /* Bursts by handling time, bucket i counts the ones that took
+     * 2^i to 2^(i+1)-1 cycles, the last one everything above */
+} __rte_cache_aligned;
+
+enum lcore_role {
+    LCORE_RUN_TO_COMPLETION,    /* RX, handling and TX on its own queues */
+    LCORE_RX,                   /* Pipeline: RX queue to the workers' rings */
+    LCORE_WORKER,               /* Pipeline: handling, from and to rings */
+    LCORE_TX,                   /* Pipeline: TX rings of its ports to TX queue 0 */
+};
+
+/* Packets staged by a pipeline worker, enqueued to ring in bulk */
+struct ring_buffer {
+    struct rte_ring *ring;
+    uint16_t size;
+    uint16_t length;
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+};
+
+/* Per-worker state. Each enabled lcore runs its own copy of the
+ * main loop and owns RX/TX queue pair queue_id on every port, so
+ * workers never share a queue or a TX buffer. In pipeline mode, see
+ * pipeline.h, only RX lcores own an RX queue. */
+struct lcore_cfg {
+    uint16_t queue_id;
+    enum lcore_role role;
+    unsigned socket_id;         /* NUMA socket of the lcore */
+    struct rte_eth_dev_tx_buffer *tx_buffer[MAX_NB_PORTS];
+    struct ring_buffer *tx_ring[MAX_NB_PORTS];  /* Pipeline workers only */
+    struct lcore_stats stats;
+} __rte_cache_aligned;
+
+/* Outer headers added by common_vxlan_encap(), built once per egress
+ * port. Only lengths, UDP source port and checksum change per packet. */
+struct vxlan_tmpl {
+    uint8_t hdr[RTE_ALIGN_CEIL(VXLAN_OUTER_HDR_LEN,16)];
+    uint16_t ip_cksum;          /* IPv4 checksum with total_length 0 */
+} __rte_aligned(16);
+
 struct port_cfg {
     uint32_t id;
-    uint32_t ip;
+    uint32_t ip;                /* Local VTEP address, host order */
     struct ether_addr mac;
-    struct rte_eth_dev_tx_buffer *tx_buffer;
+    uint8_t tx_ip_cksum;        /* NIC computes outer IPv4 checksums */
+    unsigned socket_id;         /* NUMA socket of the NIC */
+    struct vxlan_tmpl vxlan_tmpl;
     /* This function receives a an array of mbufs with received
      * packets, processes them and returns the number of packets
-     * transmitted, if any. */
-    int (*handle_pkts)(struct rte_mbuf **mbufs, uint16_t nb_pkts);
+     * transmitted, if any. lcore is the calling worker, whose
+     * queue and TX buffers must be used for transmission. */
+    int (*handle_pkts)(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts);
+};
+
+/* Parameters read at startup, before tables and pools are created.
+ * Set from the global section of the config file and overridden
+ * from the command line, see parse_param(). */
+struct sfcapp_params {
+    uint32_t nb_rx_desc;                /* RX descriptors per queue */
+    uint32_t nb_tx_desc;                /* TX descriptors per queue */
+    uint32_t burst_size;                /* RX burst and TX buffer size */
+    uint32_t nb_mbuf;                   /* Mbuf pool size per socket, 0 to compute it */
+    uint32_t classifier_max_flows;      /* Classifier exact-match table size */
+    uint32_t classifier_max_flows6;     /* Same for IPv6 flows */
+    uint32_t forwarder_table_size;      /* Max forwarder SFC_NODE and SF entries */
+    uint32_t proxy_max_flows;           /* Proxy flow table size */
+    uint32_t proxy_max_flows6;          /* Same for IPv6 flows */
+    uint32_t proxy_max_functions;       /* Max proxy SFC_NODE and SF entries */
+    uint32_t proxy_flow_timeout_ms;     /* Idle flow timeout, 0 disables aging */
+    uint32_t bench_pkts;                /* Packets per worker in bench mode, 0 disables it */
+    uint32_t bench_flows;               /* Flows generated in bench mode */
+    uint32_t bench_sph;                 /* <SPI,SI> of generated NSH packets */
+    uint32_t bench_pkt_len;             /* Inner frame length of generated packets */
+    uint32_t gen_rate;                  /* Generator packets per second, 0 for line rate */
+    uint32_t gen_encap;                 /* Generator sends VXLAN-GPE+NSH if set, else IPv4 */
+    uint32_t gen_paths;                 /* SPIs generated flows are spread among */
+    uint32_t latency;                   /* Record latency histograms if set */
+    uint32_t pipeline_workers;          /* Pipeline worker lcores, 0 for run-to-completion */
+    uint32_t pipeline_tx;               /* Pipeline TX lcores, at most one per port */
+    uint32_t pipeline_ring_size;        /* Slots of each pipeline ring, a power of 2 */
+    uint32_t pipeline_batch;            /* Packets moved through rings at once */
+    uint32_t prefetch_distance;         /* Packets prefetched ahead by handlers, 0 disables it */
+    uint32_t classifier_md;             /* NSH MD type stamped by the classifier, 0 for none */
+    uint32_t proxy_mode;                /* How the proxy recovers NSH headers, see enum proxy_mode */
 };
 
 enum sfcapp_type {
@@ -61,35 +197,177 @@ enum sfcapp_type {
     SFC_CLASSIFIER,
     SFC_FORWARDER,
     SFC_LOOPBACK,
+    SFC_GENERATOR,
     NONE
 };
 
 struct sfcapp_config {
     struct port_cfg ports[MAX_NB_PORTS];
     uint16_t nb_ports;
+    struct lcore_cfg lcores[RTE_MAX_LCORE];
+    uint16_t nb_queues;                 /* RX/TX queue pairs per port */
+    /* Non-zero for the NUMA sockets running enabled lcores, which get
+     * their own copy of the read-mostly tables */
+    uint8_t lcore_sockets[RTE_MAX_NUMA_NODES];
     struct ether_addr sff_addr;         /* MAC address of SFF */
+    uint32_t sff_ip;                    /* SFF VTEP address, 0 if not set */
+    uint32_t sff_vni;                   /* VNI used towards the SFF */
+    uint16_t sff_port;                  /* Port index towards the SFF */
     enum sfcapp_type type;              /* SFC entity type */
+    struct sfcapp_params params;
     void (*main_loop)(void);
-    uint64_t rx_pkts, tx_pkts, dropped_pkts;
+    /* Called by every worker between bursts, if set. Must do a
+     * small, bounded amount of work. */
+    void (*housekeeping)(struct lcore_cfg *lcore);
+    /* Prints counters specific to the type of application, if set */
+    void (*print_stats)(FILE *f);
+    /* Prints the usage of the application's tables as JSON object
+     * members, if set. Called from the control thread. */
+    void (*print_tables)(FILE *f);
 };
 
 /*struct rte_cfgfile_parameters sfcapp_cfgfile_parameters = {
     .comment_character = '#'
 };*/
 
-void common_flush_tx_buffers(void);
+extern struct sfcapp_config sfcapp_cfg;
+
+extern const char *const common_drop_reason_names[DROP_NB_REASONS];
+
+/* Frees a packet that will not be transmitted */
+static inline void
+common_drop_pkt(struct lcore_cfg *lcore, struct rte_mbuf *mbuf, enum sfcapp_drop_reason reason){
+    rte_pktmbuf_free(mbuf);
+    lcore->stats.drops[reason]++;
+}
+
+/* Prefetches the first two cache lines of the packet data of mbuf,
+ * enough for the outer headers, NSH and inner IPv4 and L4 headers */
+static inline void
+common_prefetch_pkt(struct rte_mbuf *mbuf){
+    const char *data = rte_pktmbuf_mtod(mbuf,const char *);
+
+    rte_prefetch0(data);
+    rte_prefetch0(data + RTE_CACHE_LINE_SIZE);
+}
+
+/* Handlers walking a burst call common_prefetch_burst() once, then
+ * common_prefetch_next() for every packet i they handle, so that the
+ * headers of packet i + prefetch_distance are loaded meanwhile. */
+static inline void
+common_prefetch_burst(struct rte_mbuf **mbufs, uint16_t nb_pkts){
+    uint16_t i, n = RTE_MIN(nb_pkts,sfcapp_cfg.params.prefetch_distance);
 
-void send_pkts(struct rte_mbuf **mbufs, uint8_t tx_port, uint16_t tx_q, struct rte_eth_dev_tx_buffer* tx_buffer,
- uint16_t nb_pkts, uint64_t drop_mask);
+    for(i = 0 ; i < n ; i++)
+        common_prefetch_pkt(mbufs[i]);
+}
+
+static inline void
+common_prefetch_next(struct rte_mbuf **mbufs, uint16_t i, uint16_t nb_pkts){
+    const uint16_t next = i + sfcapp_cfg.params.prefetch_distance;
+
+    if(next != i && next < nb_pkts)
+        common_prefetch_pkt(mbufs[next]);
+}
+
+/* Enqueues the packets staged by a pipeline worker for port_idx to
+ * the TX lcore, dropping those that do not fit. Returns the number
+ * of packets enqueued. */
+uint16_t common_flush_tx_ring(struct lcore_cfg *lcore, uint16_t port_idx);
+
+/* Enqueues mbuf for transmission on port sfcapp_cfg.ports[port_idx]
+ * using the queue and TX buffer owned by the calling worker.
+ * Returns the number of packets actually sent, if any. Pipeline
+ * workers hand packets to the TX lcore instead, which counts them
+ * once sent. */
+static inline uint16_t
+common_tx_pkt(struct lcore_cfg *lcore, uint16_t port_idx, struct rte_mbuf *mbuf){
+    struct ring_buffer *rb = lcore->tx_ring[port_idx];
+    uint16_t sent;
+
+    if(rb != NULL){
+        rb->pkts[rb->length++] = mbuf;
+        return rb->length < rb->size ? 0 : common_flush_tx_ring(lcore,port_idx);
+    }
+
+    sent = rte_eth_tx_buffer(sfcapp_cfg.ports[port_idx].id,lcore->queue_id,
+        lcore->tx_buffer[port_idx],mbuf);
+    lcore->stats.port[port_idx].tx_pkts += sent;
+
+    return sent;
+}
+
+/* Accounts for a burst handled by the calling worker in cycles
+ * TSC cycles */
+static inline void
+common_stats_burst(struct lcore_cfg *lcore, uint64_t cycles){
+    unsigned bucket = cycles == 0 ? 0 : 63 - __builtin_clzll(cycles);
+
+    lcore->stats.burst_cycles[RTE_MIN(bucket,STATS_CYCLES_BUCKETS - 1)]++;
+    lcore->stats.nb_bursts++;
+    lcore->stats.busy_cycles += cycles;
+}
+
+void common_flush_tx_buffers(struct lcore_cfg *lcore);
+
+/* Sums the counters of all workers into total. Does not stop or
+ * synchronize with the workers, so the result is approximate while
+ * traffic is flowing. */
+void common_stats_read(struct lcore_stats *total);
+
+/* Prints the counters accumulated since the last reset to f */
+void common_stats_print(FILE *f);
+
+void common_stats_reset(void);
 
 void common_print_ipv4_5tuple(struct ipv4_5tuple *tuple);
 
+void common_print_ipv6_5tuple(struct ipv6_5tuple *tuple);
+
+/* Both return -1 if the Ethernet header at offset is not of their
+ * IP version */
 int common_ipv4_get_5tuple(struct rte_mbuf *mbuf, struct ipv4_5tuple *tuple, uint16_t offset);
 
-void common_ipv4_get_5tuple_bulk(struct rte_mbuf **mbufs, struct ipv4_5tuple *tuples, 
-    struct ipv4_5tuple **tuple_ptrs, uint16_t nb_pkts);
+/* Ports are 0 for non-first fragments and protocols without ports */
+int common_ipv6_get_5tuple(struct rte_mbuf *mbuf, struct ipv6_5tuple *tuple, uint16_t offset);
+
+/* Extracts the 5-tuples of a burst of packets, to be used as keys for
+ * rte_hash bulk lookups, prefetching packets ahead. tuple_ptrs[i]
+ * always points to tuples[i]; the tuple of a non-IPv4 packet is
+ * zeroed. Returns a bitmask with the bit of each IPv4 packet set.
+ * nb_pkts must not exceed 64. */
+uint64_t common_ipv4_get_5tuple_bulk(struct rte_mbuf **mbufs, struct ipv4_5tuple *tuples, 
+    const void **tuple_ptrs, uint16_t nb_pkts, uint16_t offset);
+
+/* Extracts the IPv6 5-tuples of the packets of mask, usually those
+ * that were not IPv4. tuples is indexed like mbufs; tuple_ptrs and
+ * idx get the tuple and burst index of each IPv6 packet, packed for
+ * a bulk lookup, and mask_v6 their bits. Returns their number. */
+uint16_t common_ipv6_get_5tuple_bulk(struct rte_mbuf **mbufs, struct ipv6_5tuple *tuples,
+    const void **tuple_ptrs, uint16_t *idx, uint64_t *mask_v6, uint16_t nb_pkts,
+    uint64_t mask, uint16_t offset);
+
+/* Hash of a 5-tuple, seeded with init. Used to pick the outer UDP
+ * source port of a tunneled flow and the worker handling it. */
+static inline uint32_t common_ipv4_5tuple_hash(const struct ipv4_5tuple *tuple, uint32_t init){
+    return rte_hash_crc(tuple,sizeof(*tuple),init);
+}
+
+static inline uint32_t common_ipv6_5tuple_hash(const struct ipv6_5tuple *tuple, uint32_t init){
+    return rte_hash_crc(tuple,sizeof(*tuple),init);
+}
+
+/* Returns the offset of the inner Ethernet header of a VXLAN(-GPE)
+ * packet, past the NSH header and metadata if there is one, or 0 if
+ * mbuf is not VXLAN */
+uint16_t common_inner_offset(struct rte_mbuf *mbuf);
 
-void common_mac_update(struct rte_mbuf *mbuf, struct ether_addr *src, struct ether_addr *dst);
+/* Hash of the innermost 5-tuple of mbuf, tunneled or not, so that both
+ * directions of a flow through the proxy hash alike. Returns 0 if the
+ * packet is neither IPv4 nor IPv6. */
+uint32_t common_flow_hash(struct rte_mbuf *mbuf);
+
+void common_mac_update(struct rte_mbuf *mbuf, const struct ether_addr *src, const struct ether_addr *dst);
 
 void common_dump_pkt(struct rte_mbuf *mbuf, const char *msg);
 
@@ -99,6 +377,32 @@ void common_64_to_mac(uint64_t val, struct ether_addr *mac);
 
 int common_check_destination(struct rte_mbuf *mbuf, struct ether_addr *mac);
 
-void common_vxlan_encap(struct rte_mbuf *mbuf);
+/* Builds the VXLAN-GPE outer headers of a tunnel from the local VTEP
+ * of port port_idx to dst_ip. Addresses in host order. */
+void common_vxlan_tmpl_init(struct vxlan_tmpl *tmpl, uint16_t port_idx,
+    const struct ether_addr *dst_mac, uint32_t dst_ip, uint32_t vni);
+
+/* Builds the default tunnel of sfcapp_cfg.ports[port_idx], used by
+ * common_vxlan_encap() */
+void common_vxlan_build_tmpl(uint16_t port_idx, const struct ether_addr *dst_mac,
+    uint32_t dst_ip, uint32_t vni);
+
+/* Prepends the outer headers of port port_idx to mbuf, with a UDP
+ * source port derived from flow_hash. Returns -1 if there is no
+ * headroom left. */
+int common_vxlan_encap(struct rte_mbuf *mbuf, uint16_t port_idx, uint32_t flow_hash);
+
+/* Sets the outer UDP source port of a VXLAN packet from flow_hash, so
+ * that the receiving NIC spreads flows among its queues */
+void common_vxlan_set_src_port(struct rte_mbuf *mbuf, uint32_t flow_hash);
+
+/* Moves an already encapsulated packet to the tunnel described by
+ * tmpl, to be sent on port port_idx. Outer MACs, IPs and VNI are
+ * replaced; lengths, UDP ports and VXLAN flags are kept. */
+void common_vxlan_rewrite(struct rte_mbuf *mbuf, const struct vxlan_tmpl *tmpl, uint16_t port_idx);
+
+/* Adds delta bytes to the outer IPv4 and UDP lengths of a VXLAN
+ * packet, keeping the IPv4 checksum valid if one is set. */
+void common_vxlan_adjust_len(struct rte_mbuf *mbuf, int16_t delta);
 
 #endif
\ No newline at end of file
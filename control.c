@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+#include <rte_log.h>
+
+#include "common.h"
+#include "parser.h"
+#include "telemetry.h"
+#include "control.h"
+
+struct control_client {
+    int fd;                             /* -1 if slot is free */
+    size_t len;                         /* Bytes received, not yet handled */
+    char buf[CONTROL_LINE_LEN];
+    uint16_t nb_pending;                /* Updates in the current batch */
+    int8_t pending[CONTROL_MAX_BATCH];  /* 0 if staged, -1 if rejected */
+};
+
+static const char *control_cfg_filename;
+
+static int control_reload_pipe[2] = { -1, -1 };
+/* Written by control_request_reload(), polled by the control thread */
+
+static int control_listen_fd = -1;
+
+static struct control_client control_clients[CONTROL_MAX_CLIENTS];
+
+static unsigned control_batch_size;
+/* Updates since parse_update_begin(), 0 if no batch is open */
+
+void control_request_reload(void){
+    const char req = 'r';
+    ssize_t ret;
+
+    /* Non-blocking, a full pipe already holds a request */
+    ret = write(control_reload_pipe[1],&req,1);
+    RTE_SET_USED(ret);
+}
+
+static void control_close(struct control_client *c){
+    close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+    c->nb_pending = 0;
+}
+
+/* A client not reading its replies is dropped rather than stalling
+ * the others */
+static void control_send(struct control_client *c, const char *msg, size_t len){
+    ssize_t ret;
+
+    if(c->fd < 0)
+        return;
+
+    ret = send(c->fd,msg,len,MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(ret < 0 || (size_t) ret != len)
+        control_close(c);
+}
+
+static void control_reply(struct control_client *c, int ret){
+    if(ret < 0)
+        control_send(c,"ERR\n",4);
+    else
+        control_send(c,"OK\n",3);
+}
+
+/* Swaps in the updates staged so far and answers them */
+static void control_commit(void){
+    char replies[CONTROL_MAX_BATCH*4];
+    struct control_client *c;
+    size_t len;
+    unsigned i, j;
+    int ret;
+
+    if(control_batch_size == 0)
+        return;
+
+    ret = parse_update_commit();
+    if(ret < 0)
+        RTE_LOG(ERR,USER1,"Failed to apply a batch of %u updates.\n",control_batch_size);
+
+    control_batch_size = 0;
+
+    for(i = 0 ; i < CONTROL_MAX_CLIENTS ; i++){
+        c = &control_clients[i];
+
+        for(j = 0, len = 0 ; j < c->nb_pending ; j++){
+            if(ret < 0 || c->pending[j] < 0){
+                memcpy(&replies[len],"ERR\n",4);
+                len += 4;
+            }else{
+                memcpy(&replies[len],"OK\n",3);
+                len += 3;
+            }
+        }
+
+        c->nb_pending = 0;
+
+        if(len > 0)
+            control_send(c,replies,len);
+    }
+}
+
+static void control_update(struct control_client *c, char *line){
+
+    if(control_batch_size == 0 && parse_update_begin() < 0){
+        control_reply(c,-1);
+        return;
+    }
+
+    c->pending[c->nb_pending++] = parse_update(line) < 0 ? -1 : 0;
+    control_batch_size++;
+
+    if(control_batch_size == CONTROL_MAX_BATCH)
+        control_commit();
+}
+
+static void control_stats(struct control_client *c){
+    char *buf;
+    size_t len;
+    FILE *f;
+
+    f = open_memstream(&buf,&len);
+    if(f == NULL){
+        control_reply(c,-1);
+        return;
+    }
+
+    common_stats_print(f);
+    fputs("OK\n",f);
+    fclose(f);
+
+    control_send(c,buf,len);
+    free(buf);
+}
+
+static void control_telemetry(struct control_client *c){
+    char *buf;
+    size_t len;
+    FILE *f;
+
+    f = open_memstream(&buf,&len);
+    if(f == NULL){
+        control_reply(c,-1);
+        return;
+    }
+
+    telemetry_print(f);
+    fputs("OK\n",f);
+    fclose(f);
+
+    control_send(c,buf,len);
+    free(buf);
+}
+
+static int control_reload(void){
+
+    /* Pending updates go first, they may be undone by the file */
+    control_commit();
+
+    printf("Reloading %s...\n",control_cfg_filename);
+
+    if(parse_config_file(control_cfg_filename) < 0){
+        RTE_LOG(ERR,USER1,"Reload failed, keeping current configuration.\n");
+        return -1;
+    }
+
+    printf("Configuration reloaded.\n");
+    return 0;
+}
+
+static void control_handle_line(struct control_client *c, char *line){
+
+    if(line[0] == '\0')
+        return;
+
+    if(strncmp(line,"add ",4) == 0 || strncmp(line,"del ",4) == 0){
+        control_update(c,line);
+    }else if(strcmp(line,"stats") == 0){
+        /* Answers must follow the order of commands */
+        control_commit();
+        control_stats(c);
+    }else if(strcmp(line,"telemetry") == 0){
+        control_commit();
+        control_telemetry(c);
+    }else if(strcmp(line,"reload") == 0){
+        control_reply(c,control_reload());
+    }else{
+        RTE_LOG(ERR,USER1,"Unknown control command: %s\n",line);
+        control_commit();
+        control_reply(c,-1);
+    }
+}
+
+static void control_read(struct control_client *c){
+    char *line, *end;
+    ssize_t n;
+
+    n = recv(c->fd,c->buf + c->len,sizeof(c->buf) - c->len,0);
+    if(n < 0 && errno == EINTR)
+        return;
+
+    if(n <= 0){
+        control_close(c);
+        return;
+    }
+
+    c->len += n;
+
+    for(line = c->buf ; (end = memchr(line,'\n',c->buf + c->len - line)) != NULL ; line = end + 1){
+        *end = '\0';
+        if(end > line && end[-1] == '\r')
+            end[-1] = '\0';
+
+        control_handle_line(c,line);
+
+        if(c->fd < 0)
+            return;
+    }
+
+    /* Keep the start of the next line */
+    c->len -= line - c->buf;
+    memmove(c->buf,line,c->len);
+
+    if(c->len == sizeof(c->buf)){
+        RTE_LOG(ERR,USER1,"Control command too long, closing connection.\n");
+        control_close(c);
+    }
+}
+
+static void control_accept(void){
+    int fd, i;
+
+    fd = accept4(control_listen_fd,NULL,NULL,SOCK_CLOEXEC);
+    if(fd < 0)
+        return;
+
+    for(i = 0 ; i < CONTROL_MAX_CLIENTS ; i++){
+        if(control_clients[i].fd < 0){
+            control_clients[i].fd = fd;
+            return;
+        }
+    }
+
+    RTE_LOG(WARNING,USER1,"Too many control clients, connection refused.\n");
+    close(fd);
+}
+
+static int control_listen(const char *path){
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    strcpy(addr.sun_path,path);
+
+    fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if(fd < 0)
+        return -1;
+
+    /* Left over by a previous run */
+    unlink(path);
+
+    if(bind(fd,(struct sockaddr *) &addr,sizeof(addr)) < 0 ||
+       listen(fd,CONTROL_MAX_CLIENTS) < 0){
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Serves reload requests and the control socket. Not done on a
+ * worker since table swaps wait for all of them to go through a
+ * quiescent state. */
+static void *control_thread_main(__rte_unused void *arg){
+    struct pollfd fds[2 + CONTROL_MAX_CLIENTS];
+    char drain[16];
+    int i, ret, timeout;
+
+    for(;;){
+        fds[0].fd = control_reload_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = control_listen_fd;      /* Ignored if -1 */
+        fds[1].events = POLLIN;
+
+        for(i = 0 ; i < CONTROL_MAX_CLIENTS ; i++){
+            fds[2 + i].fd = control_clients[i].fd;
+            fds[2 + i].events = POLLIN;
+        }
+
+        timeout = telemetry_poll();
+
+        /* An open batch is swapped in as soon as no more updates
+         * are waiting, so batches grow with the update rate */
+        if(control_batch_size > 0)
+            timeout = 0;
+
+        ret = poll(fds,RTE_DIM(fds),timeout);
+
+        if(ret < 0)
+            continue;
+
+        if(ret == 0){
+            control_commit();
+            continue;
+        }
+
+        if(fds[0].revents & POLLIN){
+            while(read(control_reload_pipe[0],drain,sizeof(drain)) > 0)
+                ;
+            control_reload();
+        }
+
+        if(fds[1].revents & POLLIN)
+            control_accept();
+
+        for(i = 0 ; i < CONTROL_MAX_CLIENTS ; i++){
+            if(fds[2 + i].revents != 0 && control_clients[i].fd >= 0)
+                control_read(&control_clients[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/* Keeps the control thread off the CPUs of the lcores, if there are
+ * spare ones */
+static void control_set_affinity(pthread_t tid){
+    rte_cpuset_t cpuset;
+    unsigned lcore_id;
+    long cpu, nb_cpus;
+
+    nb_cpus = RTE_MIN(sysconf(_SC_NPROCESSORS_ONLN),(long) CPU_SETSIZE);
+
+    CPU_ZERO(&cpuset);
+    for(cpu = 0 ; cpu < nb_cpus ; cpu++)
+        CPU_SET(cpu,&cpuset);
+
+    RTE_LCORE_FOREACH(lcore_id){
+        for(cpu = 0 ; cpu < nb_cpus ; cpu++)
+            if(CPU_ISSET(cpu,&lcore_config[lcore_id].cpuset))
+                CPU_CLR(cpu,&cpuset);
+    }
+
+    if(CPU_COUNT(&cpuset) > 0)
+        pthread_setaffinity_np(tid,sizeof(cpuset),&cpuset);
+    else
+        RTE_LOG(WARNING,USER1,"No spare CPU, control thread shares the"
+            " master lcore's.\n");
+}
+
+void control_start(const char *cfg_filename, const char *socket_path){
+    pthread_t tid;
+    int i, ret;
+
+    control_cfg_filename = cfg_filename;
+
+    for(i = 0 ; i < CONTROL_MAX_CLIENTS ; i++)
+        control_clients[i].fd = -1;
+
+    ret = pipe2(control_reload_pipe,O_NONBLOCK | O_CLOEXEC);
+    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to create reload pipe.\n");
+
+    if(socket_path != NULL){
+        control_listen_fd = control_listen(socket_path);
+        if(control_listen_fd < 0)
+            rte_exit(EXIT_FAILURE,"Failed to listen on control socket %s.\n",
+                socket_path);
+
+        printf("Control socket listening on %s\n",socket_path);
+    }
+
+    ret = pthread_create(&tid,NULL,control_thread_main,NULL);
+    if(ret != 0)
+        rte_exit(EXIT_FAILURE,"Failed to start control thread.\n");
+
+    control_set_affinity(tid);
+    pthread_detach(tid);
+}
@@ -0,0 +1,32 @@
+#ifndef SFCAPP_CONTROL_
+#define SFCAPP_CONTROL_
+
+/* Control thread, which changes the tables while the workers keep
+ * running. It reloads the config file on request and, if started
+ * with a socket path, serves a Unix stream socket accepting one
+ * command per line:
+ *
+ *   add|del SF|SFC_NODE|FLOW_CLASS name=value ...   see parse_update()
+ *   stats                                           print counters
+ *   telemetry                                       counters as JSON
+ *   reload                                          reload config file
+ *
+ * Every command is answered with a line "OK" or "ERR", which for
+ * stats and telemetry follows the counters. Updates from all clients
+ * are applied in batches, each swapped in with a single table
+ * rebuild, and only answered once live.
+ */
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_MAX_BATCH   256     /* Updates swapped in at once */
+#define CONTROL_LINE_LEN    1024
+
+/* Starts the control thread, off the CPUs of the lcores if there are
+ * spare ones. socket_path may be NULL. */
+void control_start(const char *cfg_filename, const char *socket_path);
+
+/* Asks the control thread to reload the config file. Safe to call
+ * from a signal handler. */
+void control_request_reload(void);
+
+#endif
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+
+#include "common.h"
+#include "latency.h"
+
+extern struct sfcapp_config sfcapp_cfg;
+
+/* Histograms of one worker, only written by the owning lcore */
+struct latency_lcore {
+    struct latency_hist residence[MAX_NB_PORTS];    /* By egress port */
+    struct latency_hist chain;
+} __rte_cache_aligned;
+
+static struct latency_lcore latency_lcores[RTE_MAX_LCORE];
+
+static const double latency_pcts[] = { 50, 99, 99.9 };
+
+static uint64_t latency_bucket_low(unsigned idx){
+    if(idx < LATENCY_SUB)
+        return idx;
+
+    return (uint64_t) (LATENCY_SUB + (idx & (LATENCY_SUB - 1))) <<
+        ((idx >> LATENCY_SUB_BITS) - 1);
+}
+
+uint64_t latency_percentile(const struct latency_hist *h, double pct){
+    uint64_t rank, seen;
+    unsigned i;
+
+    if(h->count == 0)
+        return 0;
+
+    rank = (uint64_t) (pct / 100 * h->count);
+    if(rank == 0)
+        rank = 1;
+
+    for(i = 0, seen = 0 ; i < LATENCY_BUCKETS - 1 ; i++){
+        seen += h->buckets[i];
+        if(seen >= rank)
+            return RTE_MIN(latency_bucket_low(i + 1) - 1,h->max);
+    }
+
+    return h->max;
+}
+
+/* Stamps received packets. PKT_RX_TIMESTAMP is cleared whenever an
+ * mbuf is allocated, so only these packets carry it. */
+static uint16_t latency_rx_stamp(__rte_unused uint8_t port, __rte_unused uint16_t queue,
+    struct rte_mbuf *pkts[], uint16_t nb_pkts, __rte_unused uint16_t max_pkts,
+    __rte_unused void *arg){
+    const uint64_t now = rte_rdtsc();
+    uint16_t i;
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        pkts[i]->timestamp = now;
+        pkts[i]->ol_flags |= PKT_RX_TIMESTAMP;
+    }
+
+    return nb_pkts;
+}
+
+/* Runs on the worker flushing its TX buffer, arg is the port index */
+static uint16_t latency_tx_record(__rte_unused uint8_t port, __rte_unused uint16_t queue,
+    struct rte_mbuf *pkts[], uint16_t nb_pkts, void *arg){
+    struct latency_hist *h = &latency_lcores[rte_lcore_id()].residence[(uintptr_t) arg];
+    const uint64_t now = rte_rdtsc();
+    uint16_t i;
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        if(pkts[i]->ol_flags & PKT_RX_TIMESTAMP)
+            latency_hist_add(h,now - pkts[i]->timestamp);
+    }
+
+    return nb_pkts;
+}
+
+void latency_setup(void){
+    uintptr_t p;
+    uint16_t q;
+
+    if(!sfcapp_cfg.params.latency)
+        return;
+
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+        for(q = 0 ; q < sfcapp_cfg.nb_queues ; q++){
+            if(rte_eth_add_rx_callback(sfcapp_cfg.ports[p].id,q,latency_rx_stamp,NULL) == NULL ||
+               rte_eth_add_tx_callback(sfcapp_cfg.ports[p].id,q,latency_tx_record,(void *) p) == NULL)
+                rte_exit(EXIT_FAILURE,"Failed to add latency callbacks,"
+                    " is CONFIG_RTE_ETHDEV_RXTX_CALLBACKS set?\n");
+        }
+    }
+
+    printf("Measuring latency\n");
+}
+
+int latency_record_chain(struct rte_mbuf *mbuf, uint64_t now){
+    struct latency_trailer buf, trailer;
+    const void *t;
+
+    if(unlikely(mbuf->pkt_len < sizeof(trailer)))
+        return -1;
+
+    t = rte_pktmbuf_read(mbuf,mbuf->pkt_len - sizeof(trailer),sizeof(trailer),&buf);
+    if(t == NULL)
+        return -1;
+
+    memcpy(&trailer,t,sizeof(trailer));
+
+    /* TSCs of all lcores are in sync, a packet from the future is
+     * not ours */
+    if(trailer.magic != LATENCY_MAGIC || trailer.tsc > now)
+        return -1;
+
+    latency_hist_add(&latency_lcores[rte_lcore_id()].chain,now - trailer.tsc);
+
+    return 0;
+}
+
+/* Sums the residence histograms of port index p of all workers, or
+ * their chain histograms if p is negative */
+static void latency_sum(struct latency_hist *total, int p){
+    const struct latency_hist *h;
+    unsigned lcore_id, i;
+
+    memset(total,0,sizeof(*total));
+
+    RTE_LCORE_FOREACH(lcore_id){
+        h = p < 0 ? &latency_lcores[lcore_id].chain : &latency_lcores[lcore_id].residence[p];
+
+        total->count += h->count;
+        total->sum += h->sum;
+        total->max = RTE_MAX(total->max,h->max);
+
+        for(i = 0 ; i < LATENCY_BUCKETS ; i++)
+            total->buckets[i] += h->buckets[i];
+    }
+}
+
+static void latency_print_hist(FILE *f, const struct latency_hist *h){
+    const double us_per_cycle = 1e6 / rte_get_tsc_hz();
+    unsigned i;
+
+    fprintf(f,"%" PRIu64 " packets, avg %.1f us",h->count,
+        (double) h->sum / h->count * us_per_cycle);
+
+    for(i = 0 ; i < RTE_DIM(latency_pcts) ; i++)
+        fprintf(f,", p%g %.1f us",latency_pcts[i],
+            latency_percentile(h,latency_pcts[i]) * us_per_cycle);
+
+    fprintf(f,", max %.1f us\n",h->max * us_per_cycle);
+}
+
+void latency_print(FILE *f){
+    struct latency_hist *total;
+    int p;
+
+    total = malloc(sizeof(*total));
+    if(total == NULL)
+        return;
+
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+        latency_sum(total,p);
+        if(total->count == 0)
+            continue;
+
+        fprintf(f,"Residence to port %" PRIu32 ": ",sfcapp_cfg.ports[p].id);
+        latency_print_hist(f,total);
+    }
+
+    latency_sum(total,-1);
+    if(total->count > 0){
+        fprintf(f,"Chain: ");
+        latency_print_hist(f,total);
+    }
+
+    free(total);
+}
+
+static void latency_print_hist_json(FILE *f, const struct latency_hist *h){
+    unsigned i;
+
+    fprintf(f,"{\"count\":%" PRIu64 ",\"sum_cycles\":%" PRIu64,h->count,h->sum);
+
+    for(i = 0 ; i < RTE_DIM(latency_pcts) ; i++)
+        fprintf(f,",\"p%g_cycles\":%" PRIu64,latency_pcts[i],
+            latency_percentile(h,latency_pcts[i]));
+
+    fprintf(f,",\"max_cycles\":%" PRIu64 "}",h->max);
+}
+
+void latency_print_json(FILE *f){
+    struct latency_hist *total;
+    int p;
+
+    total = malloc(sizeof(*total));
+    if(total == NULL)
+        return;
+
+    fprintf(f,"\"residence\":[");
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+        latency_sum(total,p);
+        fprintf(f,"%s{\"port\":%" PRIu32 ",\"latency\":",p > 0 ? "," : "",
+            sfcapp_cfg.ports[p].id);
+        latency_print_hist_json(f,total);
+        fprintf(f,"}");
+    }
+
+    latency_sum(total,-1);
+    fprintf(f,"],\"chain\":");
+    latency_print_hist_json(f,total);
+
+    free(total);
+}
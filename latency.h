@@ -0,0 +1,85 @@
+#ifndef SFCAPP_LATENCY_
+#define SFCAPP_LATENCY_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <rte_mbuf.h>
+
+/* Latency histograms.
+ *
+ * With the latency parameter set, every role records the residence
+ * time of its packets, from RX until the NIC takes them on TX, by
+ * egress port. Packets sent by the generator end with a timestamp,
+ * which gives the latency through the whole chain: the generator
+ * records it for the packets coming back and, with latency set, so
+ * does the forwarder for the packets leaving the chain.
+ *
+ * Histograms are log-linear, 2^LATENCY_SUB_BITS buckets per power of
+ * two, so percentiles are within about 6% of the exact value.
+ * Timestamps are TSC values: the chain latency only makes sense when
+ * all the roles measuring it run on the same host. Histograms are
+ * not cleared by a stats reset.
+ */
+
+#define LATENCY_SUB_BITS    4
+#define LATENCY_SUB         (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    40      /* Longer latencies share the last bucket */
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+#define LATENCY_MAGIC       0x5346434147454E31ULL
+
+/* Last bytes of every packet sent by the generator */
+struct latency_trailer {
+    uint64_t magic;
+    uint64_t tsc;       /* When the packet was handed to the NIC */
+} __attribute__((__packed__));
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum;                       /* TSC cycles */
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+static inline unsigned latency_bucket(uint64_t cycles){
+    unsigned msb;
+
+    if(cycles < LATENCY_SUB)
+        return cycles;
+
+    msb = 63 - __builtin_clzll(cycles);
+    if(msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+        ((cycles >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+static inline void latency_hist_add(struct latency_hist *h, uint64_t cycles){
+    h->buckets[latency_bucket(cycles)]++;
+    h->count++;
+    h->sum += cycles;
+    if(cycles > h->max)
+        h->max = cycles;
+}
+
+/* Returns the latency, in TSC cycles, under which pct percent of the
+ * samples of h are */
+uint64_t latency_percentile(const struct latency_hist *h, double pct);
+
+/* Installs the RX/TX callbacks measuring residence times, if the
+ * latency parameter is set. Ports and queues must be configured. */
+void latency_setup(void);
+
+/* Records the chain latency of mbuf if it carries a generator
+ * timestamp. Returns -1 if it does not. */
+int latency_record_chain(struct rte_mbuf *mbuf, uint64_t now);
+
+/* Prints the percentiles of every non-empty histogram */
+void latency_print(FILE *f);
+
+/* Same as JSON object members, for telemetry */
+void latency_print_json(FILE *f);
+
+#endif
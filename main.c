@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <signal.h>
 
@@ -11,6 +12,7 @@
 #include <rte_malloc.h>
 #include <rte_cycles.h>
 #include <rte_common.h>
+#include <rte_launch.h>
 
 #include "common.h"
 #include "parser.h"
@@ -18,13 +20,23 @@
 #include "sfc_proxy.h"
 #include "sfc_forwarder.h"
 #include "sfc_loopback.h"
+#include "sfc_generator.h"
 #include "nsh.h"
+#include "rcu.h"
+#include "control.h"
+#include "bench.h"
+#include "latency.h"
+#include "pipeline.h"
 
 struct sfcapp_config sfcapp_cfg;
 
 char* cfg_filename;
 
-struct rte_mempool *sfcapp_pktmbuf_pool;
+static const char *ctrl_socket_path;
+
+static const char *bench_pcap_file; /* -r, replayed in bench mode */
+
+struct rte_mempool *sfcapp_pktmbuf_pools[RTE_MAX_NUMA_NODES];   /* By socket */
 
 static const struct rte_eth_conf dev_cfg = {
     .rxmode = {
@@ -39,26 +51,37 @@ static const struct rte_eth_conf dev_cfg = {
     .txmode = {
         .mq_mode = ETH_MQ_TX_NONE,
     },
+
+    /* Only used when more than one queue is configured.
+     * See init_port(). */
+    .rx_adv_conf = {
+        .rss_conf = {
+            .rss_key = NULL,
+            .rss_hf = ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP,
+        },
+    },
 };
 
+/* Ports of the mask get indexes in order, up to MAX_NB_PORTS */
 static void sfcapp_assoc_ports(int portmask){
     uint8_t i;
-    int count = 0; /* We'll only setup 2 ports */
+    int count = 0;
     int nb_ports_avlb = rte_eth_dev_count();
 
     if(nb_ports_avlb < 2)
         rte_exit(EXIT_FAILURE,"Not enough ports! 2 needed.\n");
 
-    for(i = 0 ; i < nb_ports_avlb && count < 2 ; i++){
+    for(i = 0 ; i < nb_ports_avlb && count < MAX_NB_PORTS ; i++){
         if((portmask & (1 << i)) == 0)
             continue;
     
         sfcapp_cfg.ports[count++].id = i;
     }
 
-    /* Hardcoded since we are only using 1 port for RX and another 
-     * for TX */
-    sfcapp_cfg.nb_ports = 2;
+    if(count < 2)
+        rte_exit(EXIT_FAILURE,"Not enough ports in portmask! 2 needed.\n");
+
+    sfcapp_cfg.nb_ports = count;
 }
 
 // static const char sfcapp_options[] = {
@@ -69,20 +92,72 @@ static void sfcapp_assoc_ports(int portmask){
 //     'H' /* Hash table size*/
 // };
 
+/* Runtime parameters given on the command line. They are applied
+ * after the config file is read, so they override it. */
+#define SFCAPP_MAX_CLI_PARAMS 32
+
+static struct {
+    const char *name;
+    const char *value;
+} cli_params[SFCAPP_MAX_CLI_PARAMS];
+static unsigned nb_cli_params;
+
+static const char *cli_table_size; /* -H, applied to the type's main table */
+
+static void print_usage(const char *prgname){
+    unsigned i;
+    const char *name;
+
+    printf("%s [EAL options] -- -p PORTMASK -t TYPE [-f CONFIG] [-H SIZE]"
+        " [-s SOCKET] [-r PCAP] [--PARAM VALUE ...]\n"
+        "  -p PORTMASK: hexadecimal bitmask of ports to use\n"
+        "  -t TYPE: classifier, forwarder, proxy, loopback or generator\n"
+        "  -f CONFIG: configuration file\n"
+        "  -H SIZE: size of the flow table (classifier, proxy) or"
+        " next-hop table (forwarder)\n"
+        "  -s SOCKET: path of the control socket, for runtime updates\n"
+        "  -r PCAP: packets replayed in bench mode, see --bench_pkts\n"
+        "  -h: print this help\n"
+        "  Runtime parameters, also accepted in the config file global section:\n",
+        prgname);
+
+    for(i = 0 ; (name = parse_param_name(i)) != NULL ; i++)
+        printf("    --%s\n",name);
+}
+
 static void 
 parse_args(int argc, char **argv){
     /* List of possible arguments
      * -t : Type (classifier, proxy, SFF)
      * -f : Configuration file (with rules, list of SFs, etc )
      * -H : Hash table size
+     * -s : Control socket path
+     * -r : Pcap file replayed in bench mode
      * -h : Print usage information
+     * --<param> : Runtime parameter, see parse_param()
      */
-    int sfcapp_opt;
+    int sfcapp_opt, opt_idx;
     int pm;
+    unsigned i;
     enum sfcapp_type type;
+    struct option long_opts[SFCAPP_MAX_CLI_PARAMS + 1];
+    const char *name;
+
+    memset(long_opts,0,sizeof(long_opts));
+    for(i = 0 ; i < SFCAPP_MAX_CLI_PARAMS && (name = parse_param_name(i)) != NULL ; i++){
+        long_opts[i].name = name;
+        long_opts[i].has_arg = required_argument;
+    }
 
-    while( (sfcapp_opt = getopt(argc,argv,"p:t:hH:f:")) != -1){
+    while( (sfcapp_opt = getopt_long(argc,argv,"p:t:hH:f:s:r:",long_opts,&opt_idx)) != -1){
         switch(sfcapp_opt){
+            case 0:
+                if(nb_cli_params == SFCAPP_MAX_CLI_PARAMS)
+                    rte_exit(EXIT_FAILURE,"Too many parameters.\n");
+                cli_params[nb_cli_params].name = long_opts[opt_idx].name;
+                cli_params[nb_cli_params].value = optarg;
+                nb_cli_params++;
+                break;
             case 'p':
                 pm = parse_portmask(optarg);
                 if(pm < 0)
@@ -101,10 +176,21 @@ parse_args(int argc, char **argv){
                 cfg_filename = optarg;
                 break;
             case 'h':
+                print_usage(argv[0]);
+                exit(0);
                 break;
             case 'H':
+                cli_table_size = optarg;
+                break;
+            case 's':
+                ctrl_socket_path = optarg;
+                break;
+            case 'r':
+                bench_pcap_file = optarg;
                 break;
             case '?':
+                print_usage(argv[0]);
+                rte_exit(EXIT_FAILURE,"Invalid arguments.\n");
                 break;
             default:
                 rte_exit(EXIT_FAILURE,"Unrecognized option: %c\n",sfcapp_opt);
@@ -113,6 +199,131 @@ parse_args(int argc, char **argv){
     }
 }
 
+static void init_params(void){
+    int i;
+
+    for(i = 0 ; i < MAX_NB_PORTS ; i++)
+        sfcapp_cfg.ports[i].ip = VXLAN_DEFAULT_SRC_IP;
+    sfcapp_cfg.sff_ip = 0;
+    sfcapp_cfg.sff_vni = VXLAN_DEFAULT_VNI;
+    sfcapp_cfg.sff_port = SFF_PORT_DEFAULT;
+
+    sfcapp_cfg.params.nb_rx_desc = NB_RX_DESC;
+    sfcapp_cfg.params.nb_tx_desc = NB_TX_DESC;
+    sfcapp_cfg.params.burst_size = BURST_SIZE;
+    sfcapp_cfg.params.nb_mbuf = 0;
+    sfcapp_cfg.params.classifier_max_flows = CLASSIFIER_MAX_FLOWS;
+    sfcapp_cfg.params.classifier_max_flows6 = CLASSIFIER_MAX_FLOWS6;
+    sfcapp_cfg.params.forwarder_table_size = FORWARDER_TABLE_SZ;
+    sfcapp_cfg.params.proxy_max_flows = PROXY_MAX_FLOWS;
+    sfcapp_cfg.params.proxy_max_flows6 = PROXY_MAX_FLOWS6;
+    sfcapp_cfg.params.proxy_max_functions = PROXY_MAX_FUNCTIONS;
+    sfcapp_cfg.params.proxy_flow_timeout_ms = PROXY_FLOW_TIMEOUT_MS;
+    sfcapp_cfg.params.bench_pkts = 0;
+    sfcapp_cfg.params.bench_flows = BENCH_FLOWS;
+    sfcapp_cfg.params.bench_sph = BENCH_SPH;
+    sfcapp_cfg.params.bench_pkt_len = BENCH_PKT_LEN;
+    sfcapp_cfg.params.gen_rate = GEN_RATE;
+    sfcapp_cfg.params.gen_encap = 0;
+    sfcapp_cfg.params.gen_paths = GEN_PATHS;
+    sfcapp_cfg.params.latency = 0;
+    sfcapp_cfg.params.pipeline_workers = 0;
+    sfcapp_cfg.params.pipeline_tx = PIPELINE_TX;
+    sfcapp_cfg.params.pipeline_ring_size = PIPELINE_RING_SIZE;
+    sfcapp_cfg.params.pipeline_batch = PIPELINE_BATCH;
+    sfcapp_cfg.params.prefetch_distance = PREFETCH_DISTANCE;
+    sfcapp_cfg.params.classifier_md = 0;
+    sfcapp_cfg.params.proxy_mode = PROXY_MODE_FLOW_TABLE;
+}
+
+static void apply_cli_params(void){
+    unsigned i;
+    const char *table_param = NULL;
+
+    for(i = 0 ; i < nb_cli_params ; i++){
+        if(parse_param(cli_params[i].name,cli_params[i].value) < 0)
+            rte_exit(EXIT_FAILURE,"Invalid value for --%s: %s\n",
+                cli_params[i].name,cli_params[i].value);
+    }
+
+    if(cli_table_size == NULL)
+        return;
+
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+            table_param = "classifier_max_flows";
+            break;
+        case SFC_FORWARDER:
+            table_param = "forwarder_table_size";
+            break;
+        case SFC_PROXY:
+            table_param = "proxy_max_flows";
+            break;
+        default:
+            break;
+    }
+
+    if(table_param != NULL && parse_param(table_param,cli_table_size) < 0)
+        rte_exit(EXIT_FAILURE,"Invalid hash table size: %s\n",cli_table_size);
+}
+
+/* Checks the runtime parameters before anything is sized with them */
+static void check_params(void){
+    const struct sfcapp_params *p = &sfcapp_cfg.params;
+
+    if(p->burst_size == 0 || p->burst_size > MAX_BURST_SIZE)
+        rte_exit(EXIT_FAILURE,"burst_size must be between 1 and %d.\n",
+            MAX_BURST_SIZE);
+
+    if(p->nb_rx_desc == 0 || p->nb_rx_desc > UINT16_MAX ||
+       p->nb_tx_desc == 0 || p->nb_tx_desc > UINT16_MAX)
+        rte_exit(EXIT_FAILURE,"rx_desc and tx_desc must be between 1 and %u.\n",
+            UINT16_MAX);
+
+    /* rte_hash needs at least one full bucket */
+    if(p->classifier_max_flows < 8 || p->proxy_max_flows < 8 ||
+       p->classifier_max_flows6 < 8 || p->proxy_max_flows6 < 8)
+        rte_exit(EXIT_FAILURE,"Flow tables need at least 8 entries.\n");
+
+    if(p->forwarder_table_size == 0 || p->proxy_max_functions == 0)
+        rte_exit(EXIT_FAILURE,"Next-hop tables need at least 1 entry.\n");
+
+    if(p->bench_flows == 0)
+        rte_exit(EXIT_FAILURE,"bench_flows must be at least 1.\n");
+
+    /* Room left for the outer headers the role expects */
+    if(p->bench_pkt_len < ETHER_MIN_LEN - ETHER_CRC_LEN ||
+       p->bench_pkt_len > ETHER_MAX_LEN - ETHER_CRC_LEN)
+        rte_exit(EXIT_FAILURE,"bench_pkt_len must be between %d and %d.\n",
+            ETHER_MIN_LEN - ETHER_CRC_LEN,ETHER_MAX_LEN - ETHER_CRC_LEN);
+
+    if(p->gen_paths == 0)
+        rte_exit(EXIT_FAILURE,"gen_paths must be at least 1.\n");
+
+    if(p->pipeline_batch == 0 || p->pipeline_batch > MAX_BURST_SIZE)
+        rte_exit(EXIT_FAILURE,"pipeline_batch must be between 1 and %d.\n",
+            MAX_BURST_SIZE);
+
+    if(!rte_is_power_of_2(p->pipeline_ring_size) || p->pipeline_ring_size <= p->pipeline_batch)
+        rte_exit(EXIT_FAILURE,"pipeline_ring_size must be a power of 2 above"
+            " pipeline_batch.\n");
+
+    if(p->classifier_md > CLASSIFIER_MD_MAX)
+        rte_exit(EXIT_FAILURE,"classifier_md must be 0, 1 or 2.\n");
+
+    if(p->proxy_mode > PROXY_MODE_MAX)
+        rte_exit(EXIT_FAILURE,"proxy_mode must be 0, 1 or 2.\n");
+
+    if(p->prefetch_distance >= MAX_BURST_SIZE)
+        rte_exit(EXIT_FAILURE,"prefetch_distance must be below %d.\n",
+            MAX_BURST_SIZE);
+
+    /* Both send on their own TX queue, which the TX lcore owns */
+    if(p->pipeline_workers > 0 && (p->bench_pkts > 0 || sfcapp_cfg.type == SFC_GENERATOR))
+        rte_exit(EXIT_FAILURE,"Pipeline mode is not available with the generator"
+            " or bench mode.\n");
+}
+
 static void setup_app(void){
 
     switch(sfcapp_cfg.type){
@@ -128,17 +339,33 @@ static void setup_app(void){
         case SFC_LOOPBACK:
             loopback_setup();
             break;
+        case SFC_GENERATOR:
+            generator_setup();
+            break;
         case NONE:
             rte_exit(EXIT_FAILURE,"App type not detected, something is wrong!\n");
             break;
     };
 }
 
-static void print_stats(void)
-{    
-    printf("\n\n%ld packets received\n%ld packets transmitted\n"
-        "%ld packets dropped\n",
-        sfcapp_cfg.rx_pkts,sfcapp_cfg.tx_pkts,sfcapp_cfg.dropped_pkts);
+/* Set by the signal handler, served by the master lcore */
+static volatile sig_atomic_t stats_print_req, stats_reset_req, quit_req;
+
+/* Runs on the master lcore, outside signal context */
+static void handle_signal_requests(void){
+    if(stats_print_req){
+        stats_print_req = 0;
+        printf("\n\n");
+        common_stats_print(stdout);
+    }
+
+    if(stats_reset_req){
+        stats_reset_req = 0;
+        common_stats_reset();
+    }
+
+    if(quit_req)
+        exit(0);
 }
 
 static void
@@ -146,49 +373,97 @@ signal_handler(int signum)
 {
     switch(signum){
         case SIGUSR1: // Zero statistics
-            sfcapp_cfg.tx_pkts = 0;
-            sfcapp_cfg.rx_pkts = 0;
-            sfcapp_cfg.dropped_pkts = 0;
+            stats_reset_req = 1;
             break;
         case SIGINT: // Print statistics
-            print_stats();
+            stats_print_req = 1;
             break;
         case SIGQUIT: // Print statistics and quit
-            // print_stats();
-            exit(0);
+            quit_req = 1;
+            break;
+        case SIGHUP: // Reload config file
+            control_request_reload();
             break;
         default:
-            print_stats();
+            stats_print_req = 1;
     }
 }
 
-/* Function to allocate memory to be used by the application */ 
+/* Records the NUMA socket of every port and enabled lcore. Ports of
+ * unknown socket are taken to be on the master lcore's. */
+static void init_sockets(void){
+    const unsigned master_socket = rte_lcore_to_socket_id(rte_get_master_lcore());
+    unsigned lcore_id;
+    int i, socket;
+
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        socket = rte_eth_dev_socket_id(sfcapp_cfg.ports[i].id);
+        sfcapp_cfg.ports[i].socket_id = socket < 0 ? master_socket : (unsigned) socket;
+    }
+
+    RTE_LCORE_FOREACH(lcore_id){
+        sfcapp_cfg.lcores[lcore_id].socket_id = rte_lcore_to_socket_id(lcore_id);
+        sfcapp_cfg.lcore_sockets[sfcapp_cfg.lcores[lcore_id].socket_id] = 1;
+    }
+}
+
+/* Function to allocate memory to be used by the application.
+ * Each socket with ports or lcores gets its own mbuf pool, so that
+ * NICs fill local memory. */
 static void
 alloc_mem(unsigned n_mbuf){
 
+    uint8_t used[RTE_MAX_NUMA_NODES];
+    char pool_name[RTE_MEMPOOL_NAMESIZE];
+    unsigned socket;
+    int i;
+
+    memcpy(used,sfcapp_cfg.lcore_sockets,sizeof(used));
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++)
+        used[sfcapp_cfg.ports[i].socket_id] = 1;
+
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        if(!used[socket])
+            continue;
+
+        snprintf(pool_name,sizeof(pool_name),"mbuf_pool_%u",socket);
+        sfcapp_pktmbuf_pools[socket] = rte_pktmbuf_pool_create(
+            pool_name,
+            n_mbuf,
+            MEMPOOL_CACHE_SIZE,
+            0,
+            RTE_MBUF_DEFAULT_BUF_SIZE,
+            socket);
+
+        if(sfcapp_pktmbuf_pools[socket] == NULL)
+            rte_exit(EXIT_FAILURE,
+                "Failed to allocate mbuf pool on socket %u\n",socket);
+        else
+            printf("Successfully allocated mbuf pool on socket %u\n",socket);
+    }
+}
+
+/* Warns about lcores polling or sending on a port of another socket,
+ * whose packets cross the interconnect */
+static void check_lcore_sockets(void){
+    const struct lcore_cfg *lc;
+    const struct port_cfg *port;
     unsigned lcore_id;
-    const char* pool_name = "mbuf_pool";
+    int i;
 
-    for(lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++){
-        if(!rte_lcore_is_enabled(lcore_id))
+    RTE_LCORE_FOREACH(lcore_id){
+        lc = &sfcapp_cfg.lcores[lcore_id];
+
+        /* Pipeline workers only use rings */
+        if(lc->role == LCORE_WORKER)
             continue;
-        
-        if(sfcapp_pktmbuf_pool == NULL){
-            sfcapp_pktmbuf_pool = rte_pktmbuf_pool_create(
-                pool_name,
-                n_mbuf,
-                MEMPOOL_CACHE_SIZE,
-                0,
-                RTE_MBUF_DEFAULT_BUF_SIZE,
-                rte_socket_id());
-            
-            if(sfcapp_pktmbuf_pool == NULL)
-                rte_exit(EXIT_FAILURE,
-                    "Failed to allocate mbuf pool\n");
-            else
-                printf("Successfully allocated mbuf pool\n");
-        }
 
+        for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+            port = &sfcapp_cfg.ports[i];
+            if(port->socket_id != lc->socket_id)
+                RTE_LOG(WARNING,USER1,"Lcore %u on socket %u uses port %" PRIu32
+                    " on socket %u.\n",lcore_id,lc->socket_id,port->id,port->socket_id);
+        }
     }
 }
 
@@ -209,30 +484,70 @@ alloc_mem(unsigned n_mbuf){
 // }
 
 static int
-init_port(uint8_t port, struct rte_mempool *mbuf_pool){
+init_port(struct port_cfg *p_cfg, struct rte_mempool *mbuf_pool, uint16_t nb_queues){
     struct rte_eth_conf port_conf = dev_cfg;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_txconf tx_conf;
+    uint8_t port = p_cfg->id;
     int ret;
     uint16_t q;
 
     if(port >= rte_eth_dev_count())
         return -1;
-    
-    ret = rte_eth_dev_configure(port,NB_RX_QS,NB_TX_QS,&port_conf);
+
+    rte_eth_dev_info_get(port,&dev_info);
+
+    /* Let the NIC fill in outer IPv4 checksums if it can. Some PMDs
+     * only honour offload flags with a full featured TX path. */
+    tx_conf = dev_info.default_txconf;
+    p_cfg->tx_ip_cksum = (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM) != 0;
+    if(p_cfg->tx_ip_cksum)
+        tx_conf.txq_flags &= ~ETH_TXQ_FLAGS_NOXSUMS;
+
+    if(nb_queues > dev_info.max_rx_queues || nb_queues > dev_info.max_tx_queues){
+        RTE_LOG(ERR,USER1,"Port %u supports at most %u RX / %u TX queues,"
+            " %u requested.\n",(unsigned) port,dev_info.max_rx_queues,
+            dev_info.max_tx_queues,nb_queues);
+        return -1;
+    }
+
+    if(sfcapp_cfg.params.nb_rx_desc > dev_info.rx_desc_lim.nb_max ||
+       sfcapp_cfg.params.nb_rx_desc < dev_info.rx_desc_lim.nb_min ||
+       sfcapp_cfg.params.nb_tx_desc > dev_info.tx_desc_lim.nb_max ||
+       sfcapp_cfg.params.nb_tx_desc < dev_info.tx_desc_lim.nb_min){
+        RTE_LOG(ERR,USER1,"Port %u supports %u-%u RX and %u-%u TX descriptors,"
+            " %u/%u requested.\n",(unsigned) port,
+            dev_info.rx_desc_lim.nb_min,dev_info.rx_desc_lim.nb_max,
+            dev_info.tx_desc_lim.nb_min,dev_info.tx_desc_lim.nb_max,
+            sfcapp_cfg.params.nb_rx_desc,sfcapp_cfg.params.nb_tx_desc);
+        return -1;
+    }
+
+    /* Spread flows among the workers' queues by 5-tuple */
+    if(nb_queues > 1){
+        port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+        port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+    }else{
+        port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+        port_conf.rx_adv_conf.rss_conf.rss_hf = 0;
+    }
+
+    ret = rte_eth_dev_configure(port,nb_queues,nb_queues,&port_conf);
     if(ret != 0)
         return ret;
     
     /* Setup TX queues */
-    for(q = 0 ; q < NB_TX_QS ; q++){
-        ret = rte_eth_tx_queue_setup(port, q, NB_TX_DESC,
-            rte_eth_dev_socket_id(port), NULL);
+    for(q = 0 ; q < nb_queues ; q++){
+        ret = rte_eth_tx_queue_setup(port, q, sfcapp_cfg.params.nb_tx_desc,
+            rte_eth_dev_socket_id(port), &tx_conf);
 
         if(ret < 0)
             return ret;
     }
 
     /* Setup RX queues */
-    for(q = 0 ; q < NB_RX_QS ; q++){
-        ret = rte_eth_rx_queue_setup(port, q, NB_RX_DESC,
+    for(q = 0 ; q < nb_queues ; q++){
+        ret = rte_eth_rx_queue_setup(port, q, sfcapp_cfg.params.nb_rx_desc,
             rte_eth_dev_socket_id(port), NULL, mbuf_pool);
 
         if(ret < 0)
@@ -247,11 +562,12 @@ init_port(uint8_t port, struct rte_mempool *mbuf_pool){
     struct ether_addr eth_addr;
     rte_eth_macaddr_get(port,&eth_addr);
     printf("MAC of port %u: %02" PRIx8 ":%02" PRIx8 ":%02" PRIx8
-            ":%02" PRIx8 ":%02" PRIx8 ":%02" PRIx8 "\n",
+            ":%02" PRIx8 ":%02" PRIx8 ":%02" PRIx8 ", IPv4 checksum %s\n",
             (unsigned) port,
             eth_addr.addr_bytes[0],eth_addr.addr_bytes[1],
             eth_addr.addr_bytes[2],eth_addr.addr_bytes[3],
-            eth_addr.addr_bytes[4],eth_addr.addr_bytes[5]);
+            eth_addr.addr_bytes[4],eth_addr.addr_bytes[5],
+            p_cfg->tx_ip_cksum ? "offloaded" : "in software");
 
     rte_eth_promiscuous_disable(port);
 
@@ -259,52 +575,117 @@ init_port(uint8_t port, struct rte_mempool *mbuf_pool){
 
 }
 
-static void sfcapp_main_loop(void){
+/* Assigns one RX/TX queue pair to each enabled lcore and allocates
+ * its TX buffers on the lcore's socket. */
+static void init_lcores(void){
+    unsigned lcore_id;
+    uint16_t queue_id = 0;
+    struct lcore_cfg *lc;
+    int i,ret;
+
+    RTE_LCORE_FOREACH(lcore_id){
+        lc = &sfcapp_cfg.lcores[lcore_id];
+        lc->queue_id = queue_id++;
+
+        for( i = 0 ; i < sfcapp_cfg.nb_ports ; i++ ){
+            lc->tx_buffer[i] = rte_zmalloc_socket(NULL,
+                RTE_ETH_TX_BUFFER_SIZE(sfcapp_cfg.params.burst_size), 0,
+                rte_lcore_to_socket_id(lcore_id));
+            if(lc->tx_buffer[i] == NULL)
+                rte_exit(EXIT_FAILURE,"Failed to allocate TX buffer.\n");
+
+            ret = rte_eth_tx_buffer_init(lc->tx_buffer[i],sfcapp_cfg.params.burst_size);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to create TX buffer.\n");
+
+            /* Set callbacks */
+            rte_eth_tx_buffer_set_err_callback(lc->tx_buffer[i],
+                rte_eth_tx_buffer_count_callback,&lc->stats.drops[DROP_TX_FULL]);
+        }
+    }
+}
 
-    uint16_t nb_rx, nb_tx;
-    struct rte_mbuf *rx_pkts[BURST_SIZE];
-    uint64_t prev_tsc, cur_tsc;
+static void sfcapp_main_loop(struct lcore_cfg *lcore){
+
+    uint16_t i, nb_rx;
+    struct rte_mbuf *rx_pkts[MAX_BURST_SIZE];
+    const int is_master = (rte_lcore_id() == rte_get_master_lcore());
+    const uint16_t burst_size = sfcapp_cfg.params.burst_size;
+    uint64_t prev_tsc, cur_tsc, start_tsc;
     struct port_cfg *p_cfg;
     const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
     int p;
     
     prev_tsc = 0;
 
+    rcu_online(rte_lcore_id());
+
     for(;;){
         cur_tsc = rte_rdtsc();
 
         /* Periodic buffer flush to reduce packet wait time 
          * in the TX buffer */
         if(unlikely(cur_tsc - prev_tsc > drain_tsc)){
-            common_flush_tx_buffers();
+            common_flush_tx_buffers(lcore);
             prev_tsc = cur_tsc;
+
+            if(is_master)
+                handle_signal_requests();
         }
 
         for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
             p_cfg = &sfcapp_cfg.ports[p];
 
             /* Receive pkts */
-            nb_rx = rte_eth_rx_burst(p_cfg->id,0,rx_pkts,
-                        BURST_SIZE);
-            nb_tx = 0;
+            nb_rx = rte_eth_rx_burst(p_cfg->id,lcore->queue_id,rx_pkts,
+                        burst_size);
+            lcore->stats.port[p].rx_pkts += nb_rx;
 
-            /* Process pkts */
+            /* Process pkts. Transmitted packets are counted by
+             * common_tx_pkt(). */
             if(likely(nb_rx > 0 && p_cfg->handle_pkts != NULL)){
-                nb_tx = (uint16_t) p_cfg->handle_pkts(rx_pkts,nb_rx);
-
+                start_tsc = rte_rdtsc();
+                p_cfg->handle_pkts(lcore,rx_pkts,nb_rx);
+                common_stats_burst(lcore,rte_rdtsc() - start_tsc);
+            }else{
+                /* Nothing expected on this port */
+                for(i = 0 ; i < nb_rx ; i++)
+                    common_drop_pkt(lcore,rx_pkts[i],DROP_NO_MATCH);
             }
-
-            /* Update stats */
-            sfcapp_cfg.rx_pkts += nb_rx;
-            sfcapp_cfg.tx_pkts += nb_tx;
         }
+
+        if(sfcapp_cfg.housekeeping != NULL)
+            sfcapp_cfg.housekeeping(lcore);
+
+        /* Done with all tables until next burst */
+        rcu_quiescent(rte_lcore_id());
     }
 }
 
+static int sfcapp_launch_one_lcore(__rte_unused void *arg){
+    struct lcore_cfg *lcore = &sfcapp_cfg.lcores[rte_lcore_id()];
+    const int is_master = (rte_lcore_id() == rte_get_master_lcore());
+
+    if(lcore->role != LCORE_RUN_TO_COMPLETION){
+        printf("Pipeline stage %d on lcore %u\n",lcore->role,rte_lcore_id());
+        pipeline_main_loop(lcore,is_master ? handle_signal_requests : NULL);
+        return 0;
+    }
+
+    printf("Worker on lcore %u polling queue %" PRIu16 "\n",
+        rte_lcore_id(),lcore->queue_id);
+
+    if(sfcapp_cfg.params.bench_pkts > 0)
+        bench_main_loop(lcore);
+    else
+        sfcapp_main_loop(lcore);
+
+    return 0;
+}
+
 int main(int argc, char **argv){
 
     int i,ret=0;
-    unsigned nb_lcores;
+    unsigned nb_lcores, lcore_id, nb_mbuf, min_mbuf;
     
     ret = rte_eal_init(argc,argv);
     if(ret < 0)
@@ -315,16 +696,60 @@ int main(int argc, char **argv){
     argc -= ret;
     argv += ret;
 
+    init_params();
     parse_args(argc,argv);
 
+    /* Parameters needed before tables are created */
+    if(sfcapp_cfg.type != SFC_LOOPBACK)
+        parse_global_config(cfg_filename);
+
+    apply_cli_params();
+    check_params();
+
     nb_lcores = rte_lcore_count();
     SFCAPP_CHECK_FAIL_LT(nb_lcores,1,"Not enough lcores! At least 1 needed.\n");
 
-    alloc_mem(RTE_MAX(2*NB_RX_DESC +
-              2*nb_lcores*BURST_SIZE +
-              2*NB_TX_DESC +
-              nb_lcores*MEMPOOL_CACHE_SIZE,
-              (unsigned) 8192));
+    /* One RX/TX queue pair per worker lcore, or per RX lcore in
+     * pipeline mode */
+    if(sfcapp_cfg.params.pipeline_workers > 0){
+        /* Each port is sent on by a single TX lcore */
+        if(sfcapp_cfg.params.pipeline_tx == 0 ||
+           sfcapp_cfg.params.pipeline_tx > sfcapp_cfg.nb_ports)
+            rte_exit(EXIT_FAILURE,"pipeline_tx must be between 1 and %u.\n",
+                sfcapp_cfg.nb_ports);
+        if(nb_lcores < sfcapp_cfg.params.pipeline_workers + sfcapp_cfg.params.pipeline_tx + 1)
+            rte_exit(EXIT_FAILURE,"Pipeline mode needs at least %u lcores.\n",
+                sfcapp_cfg.params.pipeline_workers + sfcapp_cfg.params.pipeline_tx + 1);
+        sfcapp_cfg.nb_queues = nb_lcores - sfcapp_cfg.params.pipeline_workers -
+            sfcapp_cfg.params.pipeline_tx;
+    }else{
+        sfcapp_cfg.nb_queues = nb_lcores;
+    }
+
+    /* Enough mbufs to fill every RX and TX ring, plus the ones held
+     * in bursts and mempool caches */
+    min_mbuf = sfcapp_cfg.nb_ports*sfcapp_cfg.nb_queues*sfcapp_cfg.params.nb_rx_desc +
+              sfcapp_cfg.nb_ports*nb_lcores*sfcapp_cfg.params.burst_size +
+              sfcapp_cfg.nb_ports*sfcapp_cfg.nb_queues*sfcapp_cfg.params.nb_tx_desc +
+              nb_lcores*MEMPOOL_CACHE_SIZE;
+
+    /* And every pipeline ring */
+    if(sfcapp_cfg.params.pipeline_workers > 0)
+        min_mbuf += (sfcapp_cfg.params.pipeline_workers + 1)*sfcapp_cfg.nb_ports*
+            sfcapp_cfg.params.pipeline_ring_size;
+
+    nb_mbuf = sfcapp_cfg.params.nb_mbuf;
+    if(nb_mbuf == 0)
+        nb_mbuf = RTE_MAX(min_mbuf,(unsigned) 8192);
+    else if(nb_mbuf < min_mbuf)
+        rte_exit(EXIT_FAILURE,"nb_mbuf too small, at least %u needed.\n",min_mbuf);
+
+    printf("%u mbufs, %u RX / %u TX descriptors per queue, burst of %u\n",
+        nb_mbuf,sfcapp_cfg.params.nb_rx_desc,sfcapp_cfg.params.nb_tx_desc,
+        sfcapp_cfg.params.burst_size);
+
+    init_sockets();
+    alloc_mem(nb_mbuf);
 
     /* Set signal handlers */
     signal(SIGINT, signal_handler);
@@ -335,49 +760,64 @@ int main(int argc, char **argv){
     for( i = 0 ; i < sfcapp_cfg.nb_ports ; i++ ){
 
         /* Initialize device */
-        ret = init_port(sfcapp_cfg.ports[i].id,sfcapp_pktmbuf_pool);
+        ret = init_port(&sfcapp_cfg.ports[i],
+                sfcapp_pktmbuf_pools[sfcapp_cfg.ports[i].socket_id],
+                sfcapp_cfg.nb_queues);
         SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to setup RX port.\n");
         
         /* Save MAC address */
         rte_eth_macaddr_get(sfcapp_cfg.ports[i].id,&sfcapp_cfg.ports[i].mac);
 
-        /* Initialize TX buffers */
-        sfcapp_cfg.ports[i].tx_buffer = rte_zmalloc(NULL, RTE_ETH_TX_BUFFER_SIZE(BURST_SIZE), 0);
-        ret = rte_eth_tx_buffer_init(sfcapp_cfg.ports[i].tx_buffer,BURST_SIZE);
-        SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to create TX buffer1.\n");
-        
-        /* Set callbacks */
-        rte_eth_tx_buffer_set_err_callback(sfcapp_cfg.ports[i].tx_buffer,
-            rte_eth_tx_buffer_count_callback,&sfcapp_cfg.dropped_pkts);
-
-        /* Set IP address*/
-        sfcapp_cfg.ports[i].ip = 0; // TODO: changed later
-
         /* This value will be set by the corresponding element's
          * setup function. */
         sfcapp_cfg.ports[i].handle_pkts = NULL;
     }
 
+    /* Initialize per-worker queues and TX buffers */
+    init_lcores();
+
+    if(sfcapp_cfg.params.pipeline_workers > 0)
+        pipeline_setup();
+
+    check_lcore_sockets();
+
+    /* Residence time histograms, if enabled */
+    latency_setup();
+
     /* Initialize corresponding tables */
     setup_app();
 
     /* Read config file and setup app*/
-    if(sfcapp_cfg.type != SFC_LOOPBACK)
-        parse_config_file(cfg_filename);
+    /* Only the global section matters to the generator */
+    if(sfcapp_cfg.type != SFC_LOOPBACK && sfcapp_cfg.type != SFC_GENERATOR){
+        ret = parse_config_file(cfg_filename);
+        SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to apply config file.\n");
+
+        /* Tables can be rebuilt from now on */
+        control_start(cfg_filename,ctrl_socket_path);
+        signal(SIGHUP, signal_handler);
+    }
 
     /* Print SFF's MAC read from config files */
     char mac[64];
     ether_format_addr(mac,64,&sfcapp_cfg.sff_addr);
     printf("SFF MAC: %s\n",mac);
 
-    /* Reset stats */
-    sfcapp_cfg.tx_pkts = 0;
-    sfcapp_cfg.rx_pkts = 0;
-    sfcapp_cfg.dropped_pkts = 0;
-    
-    /* Start application (single core) */
-    printf("Running...\n");
-    sfcapp_main_loop();
+    if(sfcapp_cfg.params.bench_pkts > 0)
+        bench_setup(bench_pcap_file);
+
+    /* Start one worker per enabled lcore, master included */
+    printf("Running on %u lcore(s)...\n",nb_lcores);
+    RTE_LCORE_FOREACH_SLAVE(lcore_id){
+        ret = rte_eal_remote_launch(sfcapp_launch_one_lcore,NULL,lcore_id);
+        SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to launch worker lcore.\n");
+    }
+
+    sfcapp_launch_one_lcore(NULL);
+    rte_eal_mp_wait_lcore();
+
+    if(sfcapp_cfg.params.bench_pkts > 0)
+        bench_report();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_ether.h>
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+#include <rte_log.h>
+
+#include "nexthop.h"
+
+/* Seeds of the two hashes giving the permutation of an instance */
+#define NH_POOL_SEED_OFFSET 0x9E3779B9
+#define NH_POOL_SEED_SKIP   0x85EBCA6B
+
+struct nh_sph_cfg {
+    uint32_t sph;
+    uint16_t sfid;
+    uint8_t port;               /* Egress at end of chain */
+};
+
+struct nh_sf_cfg {
+    uint16_t sfid;
+    struct nh_sf_pool pool;
+};
+
+struct nh_config {
+    uint32_t max_entries;
+    uint32_t nb_sph;
+    uint32_t nb_sf;
+    struct nh_sph_cfg *sph;
+    struct nh_sf_cfg *sf;
+};
+
+/* Pool counters of an SF, one copy per socket like the tables. Never
+ * freed, so that they survive table rebuilds. Only added to by the
+ * thread building tables. */
+struct nh_sf_stats {
+    uint16_t sfid;
+    struct nh_pool_stats *stats[RTE_MAX_NUMA_NODES];
+};
+
+static struct nh_sf_stats *nh_sf_stats;
+static uint32_t nh_nb_sf_stats;
+static uint32_t nh_max_sf_stats;
+
+struct nh_config *nh_config_create(uint32_t max_entries){
+    struct nh_config *cfg;
+
+    cfg = calloc(1,sizeof(struct nh_config));
+    if(cfg == NULL)
+        return NULL;
+
+    cfg->max_entries = max_entries;
+    cfg->sph = calloc(max_entries,sizeof(struct nh_sph_cfg));
+    cfg->sf  = calloc(max_entries,sizeof(struct nh_sf_cfg));
+
+    if(cfg->sph == NULL || cfg->sf == NULL){
+        nh_config_free(cfg);
+        return NULL;
+    }
+
+    return cfg;
+}
+
+struct nh_config *nh_config_copy(const struct nh_config *cfg){
+    struct nh_config *copy;
+
+    copy = nh_config_create(cfg->max_entries);
+    if(copy == NULL)
+        return NULL;
+
+    copy->nb_sph = cfg->nb_sph;
+    copy->nb_sf = cfg->nb_sf;
+    memcpy(copy->sph,cfg->sph,cfg->nb_sph*sizeof(struct nh_sph_cfg));
+    memcpy(copy->sf,cfg->sf,cfg->nb_sf*sizeof(struct nh_sf_cfg));
+
+    return copy;
+}
+
+void nh_config_free(struct nh_config *cfg){
+    if(cfg == NULL)
+        return;
+
+    free(cfg->sph);
+    free(cfg->sf);
+    free(cfg);
+}
+
+int nh_config_add_sph(struct nh_config *cfg, uint32_t sph, uint16_t sfid, uint8_t port){
+    uint32_t i;
+
+    if(port >= sfcapp_cfg.nb_ports){
+        RTE_LOG(ERR,USER1,"No port %" PRIu8 " for <sph=%08" PRIx32 ">.\n",port,sph);
+        return -1;
+    }
+
+    /* Replace existing entry */
+    for(i = 0 ; i < cfg->nb_sph ; i++){
+        if(cfg->sph[i].sph == sph){
+            cfg->sph[i].sfid = sfid;
+            cfg->sph[i].port = port;
+            return 0;
+        }
+    }
+
+    if(cfg->nb_sph >= cfg->max_entries)
+        return -1;
+
+    cfg->sph[cfg->nb_sph].sph = sph;
+    cfg->sph[cfg->nb_sph].sfid = sfid;
+    cfg->sph[cfg->nb_sph].port = port;
+    cfg->nb_sph++;
+
+    return 0;
+}
+
+int nh_config_add_sf(struct nh_config *cfg, uint16_t sfid, const struct nh_sf_pool *pool){
+    uint32_t i;
+
+    if(pool->nb_instances == 0 || pool->nb_instances > NH_MAX_INSTANCES)
+        return -1;
+
+    if(pool->port >= sfcapp_cfg.nb_ports){
+        RTE_LOG(ERR,USER1,"No port %" PRIu8 " for SF %" PRIu16 ".\n",pool->port,sfid);
+        return -1;
+    }
+
+    for(i = 0 ; i < pool->nb_instances ; i++){
+        if(pool->addr[i].vni > VXLAN_MAX_VNI || pool->weights[i] == 0)
+            return -1;
+    }
+
+    /* Replace existing entry */
+    for(i = 0 ; i < cfg->nb_sf ; i++){
+        if(cfg->sf[i].sfid == sfid){
+            cfg->sf[i].pool = *pool;
+            return 0;
+        }
+    }
+
+    /* Tunnel indexes are 16 bits wide, 0 meaning no tunnel */
+    if(cfg->nb_sf >= cfg->max_entries || cfg->nb_sf >= UINT16_MAX)
+        return -1;
+
+    cfg->sf[cfg->nb_sf].sfid = sfid;
+    cfg->sf[cfg->nb_sf].pool = *pool;
+    cfg->nb_sf++;
+
+    return 0;
+}
+
+void nh_config_usage(const struct nh_config *cfg, uint32_t *nb_sph, uint32_t *nb_sf,
+    uint32_t *max_entries){
+    *nb_sph = cfg->nb_sph;
+    *nb_sf = cfg->nb_sf;
+    *max_entries = cfg->max_entries;
+}
+
+/* Entries are not ordered, the last one fills the hole */
+int nh_config_del_sph(struct nh_config *cfg, uint32_t sph){
+    uint32_t i;
+
+    for(i = 0 ; i < cfg->nb_sph ; i++){
+        if(cfg->sph[i].sph == sph){
+            cfg->sph[i] = cfg->sph[--cfg->nb_sph];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int nh_config_del_sf(struct nh_config *cfg, uint16_t sfid){
+    uint32_t i;
+
+    for(i = 0 ; i < cfg->nb_sf ; i++){
+        if(cfg->sf[i].sfid == sfid){
+            cfg->sf[i] = cfg->sf[--cfg->nb_sf];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static const struct nh_sf_cfg *nh_config_find_sf(const struct nh_config *cfg, uint16_t sfid){
+    uint32_t i;
+
+    for(i = 0 ; i < cfg->nb_sf ; i++)
+        if(cfg->sf[i].sfid == sfid)
+            return &cfg->sf[i];
+
+    return NULL;
+}
+
+/* Fills the lookup table of pool, Maglev style: in turn, each
+ * instance takes as many free buckets as its weight, in the order of
+ * its own permutation of the table */
+static void nh_pool_build_lut(struct nh_pool *pool){
+    uint32_t offset[NH_MAX_INSTANCES], skip[NH_MAX_INSTANCES], next[NH_MAX_INSTANCES];
+    const struct nh_instance *inst;
+    uint32_t i, w, c, h, filled;
+
+    for(i = 0 ; i < pool->nb_instances ; i++){
+        inst = &pool->instances[i];
+        h = rte_hash_crc(&inst->mac,sizeof(inst->mac),NH_POOL_SEED_OFFSET);
+        offset[i] = h % NH_POOL_LUT_SIZE;
+        h = rte_hash_crc(&inst->mac,sizeof(inst->mac),NH_POOL_SEED_SKIP);
+        skip[i] = h % (NH_POOL_LUT_SIZE - 1) + 1;
+        next[i] = 0;
+    }
+
+    memset(pool->lut,0xFF,sizeof(pool->lut));
+
+    for(filled = 0 ; ; ){
+        for(i = 0 ; i < pool->nb_instances ; i++){
+            for(w = 0 ; w < pool->weights[i] ; w++){
+                do{
+                    c = (offset[i] + next[i] * skip[i]) % NH_POOL_LUT_SIZE;
+                    next[i]++;
+                }while(pool->lut[c] != 0xFF);
+
+                pool->lut[c] = i;
+                if(++filled == NH_POOL_LUT_SIZE)
+                    return;
+            }
+        }
+    }
+}
+
+/* Counters of the pool of sfid, by lcore id, on socket_id. Returns
+ * NULL in case of failure. */
+static struct nh_pool_stats *nh_pool_stats_get(uint16_t sfid, int socket_id){
+    struct nh_sf_stats *s;
+    uint32_t i;
+
+    for(i = 0 ; i < nh_nb_sf_stats ; i++)
+        if(nh_sf_stats[i].sfid == sfid)
+            break;
+
+    if(i == nh_nb_sf_stats){
+        if(nh_nb_sf_stats == nh_max_sf_stats){
+            s = realloc(nh_sf_stats,(nh_max_sf_stats + 16)*sizeof(struct nh_sf_stats));
+            if(s == NULL)
+                return NULL;
+
+            nh_sf_stats = s;
+            nh_max_sf_stats += 16;
+        }
+
+        memset(&nh_sf_stats[i],0,sizeof(struct nh_sf_stats));
+        nh_sf_stats[i].sfid = sfid;
+        nh_nb_sf_stats++;
+    }
+
+    s = &nh_sf_stats[i];
+
+    if(s->stats[socket_id] == NULL)
+        s->stats[socket_id] = rte_zmalloc_socket("nh_pool_stats",
+            RTE_MAX_LCORE*sizeof(struct nh_pool_stats),RTE_CACHE_LINE_SIZE,socket_id);
+
+    return s->stats[socket_id];
+}
+
+static int nh_spi_cmp(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Lists the distinct SPIs of cfg from NH_DENSE_SPI up in
+ * table->sparse, sorted, with no path yet. Returns -1 in case of
+ * failure. */
+static int nh_table_build_sparse(struct nh_table *table, const struct nh_config *cfg,
+    int socket_id){
+    uint32_t *spis;
+    uint32_t i, n, spi;
+
+    spis = calloc(cfg->nb_sph + 1,sizeof(uint32_t));
+    if(spis == NULL)
+        return -1;
+
+    n = 0;
+    for(i = 0 ; i < cfg->nb_sph ; i++){
+        spi = (cfg->sph[i].sph & NSH_SPI_MASK) >> 8;
+        if(spi >= NH_DENSE_SPI)
+            spis[n++] = spi;
+    }
+
+    qsort(spis,n,sizeof(uint32_t),nh_spi_cmp);
+
+    table->nb_sparse = 0;
+    for(i = 0 ; i < n ; i++)
+        if(i == 0 || spis[i] != spis[i - 1])
+            spis[table->nb_sparse++] = spis[i];
+
+    if(table->nb_sparse > 0){
+        table->sparse = rte_zmalloc_socket("nh_sparse",
+            table->nb_sparse*sizeof(struct nh_sparse_path),0,socket_id);
+        if(table->sparse == NULL){
+            table->nb_sparse = 0;
+            free(spis);
+            return -1;
+        }
+
+        for(i = 0 ; i < table->nb_sparse ; i++)
+            table->sparse[i].spi = spis[i];
+    }
+
+    free(spis);
+    return 0;
+}
+
+/* Where the path of spi is stored in table, which has room for it */
+static struct nh_entry **nh_table_path_slot(struct nh_table *table, uint32_t spi){
+    struct nh_sparse_path *sparse;
+
+    if(spi < NH_DENSE_SPI)
+        return &table->paths[spi];
+
+    /* spi is the first member, nh_spi_cmp() compares it */
+    sparse = bsearch(&spi,table->sparse,table->nb_sparse,sizeof(struct nh_sparse_path),
+        nh_spi_cmp);
+
+    return &sparse->path;
+}
+
+struct nh_table *nh_table_build(const struct nh_config *cfg, int socket_id){
+    struct nh_table *table;
+    struct nh_entry *entry;
+    struct nh_pool *pool;
+    const struct nh_sf_cfg *sf;
+    const struct nh_sf_addr *addr;
+    struct nh_entry **path;
+    uint32_t *sf_tunnel;
+    uint16_t *sf_pool;
+    uint32_t i, j, spi, nb_spi, nb_tunnels;
+
+    /* Paths are indexed by SPI, size array after the largest one
+     * below NH_DENSE_SPI */
+    nb_spi = 0;
+    for(i = 0 ; i < cfg->nb_sph ; i++){
+        spi = (cfg->sph[i].sph & NSH_SPI_MASK) >> 8;
+        if(spi < NH_DENSE_SPI)
+            nb_spi = RTE_MAX(nb_spi,spi + 1);
+    }
+
+    table = rte_zmalloc_socket("nh_table",sizeof(struct nh_table),0,socket_id);
+    if(table == NULL)
+        return NULL;
+
+    table->nb_spi = nb_spi;
+
+    sf_tunnel = NULL;
+    sf_pool = NULL;
+    if(nh_table_build_sparse(table,cfg,socket_id) < 0)
+        goto fail;
+
+    /* First tunnel of each SF, one per instance, and pool of each SF
+     * with several instances. Index 0 means none for both. */
+    sf_tunnel = calloc(cfg->nb_sf + 1,sizeof(uint32_t));
+    sf_pool = calloc(cfg->nb_sf + 1,sizeof(uint16_t));
+    if(sf_tunnel == NULL || sf_pool == NULL)
+        goto fail;
+
+    nb_tunnels = 1;
+    table->nb_pools = 1;
+    for(i = 0 ; i < cfg->nb_sf ; i++){
+        sf_tunnel[i] = nb_tunnels;
+        nb_tunnels += cfg->sf[i].pool.nb_instances;
+        if(cfg->sf[i].pool.nb_instances > 1)
+            sf_pool[i] = table->nb_pools++;
+    }
+
+    if(nb_tunnels > UINT16_MAX + 1){
+        RTE_LOG(ERR,USER1,"Too many SF instances, maximum is %d.\n",UINT16_MAX);
+        goto fail;
+    }
+
+    table->tunnels = rte_zmalloc_socket("nh_tunnels",
+        nb_tunnels*sizeof(struct vxlan_tmpl),RTE_CACHE_LINE_SIZE,socket_id);
+    table->pools = rte_zmalloc_socket("nh_pools",
+        table->nb_pools*sizeof(struct nh_pool),RTE_CACHE_LINE_SIZE,socket_id);
+    if(table->tunnels == NULL || table->pools == NULL)
+        goto fail;
+
+    for(i = 0 ; i < cfg->nb_sf ; i++){
+        for(j = 0 ; j < cfg->sf[i].pool.nb_instances ; j++){
+            addr = &cfg->sf[i].pool.addr[j];
+            if(addr->ip != 0)
+                common_vxlan_tmpl_init(&table->tunnels[sf_tunnel[i] + j],cfg->sf[i].pool.port,
+                    &addr->mac,addr->ip,addr->vni);
+        }
+
+        if(sf_pool[i] == 0)
+            continue;
+
+        pool = &table->pools[sf_pool[i]];
+        pool->sfid = cfg->sf[i].sfid;
+        pool->nb_instances = cfg->sf[i].pool.nb_instances;
+        memcpy(pool->weights,cfg->sf[i].pool.weights,sizeof(pool->weights));
+
+        for(j = 0 ; j < pool->nb_instances ; j++){
+            addr = &cfg->sf[i].pool.addr[j];
+            ether_addr_copy(&addr->mac,&pool->instances[j].mac);
+            pool->instances[j].tunnel = addr->ip != 0 ? sf_tunnel[i] + j : 0;
+        }
+
+        pool->stats = nh_pool_stats_get(pool->sfid,socket_id);
+        if(pool->stats == NULL)
+            goto fail;
+
+        nh_pool_build_lut(pool);
+    }
+
+    if(nb_spi > 0){
+        table->paths = rte_zmalloc_socket("nh_paths",
+            nb_spi*sizeof(struct nh_entry *),0,socket_id);
+        if(table->paths == NULL)
+            goto fail;
+    }
+
+    for(i = 0 ; i < cfg->nb_sph ; i++){
+        spi = (cfg->sph[i].sph & NSH_SPI_MASK) >> 8;
+        path = nh_table_path_slot(table,spi);
+
+        if(*path == NULL){
+            *path = rte_zmalloc_socket("nh_path",
+                NH_NB_SI*sizeof(struct nh_entry),RTE_CACHE_LINE_SIZE,socket_id);
+            if(*path == NULL)
+                goto fail;
+        }
+
+        entry = &(*path)[cfg->sph[i].sph & NSH_SI_MASK];
+        entry->sfid = cfg->sph[i].sfid;
+
+        if(entry->sfid == 0){
+            entry->action = NH_ACTION_DECAP;
+            entry->port = cfg->sph[i].port;
+            continue;
+        }
+
+        sf = nh_config_find_sf(cfg,entry->sfid);
+
+        if(sf == NULL){
+            RTE_LOG(WARNING,USER1,"No address for SF %" PRIu16 " used by "
+                "<sph=%08" PRIx32 ">, its packets will be dropped.\n",
+                entry->sfid,cfg->sph[i].sph);
+            entry->action = NH_ACTION_DROP;
+            continue;
+        }
+
+        entry->action = NH_ACTION_FORWARD;
+        entry->port = sf->pool.port;
+        ether_addr_copy(&sf->pool.addr[0].mac,&entry->mac);
+        entry->tunnel = sf->pool.addr[0].ip != 0 ? sf_tunnel[sf - cfg->sf] : 0;
+        entry->pool = sf_pool[sf - cfg->sf];
+    }
+
+    free(sf_tunnel);
+    free(sf_pool);
+
+    return table;
+
+fail:
+    free(sf_tunnel);
+    free(sf_pool);
+    nh_table_free(table);
+    return NULL;
+}
+
+void nh_table_free(struct nh_table *table){
+    uint32_t i;
+
+    if(table == NULL)
+        return;
+
+    if(table->paths != NULL){
+        for(i = 0 ; i < table->nb_spi ; i++)
+            rte_free(table->paths[i]);
+
+        rte_free(table->paths);
+    }
+
+    if(table->sparse != NULL){
+        for(i = 0 ; i < table->nb_sparse ; i++)
+            rte_free(table->sparse[i].path);
+
+        rte_free(table->sparse);
+    }
+
+    rte_free(table->pools);
+
+    rte_free(table->tunnels);
+
+    rte_free(table);
+}
+
+int nh_table_build_all(const struct nh_config *cfg, struct nh_table *tables[RTE_MAX_NUMA_NODES]){
+    unsigned socket;
+
+    memset(tables,0,RTE_MAX_NUMA_NODES*sizeof(struct nh_table *));
+
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        if(!sfcapp_cfg.lcore_sockets[socket])
+            continue;
+
+        tables[socket] = nh_table_build(cfg,socket);
+        if(tables[socket] == NULL){
+            RTE_LOG(ERR,USER1,"Failed to build next-hop table on socket %u.\n",socket);
+            nh_table_free_all(tables);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void nh_table_free_all(struct nh_table *tables[RTE_MAX_NUMA_NODES]){
+    unsigned socket;
+
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        nh_table_free(tables[socket]);
+        tables[socket] = NULL;
+    }
+}
+
+/* Any copy of tables, as they all have the same entries. NULL if
+ * there are none. */
+static const struct nh_table *nh_table_any(struct nh_table *const tables[RTE_MAX_NUMA_NODES]){
+    unsigned socket;
+
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++)
+        if(tables[socket] != NULL)
+            return tables[socket];
+
+    return NULL;
+}
+
+/* Packets sent to instance idx of pool pool_idx by all lcores, each
+ * counting in the copy of its socket */
+static uint64_t nh_pool_pkts(struct nh_table *const tables[RTE_MAX_NUMA_NODES],
+    unsigned pool_idx, unsigned idx){
+    unsigned lcore_id;
+    uint64_t pkts;
+
+    pkts = 0;
+    RTE_LCORE_FOREACH(lcore_id){
+        if(tables[sfcapp_cfg.lcores[lcore_id].socket_id] != NULL)
+            pkts += tables[sfcapp_cfg.lcores[lcore_id].socket_id]->pools[pool_idx]
+                .stats[lcore_id].pkts[idx];
+    }
+
+    return pkts;
+}
+
+void nh_table_print_stats(FILE *f, struct nh_table *const tables[RTE_MAX_NUMA_NODES]){
+    const struct nh_table *table = nh_table_any(tables);
+    char buf[ETHER_ADDR_FMT_SIZE + 1];
+    const struct nh_pool *pool;
+    unsigned i, j;
+
+    if(table == NULL)
+        return;
+
+    for(i = 1 ; i < table->nb_pools ; i++){
+        pool = &table->pools[i];
+
+        for(j = 0 ; j < pool->nb_instances ; j++){
+            ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,&pool->instances[j].mac);
+            fprintf(f,"%" PRIu64 " packets to SF %" PRIu16 " instance %s\n",
+                nh_pool_pkts(tables,i,j),pool->sfid,buf);
+        }
+    }
+}
+
+void nh_table_print_json(FILE *f, struct nh_table *const tables[RTE_MAX_NUMA_NODES]){
+    const struct nh_table *table = nh_table_any(tables);
+    char buf[ETHER_ADDR_FMT_SIZE + 1];
+    const struct nh_pool *pool;
+    unsigned i, j;
+    int first;
+
+    fprintf(f,"\"sf_instances\":[");
+
+    first = 1;
+    for(i = 1 ; table != NULL && i < table->nb_pools ; i++){
+        pool = &table->pools[i];
+
+        for(j = 0 ; j < pool->nb_instances ; j++){
+            ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,&pool->instances[j].mac);
+            fprintf(f,"%s{\"sfid\":%" PRIu16 ",\"mac\":\"%s\",\"weight\":%" PRIu8
+                ",\"pkts\":%" PRIu64 "}",first ? "" : ",",pool->sfid,buf,
+                pool->weights[j],nh_pool_pkts(tables,i,j));
+            first = 0;
+        }
+    }
+
+    fprintf(f,"]");
+}
@@ -0,0 +1,239 @@
+#ifndef SFCAPP_NEXTHOP_
+#define SFCAPP_NEXTHOP_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_ether.h>
+#include <rte_lcore.h>
+
+#include "nsh.h"
+#include "common.h"
+
+/* Next-hop resolution of <SPI,SI>.
+ *
+ * The control plane keeps the [SFC_NODE] (<SPI,SI> -> sfid) and [SF]
+ * (sfid -> MAC, VTEP) entries in a struct nh_config. Once all entries
+ * are known, they are compiled into a struct nh_table, where each SPI
+ * has an array indexed by SI holding the final action, egress MAC and
+ * outer-header template of the SF's tunnel, if it has one. Resolving a
+ * packet's next hop is then a single array access instead of two
+ * chained hash lookups. SPIs from NH_DENSE_SPI up, which would make
+ * the SPI array too large, are found by binary search in a sorted
+ * array instead. Entries also give the port packets leave through:
+ * the SF's for SF hops, the [SFC_NODE]'s at end of chain.
+ *
+ * An SF may be a pool of instances. Flows are spread among them with
+ * a Maglev lookup table indexed by the hash of their inner 5-tuple:
+ * each instance fills the table following its own permutation, which
+ * only depends on its address, in proportion to its weight. Adding
+ * or removing an instance thus moves few flows besides its own.
+ *
+ * Tables are read-mostly: each NUMA socket running workers gets its
+ * own copy, so lookups never leave local memory. Copies only differ by
+ * their pool counters, which are summed when printed. Counters belong
+ * to the SF, not the table: a rebuilt table goes on counting where
+ * the one it replaces stopped.
+ */
+
+#define NH_NB_SI    256         /* SI is 8 bits wide */
+#define NH_DENSE_SPI 0x10000    /* SPIs below are directly indexed */
+
+#define NH_DEFAULT_PORT  1      /* Egress port index if none is given */
+
+#define NH_MAX_INSTANCES 16     /* Instances of one SF */
+#define NH_POOL_LUT_SIZE 4093   /* Prime, well above 100 per instance */
+
+enum nh_action {
+    NH_ACTION_DROP = 0,         /* No path, must be zero */
+    NH_ACTION_FORWARD,          /* Send to the SF at mac */
+    NH_ACTION_DECAP             /* End of chain, remove encapsulation */
+};
+
+struct nh_entry {
+    uint8_t action;             /* enum nh_action */
+    uint8_t port;               /* Egress port index */
+    uint16_t sfid;
+    struct ether_addr mac;
+    uint16_t tunnel;            /* Index in nh_table.tunnels, 0 if none */
+    uint16_t pool;              /* Index in nh_table.pools, 0 if the SF
+                                 * has a single instance */
+} __attribute__((__aligned__(16)));
+
+struct nh_instance {
+    struct ether_addr mac;
+    uint16_t tunnel;
+};
+
+/* Packets sent to each instance of a pool by one lcore */
+struct nh_pool_stats {
+    uint64_t pkts[NH_MAX_INSTANCES];
+} __rte_cache_aligned;
+
+struct nh_pool {
+    uint8_t lut[NH_POOL_LUT_SIZE];      /* Instance of each flow hash bucket */
+    uint16_t sfid;
+    uint8_t nb_instances;
+    uint8_t weights[NH_MAX_INSTANCES];
+    struct nh_instance instances[NH_MAX_INSTANCES];
+    struct nh_pool_stats *stats;        /* By lcore id, outlives the table */
+};
+
+/* Path of an SPI at or above NH_DENSE_SPI */
+struct nh_sparse_path {
+    uint32_t spi;
+    struct nh_entry *path;
+};
+
+struct nh_table {
+    uint32_t nb_spi;            /* Size of paths */
+    struct nh_entry **paths;    /* Indexed by SPI, NULL if not in use */
+    uint32_t nb_sparse;         /* Size of sparse */
+    struct nh_sparse_path *sparse;  /* Sorted by SPI */
+    struct vxlan_tmpl *tunnels; /* Outer headers towards each SF VTEP */
+    uint16_t nb_pools;          /* Size of pools, the first one unused */
+    struct nh_pool *pools;
+};
+
+/* Address of an SF instance */
+struct nh_sf_addr {
+    struct ether_addr mac;
+    uint32_t ip;                /* VTEP address, host order. 0 to only
+                                 * rewrite MACs */
+    uint32_t vni;
+};
+
+/* An [SF] entry. Flows are spread among instances in proportion to
+ * their weights. */
+struct nh_sf_pool {
+    uint8_t port;               /* Port index the instances are behind */
+    uint8_t nb_instances;       /* 1 to NH_MAX_INSTANCES */
+    uint8_t weights[NH_MAX_INSTANCES];  /* At least 1 */
+    struct nh_sf_addr addr[NH_MAX_INSTANCES];
+};
+
+struct nh_config;
+
+/* Creates an empty next-hop configuration holding at most max_entries
+ * <SPI,SI> and SF entries each. Returns NULL in case of failure. */
+struct nh_config *nh_config_create(uint32_t max_entries);
+
+/* Returns a copy of cfg, to be modified while cfg stays in use.
+ * Returns NULL in case of failure. */
+struct nh_config *nh_config_copy(const struct nh_config *cfg);
+
+void nh_config_free(struct nh_config *cfg);
+
+/* Maps <SPI,SI> to sfid, 0 meaning end of chain. Packets leaving the
+ * chain are sent on port index port, SF hops use the SF's. Returns -1
+ * in case of failure. */
+int nh_config_add_sph(struct nh_config *cfg, uint32_t sph, uint16_t sfid, uint8_t port);
+
+/* Maps sfid to the SF's instances. Returns -1 in case of failure. */
+int nh_config_add_sf(struct nh_config *cfg, uint16_t sfid, const struct nh_sf_pool *pool);
+
+/* Number of <SPI,SI> and SF entries in cfg, and the maximum of each */
+void nh_config_usage(const struct nh_config *cfg, uint32_t *nb_sph, uint32_t *nb_sf,
+    uint32_t *max_entries);
+
+/* Remove the entry of <SPI,SI> sph or SF sfid. Return -1 if there
+ * is none. */
+int nh_config_del_sph(struct nh_config *cfg, uint32_t sph);
+
+int nh_config_del_sf(struct nh_config *cfg, uint16_t sfid);
+
+/* Compiles cfg into a lookup table allocated on socket_id. <SPI,SI>
+ * entries pointing to unknown SFs are left as drops. Returns NULL in
+ * case of failure. */
+struct nh_table *nh_table_build(const struct nh_config *cfg, int socket_id);
+
+void nh_table_free(struct nh_table *table);
+
+/* Compiles cfg into one table per socket running lcores, in tables
+ * indexed by socket id. Returns -1 in case of failure, leaving none
+ * built. */
+int nh_table_build_all(const struct nh_config *cfg, struct nh_table *tables[RTE_MAX_NUMA_NODES]);
+
+void nh_table_free_all(struct nh_table *tables[RTE_MAX_NUMA_NODES]);
+
+/* Prints the packets sent to each instance of every pool of the
+ * per-socket copies of a table */
+void nh_table_print_stats(FILE *f, struct nh_table *const tables[RTE_MAX_NUMA_NODES]);
+
+/* Same as a JSON object member, for telemetry */
+void nh_table_print_json(FILE *f, struct nh_table *const tables[RTE_MAX_NUMA_NODES]);
+
+/* Path of an SPI outside the directly indexed ones, NULL if none */
+static inline const struct nh_entry *
+nh_lookup_sparse(const struct nh_table *table, uint32_t spi){
+    uint32_t lo = 0, hi = table->nb_sparse, mid;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(table->sparse[mid].spi == spi)
+            return table->sparse[mid].path;
+        if(table->sparse[mid].spi < spi)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/* Returns the next hop of <SPI,SI> sph (host order). The action of
+ * the entry is NH_ACTION_DROP if there is no path. */
+static inline const struct nh_entry *
+nh_lookup(const struct nh_table *table, uint32_t sph){
+    static const struct nh_entry nh_drop = { .action = NH_ACTION_DROP };
+    uint32_t spi = (sph & NSH_SPI_MASK) >> 8;
+    const struct nh_entry *path;
+
+    if(likely(spi < table->nb_spi))
+        path = table->paths[spi];
+    else
+        path = nh_lookup_sparse(table,spi);
+
+    if(unlikely(path == NULL))
+        return &nh_drop;
+
+    return &path[sph & NSH_SI_MASK];
+}
+
+/* Instance of the pool of nh a flow goes to, counted as sent */
+static inline const struct nh_instance *
+nh_pool_pick(const struct nh_table *table, const struct nh_entry *nh, uint32_t flow_hash){
+    const struct nh_pool *pool = &table->pools[nh->pool];
+    uint8_t idx = pool->lut[flow_hash % NH_POOL_LUT_SIZE];
+
+    pool->stats[rte_lcore_id()].pkts[idx]++;
+
+    return &pool->instances[idx];
+}
+
+/* Points the outer headers of mbuf to the forwarding next hop nh,
+ * from its egress port. Pooled SFs get the instance of the inner
+ * flow of mbuf. */
+static inline void
+nh_rewrite(const struct nh_table *table, const struct nh_entry *nh, struct rte_mbuf *mbuf){
+    const struct nh_instance *inst;
+    const uint16_t port_idx = nh->port;
+
+    if(nh->pool != 0){
+        inst = nh_pool_pick(table,nh,common_flow_hash(mbuf));
+
+        if(inst->tunnel != 0)
+            common_vxlan_rewrite(mbuf,&table->tunnels[inst->tunnel],port_idx);
+        else
+            common_mac_update(mbuf,&sfcapp_cfg.ports[port_idx].mac,&inst->mac);
+        return;
+    }
+
+    if(nh->tunnel != 0)
+        common_vxlan_rewrite(mbuf,&table->tunnels[nh->tunnel],port_idx);
+    else
+        common_mac_update(mbuf,&sfcapp_cfg.ports[port_idx].mac,&nh->mac);
+}
+
+#endif
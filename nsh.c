@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <rte_mbuf.h>
 #include <rte_ether.h>
@@ -7,35 +8,63 @@
 #include <rte_ip.h>
 #include <rte_udp.h>
 #include <rte_log.h>
+#include <rte_memcpy.h>
 
 #include "nsh.h"
 #include "common.h"
 #include "vxlan_gpe.h"
 
-extern struct rte_mempool *sfcapp_pktmbuf_pool;
+/* Makes sure the outer headers plus extra bytes are in the first
+ * segment, so they can be moved with a single memmove. */
+static inline int nsh_check_first_seg(struct rte_mbuf *mbuf, uint16_t len){
+    if(likely(rte_pktmbuf_data_len(mbuf) >= len))
+        return 0;
 
-void nsh_encap(struct rte_mbuf* mbuf, struct nsh_hdr *nsh_info){
-    int i;
-    char *init_inner;
-    uint16_t tun_hdr_sz;
-    uint16_t offset;
+    /* Headers split among segments, should be really rare */
+    if(rte_pktmbuf_linearize(mbuf) < 0 || rte_pktmbuf_data_len(mbuf) < len)
+        return -1;
+
+    return 0;
+}
+
+int nsh_encap(struct rte_mbuf* mbuf, struct nsh_hdr *nsh_info, const struct nsh_md *md){
+    char *new_start;
+    const uint16_t tun_hdr_sz = VXLAN_OUTER_HDR_LEN;
+    uint16_t md_len, offset;
     struct nsh_hdr *nsh_header;
     struct vxlan_hdr *vxl_hdr;
     uint32_t vxlan_flags;
 
-    /* TODO: Check if packet is VXLAN or not */
-    if(!rte_pktmbuf_is_contiguous(mbuf))
-        rte_exit(EXIT_FAILURE,"Not contiguous!! Don't know what to do.\n");
+    md_len = md != NULL ? md->len : 0;
+    if(nsh_info->md_type == NSH_MD_TYPE_1 && md == NULL)
+        md_len = NSH_MD1_CONTEXT_LEN;
+
+    if(unlikely(nsh_info->md_type == NSH_MD_TYPE_1 && md_len != NSH_MD1_CONTEXT_LEN)){
+        RTE_LOG(NOTICE,USER1,"Failed to encapsulate packet. Wrong MD type 1 context length.\n");
+        return -1;
+    }
 
-    offset = sizeof(struct nsh_hdr);
+    offset = sizeof(struct nsh_hdr) + md_len;
 
-    rte_pktmbuf_append(mbuf,offset);
+    /* TODO: Check if packet is VXLAN or not */
+    if(unlikely(nsh_check_first_seg(mbuf,tun_hdr_sz) < 0)){
+        RTE_LOG(NOTICE,USER1,"Failed to encapsulate packet. Outer headers not in first segment.\n");
+        return -1;
+    }
 
-    if(mbuf == NULL){
-        RTE_LOG(NOTICE,USER1,"Failed to encapsulate packet. Not enough room.\n");
-        return;
+    /* Open the NSH gap by moving only the outer headers into
+     * the headroom. The inner packet is left untouched. */
+    new_start = rte_pktmbuf_prepend(mbuf,offset);
+
+    if(unlikely(new_start == NULL)){
+        RTE_LOG(NOTICE,USER1,"Failed to encapsulate packet. Not enough headroom.\n");
+        return -1;
     }
 
+    memmove(new_start,new_start + offset,tun_hdr_sz);
+
+    common_vxlan_adjust_len(mbuf,offset);
+
     vxl_hdr = rte_pktmbuf_mtod_offset(mbuf,struct vxlan_hdr *,sizeof(struct ether_hdr) + 
             sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr));
     
@@ -49,24 +78,27 @@ void nsh_encap(struct rte_mbuf* mbuf, struct nsh_hdr *nsh_info){
 
     vxl_hdr->vx_flags = rte_cpu_to_be_32(vxlan_flags);
 
-    tun_hdr_sz = (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) 
-        + sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr));
-
-    init_inner = (char*) mbuf->buf_addr + rte_pktmbuf_headroom(mbuf);
-
-    for(i = (int) mbuf->pkt_len ; i >= tun_hdr_sz  ; i--)
-        init_inner[i] = init_inner[i-offset];
-    
-    nsh_header = rte_pktmbuf_mtod_offset(mbuf,struct nsh_hdr *,tun_hdr_sz);
-    nsh_header->basic_info  = rte_cpu_to_be_16(nsh_info->basic_info);
+    nsh_header = (struct nsh_hdr *) (new_start + tun_hdr_sz);
+    nsh_header->basic_info  = rte_cpu_to_be_16((nsh_info->basic_info & ~NSH_LENGTH_MASK) |
+                                               (offset >> 2));
     nsh_header->md_type     = nsh_info->md_type;
     nsh_header->next_proto  = nsh_info->next_proto;
     nsh_header->serv_path   = rte_cpu_to_be_32(nsh_info->serv_path);
+
+    if(unlikely(md_len != 0)){
+        if(md != NULL)
+            rte_memcpy(nsh_header + 1,md->data,md_len);
+        else
+            memset(nsh_header + 1,0,md_len);
+    }
+
+    return 0;
 }
 
-void nsh_decap(struct rte_mbuf* mbuf){
-    int i;
-    char *init_new_inner;
+int nsh_decap(struct rte_mbuf* mbuf){
+    char *old_start;
+    const uint16_t tun_hdr_sz = VXLAN_OUTER_HDR_LEN;
+    const struct nsh_hdr *nsh_header;
     uint16_t offset;
     struct vxlan_hdr *vxl_hdr;
     uint32_t vxlan_flags;
@@ -74,9 +106,19 @@ void nsh_decap(struct rte_mbuf* mbuf){
     //printf("\n=== Full packet ===\n");
     //rte_pktmbuf_dump(stdout,mbuf,mbuf->pkt_len);
 
-    if(!rte_pktmbuf_is_contiguous(mbuf)){
-        RTE_LOG(NOTICE,USER1,"Could not append to mbuf\n");
-        return;
+    if(unlikely(nsh_check_first_seg(mbuf,tun_hdr_sz + sizeof(struct nsh_hdr)) < 0)){
+        RTE_LOG(NOTICE,USER1,"Failed to decapsulate packet. NSH header not in first segment.\n");
+        return -1;
+    }
+
+    /* Metadata goes along with the header */
+    nsh_header = rte_pktmbuf_mtod_offset(mbuf,const struct nsh_hdr *,tun_hdr_sz);
+    offset = (rte_be_to_cpu_16(nsh_header->basic_info) & NSH_LENGTH_MASK) << 2;
+
+    if(unlikely(offset < sizeof(struct nsh_hdr) ||
+                nsh_check_first_seg(mbuf,tun_hdr_sz + offset) < 0)){
+        RTE_LOG(NOTICE,USER1,"Failed to decapsulate packet. Bad NSH length.\n");
+        return -1;
     }
 
     vxl_hdr = rte_pktmbuf_mtod_offset(mbuf,struct vxlan_hdr *,sizeof(struct ether_hdr) + 
@@ -92,18 +134,15 @@ void nsh_decap(struct rte_mbuf* mbuf){
 
     vxl_hdr->vx_flags = rte_cpu_to_be_32(vxlan_flags);
 
-    /* Get pointer to beginning of inner packet data */
-    init_new_inner = (char*) mbuf->buf_addr + rte_pktmbuf_headroom(mbuf) + 
-        sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + 
-        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr);
-    
-    offset = sizeof(struct nsh_hdr);
+    /* Close the NSH gap by moving the outer headers over it and
+     * releasing the freed bytes back to the headroom. */
+    old_start = rte_pktmbuf_mtod(mbuf,char *);
+    memmove(old_start + offset,old_start,tun_hdr_sz);
+    rte_pktmbuf_adj(mbuf,offset);
 
-    /* Shift inner packet left to use NSH header space */
-    for(i = 0; i < (int) mbuf->pkt_len ; i++)
-        init_new_inner[i] = init_new_inner[i+offset];    
-    
-    rte_pktmbuf_trim(mbuf,offset);
+    common_vxlan_adjust_len(mbuf,-offset);
+
+    return 0;
 }
 
 int nsh_dec_si(struct rte_mbuf* mbuf){
@@ -149,6 +188,7 @@ int nsh_init_header(struct nsh_hdr *nsh_header){
 
 int nsh_get_header(struct rte_mbuf *mbuf, struct nsh_hdr *nsh_info){
     struct nsh_hdr *nsh_hdr;
+    uint16_t len;
 
     nsh_hdr = rte_pktmbuf_mtod_offset(mbuf,struct nsh_hdr *, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) +
         sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr));
@@ -159,6 +199,104 @@ int nsh_get_header(struct rte_mbuf *mbuf, struct nsh_hdr *nsh_info){
     nsh_info->next_proto = nsh_hdr->next_proto;
     nsh_info->serv_path = rte_cpu_to_be_32(nsh_hdr->serv_path);
 
+    /* MD type 1 has a fixed length, others at least the base */
+    len = nsh_info->basic_info & NSH_LENGTH_MASK;
+    if(unlikely(len < NSH_BASE_LENGHT_MD_TYPE_2 ||
+                (nsh_info->md_type == NSH_MD_TYPE_1 && len != NSH_LENGTH_MD_TYPE_1)))
+        return -1;
+
+    return 0;
+}
+
+int nsh_get_md(struct rte_mbuf *mbuf, const struct nsh_hdr *nsh_info, struct nsh_md *md){
+    const uint16_t md_len = nsh_md_len(nsh_info);
+    const void *data;
+
+    if(unlikely(md_len > NSH_MAX_MD_LEN))
+        return -1;
+
+    data = rte_pktmbuf_read(mbuf,VXLAN_OUTER_HDR_LEN + sizeof(struct nsh_hdr),
+        md_len,md->data);
+    if(unlikely(data == NULL))
+        return -1;
+
+    if(data != md->data)
+        rte_memcpy(md->data,data,md_len);
+    md->len = md_len;
+
+    return 0;
+}
+
+int nsh_md_add_tlv(struct nsh_md *md, uint16_t md_class, uint8_t type,
+    const void *value, uint8_t len){
+    const uint16_t padded = RTE_ALIGN_CEIL(len,4);
+    struct nsh_tlv *tlv;
+
+    if(len > NSH_TLV_LEN_MASK || md->len + sizeof(*tlv) + padded > NSH_MAX_MD_LEN)
+        return -1;
+
+    tlv = (struct nsh_tlv *) (md->data + md->len);
+    tlv->md_class = rte_cpu_to_be_16(md_class);
+    tlv->type = type;
+    tlv->len = len;
+    memcpy(tlv + 1,value,len);
+    memset((uint8_t *) (tlv + 1) + len,0,padded - len);
+
+    md->len += sizeof(*tlv) + padded;
+
+    return 0;
+}
+
+/* Handlers by MD class, a handful at most */
+static struct {
+    uint16_t md_class;
+    nsh_tlv_handler_t fn;
+    void *arg;
+} nsh_tlv_classes[NSH_MAX_TLV_CLASSES];
+
+static unsigned nsh_nb_tlv_classes;
+
+int nsh_register_tlv_class(uint16_t md_class, nsh_tlv_handler_t fn, void *arg){
+
+    if(nsh_nb_tlv_classes == NSH_MAX_TLV_CLASSES){
+        RTE_LOG(ERR,USER1,"Too many NSH TLV classes. Maximum is %d.\n",
+            NSH_MAX_TLV_CLASSES);
+        return -1;
+    }
+
+    nsh_tlv_classes[nsh_nb_tlv_classes].md_class = md_class;
+    nsh_tlv_classes[nsh_nb_tlv_classes].fn = fn;
+    nsh_tlv_classes[nsh_nb_tlv_classes].arg = arg;
+    nsh_nb_tlv_classes++;
+
+    return 0;
+}
+
+int nsh_md_dispatch(struct rte_mbuf *mbuf, const struct nsh_md *md){
+    const struct nsh_tlv *tlv;
+    uint16_t off, len, md_class;
+    unsigned c;
+
+    for(off = 0 ; off < md->len ; off += sizeof(*tlv) + RTE_ALIGN_CEIL(len,4)){
+        if(unlikely(off + sizeof(*tlv) > md->len))
+            return -1;
+
+        tlv = (const struct nsh_tlv *) (md->data + off);
+        len = tlv->len & NSH_TLV_LEN_MASK;
+
+        if(unlikely(off + sizeof(*tlv) + len > md->len))
+            return -1;
+
+        md_class = rte_be_to_cpu_16(tlv->md_class);
+        for(c = 0 ; c < nsh_nb_tlv_classes ; c++){
+            if(nsh_tlv_classes[c].md_class == md_class){
+                nsh_tlv_classes[c].fn(mbuf,tlv,(const uint8_t *) (tlv + 1),
+                    nsh_tlv_classes[c].arg);
+                break;
+            }
+        }
+    }
+
     return 0;
 }
 
@@ -170,8 +308,8 @@ uint64_t nsh_header_to_uint64(struct nsh_hdr *nsh_info){
 }
 
 void nsh_uint64_to_header(uint64_t hdr_int, struct nsh_hdr *nsh_info){
-    nsh_info->basic_info = (uint8_t)  (hdr_int>>48);
+    nsh_info->basic_info = (uint16_t) (hdr_int>>48);
     nsh_info->md_type    = (uint8_t)  (hdr_int>>40);
-    nsh_info->next_proto = (uint16_t) (hdr_int>>32);
+    nsh_info->next_proto = (uint8_t)  (hdr_int>>32);
     nsh_info->serv_path  = (uint32_t) (hdr_int);
 }
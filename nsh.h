@@ -16,6 +16,10 @@
 
 #define NSH_LENGTH_MD_TYPE_1        0x0006
 #define NSH_BASE_LENGHT_MD_TYPE_2   0x0002
+#define NSH_LENGTH_MASK             0x003F  /* Header length, in 4-byte words */
+
+#define NSH_MD1_CONTEXT_LEN 16      /* Fixed context of MD type 1 */
+#define NSH_MAX_MD_LEN      64      /* Metadata bytes nsh_get_md() can copy */
 
 #define NSH_MD_TYPE_MASK    0x00000F00
 #define NSH_MD_TYPE_0       0x00
@@ -34,6 +38,14 @@
 #define NSH_NEXT_PROTO_EXP1  0xFE
 #define NSH_NEXT_PROTO_EXP2  0xFF
 
+/* MD type 2 TLVs stamped by the classifier, in an experimental class */
+#define NSH_MD_CLASS_SFCAPP  0xFFF6
+#define NSH_TLV_TENANT       0x01   /* 4 bytes, tenant of the flow */
+#define NSH_TLV_FLOW_ID      0x02   /* 4 bytes, hash of the inner 5-tuple */
+
+#define NSH_TLV_LEN_MASK     0x7F
+#define NSH_MAX_TLV_CLASSES  8
+
 struct nsh_hdr {
     uint16_t basic_info; /* Ver, OAM bit, Unused and TTL */
     uint8_t md_type;
@@ -45,16 +57,38 @@ struct nsh_spi {
     uint8_t spi_bytes[NSH_SPI_LEN];
 } __attribute__((__packed__));
 
-/* Encapsulates the packet in pkt_mbuf in NSH header with
- * NSH parameters given by nsh_hdr. This app considers that
- * NSH packets don't contain metadata
+/* MD type 2 TLV header, followed by its value padded to 4 bytes */
+struct nsh_tlv {
+    uint16_t md_class;
+    uint8_t type;
+    uint8_t len;        /* Value bytes, in the low 7 bits */
+} __attribute__((__packed__));
+
+/* Metadata following the base and service path headers, as on the
+ * wire: the MD type 1 fixed context or MD type 2 TLVs */
+struct nsh_md {
+    uint16_t len;       /* Bytes, a multiple of 4 */
+    uint8_t data[NSH_MAX_MD_LEN];
+};
+
+/* Called by nsh_md_dispatch() for every TLV of the class it was
+ * registered for. value points to the TLV's value. */
+typedef void (*nsh_tlv_handler_t)(struct rte_mbuf *mbuf, const struct nsh_tlv *tlv,
+    const uint8_t *value, void *arg);
+
+/* Encapsulates the VXLAN packet in mbuf in NSH header with
+ * NSH parameters given by nsh_hdr, followed by the metadata md.
+ * With md NULL, MD type 1 packets get a zero context and others
+ * no metadata. The length field is set from the metadata. Only the
+ * outer headers are moved (into the headroom), the inner packet is
+ * not copied. Returns -1 in case of failure.
  */
-void nsh_encap(struct rte_mbuf* mbuf, struct nsh_hdr *nsh_info);
+int nsh_encap(struct rte_mbuf* mbuf, struct nsh_hdr *nsh_info, const struct nsh_md *md);
 
-/* Decapsulates the packet in pkt_mbuf, removing the NSH
- * header.
+/* Decapsulates the packet in mbuf, removing the NSH
+ * header and its metadata. Returns -1 in case of failure.
  */
-void nsh_decap(struct rte_mbuf* pkt_mbuf);
+int nsh_decap(struct rte_mbuf* mbuf);
 
 /* Decrements the value of SI in a NSH encapsulated packet.
  * Returns -1 in case o failure.
@@ -66,10 +100,34 @@ int nsh_dec_si(struct rte_mbuf* pkt_mbuf);
 int nsh_init_header(struct nsh_hdr *nsh_header);
 
 /* Copies the nsh header info contained in mbuf to nsh_hdr.
- * Returns -1 in case of failure.
+ * Returns -1 if the length field is not valid for the MD type.
  */ 
 int nsh_get_header(struct rte_mbuf *mbuf, struct nsh_hdr *nsh_info);
 
+/* Bytes of metadata after the header nsh_info, as read by
+ * nsh_get_header() */
+static inline uint16_t nsh_md_len(const struct nsh_hdr *nsh_info){
+    return ((nsh_info->basic_info & NSH_LENGTH_MASK) << 2) - sizeof(struct nsh_hdr);
+}
+
+/* Copies the metadata of mbuf, whose header is nsh_info, to md.
+ * Returns -1 if it is longer than NSH_MAX_MD_LEN. */
+int nsh_get_md(struct rte_mbuf *mbuf, const struct nsh_hdr *nsh_info, struct nsh_md *md);
+
+/* Appends a TLV to the MD type 2 metadata md. Returns -1 if it does
+ * not fit. */
+int nsh_md_add_tlv(struct nsh_md *md, uint16_t md_class, uint8_t type,
+    const void *value, uint8_t len);
+
+/* Registers fn for the TLVs of class md_class. Must be called before
+ * the workers start. Returns -1 if the table is full. */
+int nsh_register_tlv_class(uint16_t md_class, nsh_tlv_handler_t fn, void *arg);
+
+/* Calls the registered handler of every TLV of md, MD type 2
+ * metadata of mbuf. TLVs of other classes are skipped. Returns -1 if
+ * md is malformed. */
+int nsh_md_dispatch(struct rte_mbuf *mbuf, const struct nsh_md *md);
+
 /* Converts a struct nsh_hdr into a 64b unsigned integer */ 
 uint64_t nsh_header_to_uint64(struct nsh_hdr *nsh_info);
 
@@ -1,8 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 #include <rte_ether.h>
 #include <rte_ip.h>
+#include <rte_acl.h>
+#include <rte_log.h>
 
 #include "parser.h"
 #include "common.h"
@@ -39,6 +45,9 @@ enum sfcapp_type parse_apptype(const char *type){
     
     if(strcmp(type,"loopback") == 0)
         return SFC_LOOPBACK;
+
+    if(strcmp(type,"generator") == 0)
+        return SFC_GENERATOR;
     return NONE;
 }
 
@@ -69,16 +78,24 @@ int parse_uint16(const char *str, uint16_t *res, int radix){
     return 0;
 }
 
+/* strtoull() accepts a sign and wraps negative values around, and
+ * unsigned long may be wider than 32 bits */
 int parse_uint32(const char* str, uint32_t *res, int radix){
+    const char *p = str;
     char *end;
 
+    while(isspace((unsigned char) *p))
+        p++;
+    if(*p == '-')
+        return -1;
+
     errno = 0;
-    uint32_t val = strtoul(str, &end, radix);
+    unsigned long long val = strtoull(str, &end, radix);
 
-    if (errno == ERANGE || errno == EINVAL || end == str || *end != '\0')
+    if (errno == ERANGE || errno == EINVAL || end == str || *end != '\0' || val > UINT32_MAX)
         return -1;
 
-    *res = val;
+    *res = (uint32_t) val;
     
     return 0;
 }
@@ -131,41 +148,262 @@ int parse_ipv4(const char *str, uint32_t *ipv4){
     return 0;
 }
 
-static void parse_global_section(struct rte_cfgfile_entry *entries, int nb_entries){
+int parse_ipv4_prefix(const char *str, uint32_t *ipv4, uint8_t *depth){
+    char buf[CFG_VALUE_LEN];
+    char *slash;
 
-    int ret;
-    const char* SECTION_NAME = "GLOBAL";
-    int NARGS = 1;
+    /* Any address */
+    if(strcmp(str,"*") == 0){
+        *ipv4 = 0;
+        *depth = 0;
+        return 0;
+    }
 
-    if(nb_entries != 1)
-        rte_exit(EXIT_FAILURE,
-            "Wrong number of arguments in global section in config file. Expected %d, found %d",
-            NARGS,nb_entries);
+    snprintf(buf,sizeof(buf),"%s",str);
+    slash = strchr(buf,'/');
 
-    if(strcmp(entries[0].name,"sff_mac") == 0){
-        ret = parse_ether(entries[0].value,&sfcapp_cfg.sff_addr);
-        SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse mac address from config file\n");
+    if(slash == NULL){
+        *depth = 32;
     }else{
-        rte_exit(EXIT_FAILURE,
-            "Entry %s unknown in section %s, please check config file.\n",
-            entries[0].name,SECTION_NAME); 
+        *slash = '\0';
+        if(parse_uint8(slash + 1,depth,10) < 0 || *depth > 32)
+            return -1;
+    }
+
+    if(parse_ipv4(buf,ipv4) < 0)
+        return -1;
+
+    /* Clear host bits */
+    if(*depth < 32)
+        *ipv4 &= *depth == 0 ? 0 : ~((1U << (32 - *depth)) - 1);
+
+    return 0;
+}
+
+int parse_ipv6(const char *str, uint8_t *ipv6){
+    char buf[CFG_VALUE_LEN];
+    char *slash;
+
+    snprintf(buf,sizeof(buf),"%s",str);
+    slash = strchr(buf,'/');
+
+    if(slash != NULL){
+        if(strcmp(slash + 1,"128") != 0)
+            return -1;
+        *slash = '\0';
+    }
+
+    return inet_pton(AF_INET6,buf,ipv6) == 1 ? 0 : -1;
+}
+
+int parse_port_range(const char *str, uint16_t *lo, uint16_t *hi){
+    char buf[CFG_VALUE_LEN];
+    char *dash;
+
+    /* Any port */
+    if(strcmp(str,"*") == 0){
+        *lo = 0;
+        *hi = UINT16_MAX;
+        return 0;
+    }
+
+    snprintf(buf,sizeof(buf),"%s",str);
+    dash = strchr(buf,'-');
+
+    if(dash == NULL){
+        if(parse_uint16(buf,lo,10) < 0)
+            return -1;
+        *hi = *lo;
+        return 0;
+    }
+
+    *dash = '\0';
+    if(parse_uint16(buf,lo,10) < 0 || parse_uint16(dash + 1,hi,10) < 0 || *lo > *hi)
+        return -1;
+
+    return 0;
+}
+
+int parse_vni(const char *str, uint32_t *vni){
+    uint32_t val;
+
+    if(parse_uint32(str,&val,0) < 0 || val > VXLAN_MAX_VNI)
+        return -1;
+
+    *vni = val;
+    return 0;
+}
+
+int parse_priority(const char *str, int32_t *priority){
+    uint32_t val;
+
+    if(parse_uint32(str,&val,10) < 0 || val < RTE_ACL_MIN_PRIORITY + 1 ||
+       val > RTE_ACL_MAX_PRIORITY)
+        return -1;
+
+    *priority = (int32_t) val;
+    return 0;
+}
+
+/* Runtime parameters, by the name used both in the global section
+ * of the config file and as long command line option */
+static const struct {
+    const char *name;
+    size_t offset;
+} sfcapp_param_list[] = {
+    { "rx_desc",              offsetof(struct sfcapp_params,nb_rx_desc) },
+    { "tx_desc",              offsetof(struct sfcapp_params,nb_tx_desc) },
+    { "burst_size",           offsetof(struct sfcapp_params,burst_size) },
+    { "nb_mbuf",              offsetof(struct sfcapp_params,nb_mbuf) },
+    { "classifier_max_flows", offsetof(struct sfcapp_params,classifier_max_flows) },
+    { "classifier_max_flows6",offsetof(struct sfcapp_params,classifier_max_flows6) },
+    { "forwarder_table_size", offsetof(struct sfcapp_params,forwarder_table_size) },
+    { "proxy_max_flows",      offsetof(struct sfcapp_params,proxy_max_flows) },
+    { "proxy_max_flows6",     offsetof(struct sfcapp_params,proxy_max_flows6) },
+    { "proxy_max_functions",  offsetof(struct sfcapp_params,proxy_max_functions) },
+    { "proxy_flow_timeout",   offsetof(struct sfcapp_params,proxy_flow_timeout_ms) },
+    { "bench_pkts",           offsetof(struct sfcapp_params,bench_pkts) },
+    { "bench_flows",          offsetof(struct sfcapp_params,bench_flows) },
+    { "bench_sph",            offsetof(struct sfcapp_params,bench_sph) },
+    { "bench_pkt_len",        offsetof(struct sfcapp_params,bench_pkt_len) },
+    { "gen_rate",             offsetof(struct sfcapp_params,gen_rate) },
+    { "gen_encap",            offsetof(struct sfcapp_params,gen_encap) },
+    { "gen_paths",            offsetof(struct sfcapp_params,gen_paths) },
+    { "latency",              offsetof(struct sfcapp_params,latency) },
+    { "pipeline_workers",     offsetof(struct sfcapp_params,pipeline_workers) },
+    { "pipeline_tx",          offsetof(struct sfcapp_params,pipeline_tx) },
+    { "pipeline_ring_size",   offsetof(struct sfcapp_params,pipeline_ring_size) },
+    { "pipeline_batch",       offsetof(struct sfcapp_params,pipeline_batch) },
+    { "prefetch_distance",    offsetof(struct sfcapp_params,prefetch_distance) },
+    { "classifier_md",        offsetof(struct sfcapp_params,classifier_md) },
+    { "proxy_mode",           offsetof(struct sfcapp_params,proxy_mode) },
+};
+
+int parse_param(const char *name, const char *value){
+    unsigned i;
+    uint32_t *field;
+
+    for(i = 0 ; i < RTE_DIM(sfcapp_param_list) ; i++){
+        if(strcmp(name,sfcapp_param_list[i].name) != 0)
+            continue;
+
+        field = (uint32_t *) ((char *) &sfcapp_cfg.params + sfcapp_param_list[i].offset);
+
+        return parse_uint32(value,field,0) < 0 ? -EINVAL : 0;
     }
+
+    return -ENOENT;
 }
 
-static void parse_sf_section(struct rte_cfgfile_entry *entries, int nb_entries){
+const char *parse_param_name(unsigned idx){
+    if(idx >= RTE_DIM(sfcapp_param_list))
+        return NULL;
+
+    return sfcapp_param_list[idx].name;
+}
+
+/* Errors in the sections below are reported and returned instead of
+ * being fatal, so that a bad file given for a reload leaves the
+ * running configuration untouched. */
+#define PARSE_FAIL(...) do { RTE_LOG(ERR,USER1,__VA_ARGS__); return -1; } while(0)
+#define PARSE_CHECK(cond,...) do { if(!(cond)) PARSE_FAIL(__VA_ARGS__); } while(0)
+
+static void parse_global_section(struct rte_cfgfile_entry *entries, int nb_entries){
+
     int j,ret;
-    int sfid_ok, mac_ok;
-    struct ether_addr sfmac;
+    unsigned port;
+    int len;
+    const char* SECTION_NAME = "GLOBAL";
+
+    for(j = 0 ; j < nb_entries ; j++){
+        if(strcmp(entries[j].name,"sff_mac") == 0){
+            ret = parse_ether(entries[j].value,&sfcapp_cfg.sff_addr);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse mac address from config file\n");
+        }else if(strcmp(entries[j].name,"sff_ip") == 0){
+            ret = parse_ipv4(entries[j].value,&sfcapp_cfg.sff_ip);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse sff_ip from config file\n");
+        }else if(strcmp(entries[j].name,"sff_vni") == 0){
+            ret = parse_vni(entries[j].value,&sfcapp_cfg.sff_vni);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse sff_vni from config file\n");
+        }else if(strcmp(entries[j].name,"sff_port") == 0){
+            ret = parse_uint32(entries[j].value,&port,10);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse sff_port from config file\n");
+            if(port >= sfcapp_cfg.nb_ports)
+                rte_exit(EXIT_FAILURE,"No port %u for entry %s.\n",port,entries[j].name);
+            sfcapp_cfg.sff_port = port;
+        }else if((len = 0, sscanf(entries[j].name,"port%u_ip%n",&port,&len)) == 1 &&
+                 len > 0 && entries[j].name[len] == '\0'){
+            /* Local VTEP of port N, "portN_ip" */
+            if(port >= MAX_NB_PORTS)
+                rte_exit(EXIT_FAILURE,"No port %u for entry %s.\n",port,entries[j].name);
+            ret = parse_ipv4(entries[j].value,&sfcapp_cfg.ports[port].ip);
+            SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse port address from config file\n");
+        }else{
+            ret = parse_param(entries[j].name,entries[j].value);
+            if(ret == -EINVAL)
+                rte_exit(EXIT_FAILURE,"Failed to parse %s from config file\n",
+                    entries[j].name);
+            if(ret == -ENOENT)
+                rte_exit(EXIT_FAILURE,
+                    "Entry %s unknown in section %s, please check config file.\n",
+                    entries[j].name,SECTION_NAME); 
+        }
+    }
+}
+
+/* Splits a comma separated list in place, skipping blanks around
+ * items. Returns the number of items, or -1 if there are more than
+ * max or one of them is empty. */
+static int parse_list(char *str, char **items, int max){
+    char *item, *save, *end;
+    int n;
+
+    for(n = 0, item = strtok_r(str,",",&save) ; item != NULL ;
+        item = strtok_r(NULL,",",&save)){
+        while(*item == ' ' || *item == '\t')
+            item++;
+
+        end = item + strlen(item);
+        while(end > item && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+
+        if(*item == '\0' || n == max)
+            return -1;
+
+        items[n++] = item;
+    }
+
+    return n;
+}
+
+/* mac, ip and weight may list the instances of a pool, in the same
+ * order. A single ip is shared by all instances, which are all behind
+ * port. */
+static int parse_sf_section(struct rte_cfgfile_entry *entries, int nb_entries){
+    int i,j,ret;
+    int sfid_ok, mac_ok, ip_ok, vni_ok, weight_ok, port_ok;
+    int nb_ip, nb_weight;
+    struct nh_sf_pool pool;
+    uint32_t vni;
     uint16_t sfid;
+    char buf[CFG_VALUE_LEN];
+    char *items[NH_MAX_INSTANCES];
     const char* SECTION_NAME = "SF";
 
     sfid_ok = 0;
     mac_ok = 0;
+    ip_ok = 0;
+    vni_ok = 0;
+    weight_ok = 0;
+    port_ok = 0;
+    nb_ip = nb_weight = 0;
     sfid = 0;
+    vni = VXLAN_DEFAULT_VNI;
+    memset(&pool,0,sizeof(pool));
+    pool.port = NH_DEFAULT_PORT;
 
-    if(nb_entries != 2)
-        rte_exit(EXIT_FAILURE,
-            "Wrong argument number in SF section in config file. Expected 2, found %d",
+    if(nb_entries < 2 || nb_entries > 6)
+        PARSE_FAIL("Wrong argument number in SF section in config file. Expected 2 to 6, found %d\n",
             nb_entries);
 
     for(j = 0 ; j < nb_entries ; j++){
@@ -176,7 +414,7 @@ static void parse_sf_section(struct rte_cfgfile_entry *entries, int nb_entries){
                 printf("Duplicated sfid entry in SF section. Ignoring...\n");
             else{
                 ret = parse_uint16(entries[j].value,&sfid,10);
-                SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse SF ID from config file\n");
+                PARSE_CHECK(ret >= 0,"Failed to parse SF ID from config file\n");
                 sfid_ok = 1;
             }
 
@@ -184,49 +422,125 @@ static void parse_sf_section(struct rte_cfgfile_entry *entries, int nb_entries){
             if(mac_ok)
                 printf("Duplicated mac entry in SF section. Ignoring...\n");
             else{
-                ret = parse_ether(entries[j].value,&sfmac);
-                SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse mac address from config file\n");
+                snprintf(buf,sizeof(buf),"%s",entries[j].value);
+                ret = parse_list(buf,items,NH_MAX_INSTANCES);
+                PARSE_CHECK(ret > 0,"Expected 1 to %d SF instance mac addresses\n",
+                    NH_MAX_INSTANCES);
+                pool.nb_instances = ret;
+
+                for(i = 0 ; i < pool.nb_instances ; i++){
+                    ret = parse_ether(items[i],&pool.addr[i].mac);
+                    PARSE_CHECK(ret >= 0,"Failed to parse mac address from config file\n");
+                }
                 mac_ok = 1;
             }
 
+        }else if(strcmp(entries[j].name,"ip") == 0){
+            if(ip_ok)
+                printf("Duplicated ip entry in SF section. Ignoring...\n");
+            else{
+                snprintf(buf,sizeof(buf),"%s",entries[j].value);
+                nb_ip = parse_list(buf,items,NH_MAX_INSTANCES);
+                PARSE_CHECK(nb_ip > 0,"Expected 1 to %d SF VTEP addresses\n",
+                    NH_MAX_INSTANCES);
+
+                for(i = 0 ; i < nb_ip ; i++){
+                    ret = parse_ipv4(items[i],&pool.addr[i].ip);
+                    PARSE_CHECK(ret >= 0,"Failed to parse SF VTEP address from config file\n");
+                }
+                ip_ok = 1;
+            }
+
+        }else if(strcmp(entries[j].name,"vni") == 0){
+            if(vni_ok)
+                printf("Duplicated vni entry in SF section. Ignoring...\n");
+            else{
+                ret = parse_vni(entries[j].value,&vni);
+                PARSE_CHECK(ret >= 0,"Failed to parse SF VNI from config file\n");
+                vni_ok = 1;
+            }
+
+        }else if(strcmp(entries[j].name,"weight") == 0){
+            if(weight_ok)
+                printf("Duplicated weight entry in SF section. Ignoring...\n");
+            else{
+                snprintf(buf,sizeof(buf),"%s",entries[j].value);
+                nb_weight = parse_list(buf,items,NH_MAX_INSTANCES);
+                PARSE_CHECK(nb_weight > 0,"Expected 1 to %d SF instance weights\n",
+                    NH_MAX_INSTANCES);
+
+                for(i = 0 ; i < nb_weight ; i++){
+                    ret = parse_uint8(items[i],&pool.weights[i],10);
+                    PARSE_CHECK(ret >= 0 && pool.weights[i] > 0,
+                        "SF instance weights must be between 1 and %u\n",UINT8_MAX);
+                }
+                weight_ok = 1;
+            }
+
+        }else if(strcmp(entries[j].name,"port") == 0){
+            if(port_ok)
+                printf("Duplicated port entry in SF section. Ignoring...\n");
+            else{
+                ret = parse_uint8(entries[j].value,&pool.port,10);
+                PARSE_CHECK(ret >= 0,"Failed to parse SF port from config file\n");
+                port_ok = 1;
+            }
+
         }else{
-            rte_exit(EXIT_FAILURE,
-                "Entry %s unknown in section %s, please check config file.\n",
+            PARSE_FAIL("Entry %s unknown in section %s, please check config file.\n",
                 entries[j].name,SECTION_NAME); 
         } 
     }
 
+    if(vni_ok && !ip_ok)
+        printf("SF %" PRIu16 " has a vni but no ip, vni ignored.\n",sfid);
+
     if(mac_ok && sfid_ok){
+        PARSE_CHECK(!ip_ok || nb_ip == 1 || nb_ip == pool.nb_instances,
+            "SF %" PRIu16 " needs one ip or one per mac address\n",sfid);
+        PARSE_CHECK(!weight_ok || nb_weight == pool.nb_instances,
+            "SF %" PRIu16 " needs one weight per mac address\n",sfid);
+
+        for(i = 0 ; i < pool.nb_instances ; i++){
+            if(nb_ip == 1)
+                pool.addr[i].ip = pool.addr[0].ip;
+            pool.addr[i].vni = vni;
+            if(!weight_ok)
+                pool.weights[i] = 1;
+        }
+
         switch(sfcapp_cfg.type){
             case SFC_FORWARDER:
-                forwarder_add_sf_address_entry(sfid,&sfmac);
-                break;
+                return forwarder_add_sf_address_entry(sfid,&pool);
             case SFC_PROXY:
-                proxy_add_sf_address_entry(sfid,&sfmac);
-                break;
+                return proxy_add_sf_address_entry(sfid,&pool);
             default:
-                rte_exit(EXIT_FAILURE,
-                "Config file parsing failed. \"SF\" sections do not" 
+                PARSE_FAIL("Config file parsing failed. \"SF\" sections do not" 
                 "apply to this type of application.\n");
         }
     }
+
+    return 0;
 }
 
-static void parse_sfc_node_section(struct rte_cfgfile_entry *entries, int nb_entries){
+/* port only applies to the end of chain, sfid 0. Packets to an SF
+ * leave through the SF's port. */
+static int parse_sfc_node_section(struct rte_cfgfile_entry *entries, int nb_entries){
     int j,ret;
-    int sfid_ok,sph_ok;
+    int sfid_ok,sph_ok,port_ok;
     uint16_t sfid;
     uint32_t sph;
+    uint8_t port;
     const char* SECTION_NAME = "SFC_NODE";
 
-    if(nb_entries != 2)
-        rte_exit(EXIT_FAILURE,
-            "Wrong argument number in \"SFC_NODE\" section in config file."
-            "Expected 2, found %d",
+    if(nb_entries < 2 || nb_entries > 3)
+        PARSE_FAIL("Wrong argument number in \"SFC_NODE\" section in config file."
+            " Expected 2 or 3, found %d\n",
             nb_entries);
 
     sph = sfid = 0;
-    sfid_ok = sph_ok = 0;
+    port = NH_DEFAULT_PORT;
+    sfid_ok = sph_ok = port_ok = 0;
 
     for(j = 0 ; j < nb_entries ; j++){
         
@@ -235,7 +549,7 @@ static void parse_sfc_node_section(struct rte_cfgfile_entry *entries, int nb_ent
                 printf("Duplicated sfid entry in PATH_NODE section. Ignoring...\n");
             else{
                 ret = parse_uint16(entries[j].value,&sfid,10);
-                SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse SF ID from config file\n");
+                PARSE_CHECK(ret >= 0,"Failed to parse SF ID from config file\n");
                 sfid_ok = 1;
             }
         }else if(strcmp(entries[j].name,"sph") == 0){
@@ -243,12 +557,19 @@ static void parse_sfc_node_section(struct rte_cfgfile_entry *entries, int nb_ent
                 printf("Duplicated mac entry in PATH_NODE section. Ignoring...\n");
             else{
                 ret = parse_uint32(entries[j].value,&sph,16);
-                SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to parse service path info from config file\n");
+                PARSE_CHECK(ret >= 0,"Failed to parse service path info from config file\n");
                 sph_ok = 1;
             }
+        }else if(strcmp(entries[j].name,"port") == 0){
+            if(port_ok)
+                printf("Duplicated port entry in PATH_NODE section. Ignoring...\n");
+            else{
+                ret = parse_uint8(entries[j].value,&port,10);
+                PARSE_CHECK(ret >= 0,"Failed to parse egress port from config file\n");
+                port_ok = 1;
+            }
         }else{
-            rte_exit(EXIT_FAILURE,
-                "Entry %s unknown in section %s, please check config file.\n",
+            PARSE_FAIL("Entry %s unknown in section %s, please check config file.\n",
                 entries[j].name,SECTION_NAME); 
         }         
     }
@@ -256,35 +577,71 @@ static void parse_sfc_node_section(struct rte_cfgfile_entry *entries, int nb_ent
     if(sph_ok && sfid_ok){
         switch(sfcapp_cfg.type){
             case SFC_FORWARDER:
-                forwarder_add_sph_entry(sph,sfid);
-                break;
+                return forwarder_add_sph_entry(sph,sfid,port);
             case SFC_PROXY:
-                proxy_add_sph_entry(sph,sfid);
-                break;
+                return proxy_add_sph_entry(sph,sfid,port);
             default:
-                rte_exit(EXIT_FAILURE,
-                "Config file parsing failed. \"SFC_NODE\" sections do not" 
+                PARSE_FAIL("Config file parsing failed. \"SFC_NODE\" sections do not" 
                 "apply to this type of application.\n");
         }
     }
+
+    return 0;
 }
 
-static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_entries){
-    struct ipv4_5tuple tuple;
+/* Removal of an SF, by "sfid" */
+static int parse_sf_del(struct rte_cfgfile_entry *entries, int nb_entries){
+    uint16_t sfid;
+
+    PARSE_CHECK(nb_entries == 1 && strcmp(entries[0].name,"sfid") == 0 &&
+        parse_uint16(entries[0].value,&sfid,10) == 0,
+        "Expected sfid=<id> to remove an SF.\n");
+
+    switch(sfcapp_cfg.type){
+        case SFC_FORWARDER:
+            return forwarder_del_sf_address_entry(sfid);
+        case SFC_PROXY:
+            return proxy_del_sf_address_entry(sfid);
+        default:
+            PARSE_FAIL("\"SF\" entries do not apply to this type of application.\n");
+    }
+}
+
+/* Removal of a path node, by "sph" */
+static int parse_sfc_node_del(struct rte_cfgfile_entry *entries, int nb_entries){
+    uint32_t sph;
+
+    PARSE_CHECK(nb_entries == 1 && strcmp(entries[0].name,"sph") == 0 &&
+        parse_uint32(entries[0].value,&sph,16) == 0,
+        "Expected sph=<hex> to remove an SFC_NODE.\n");
+
+    switch(sfcapp_cfg.type){
+        case SFC_FORWARDER:
+            return forwarder_del_sph_entry(sph);
+        case SFC_PROXY:
+            return proxy_del_sph_entry(sph);
+        default:
+            PARSE_FAIL("\"SFC_NODE\" entries do not apply to this type of application.\n");
+    }
+}
+
+/* Also used to remove rules, then sfp is optional and ignored */
+static int parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_entries, int del){
+    struct flow_class_rule rule;
     int ipsrc_ok,ipdst_ok;
     int dport_ok,sport_ok;
-    int proto_ok,sfp_ok;
+    int proto_ok,sfp_ok,prio_ok,tenant_ok;
+    int src_v6,dst_v6;
     int dup,ret,j;
     uint32_t sfp;
     const char* SECTION_NAME = "FLOW_CLASS";
-    const int N_ENTRIES = 6;
+    const int MAX_ENTRIES = 8;
 
-    if(nb_entries != 6)
-        rte_exit(EXIT_FAILURE,
-            "Wrong argument number in \"%s\" section in config file."
-            "Expected %d, found %d",
+    if(nb_entries < 1 || nb_entries > MAX_ENTRIES)
+        PARSE_FAIL("Wrong argument number in \"%s\" section in config file."
+            " Expected at most %d, found %d\n",
             SECTION_NAME,
-            N_ENTRIES,
+            MAX_ENTRIES,
             nb_entries);
     
     dup = 0;
@@ -292,7 +649,13 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
     ipsrc_ok = ipdst_ok = 0;
     dport_ok = sport_ok = 0;
     sfp = 0;
-    proto_ok = sfp_ok = 0;
+    proto_ok = sfp_ok = prio_ok = tenant_ok = 0;
+    src_v6 = dst_v6 = 0;
+
+    /* Omitted fields match anything */
+    memset(&rule,0,sizeof(rule));
+    rule.sport_hi = rule.dport_hi = UINT16_MAX;
+    rule.priority = CLASSIFIER_DEFAULT_PRIORITY;
 
     for(j = 0 ; j < nb_entries ; j++){
         
@@ -300,7 +663,12 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
             if(ipsrc_ok)
                 dup = -1;
             else{
-                ret = parse_ipv4(entries[j].value,&tuple.src_ip);
+                src_v6 = strchr(entries[j].value,':') != NULL;
+                if(src_v6){
+                    ret = parse_ipv6(entries[j].value,rule.src_ip6);
+                    rule.src_depth = 128;
+                }else
+                    ret = parse_ipv4_prefix(entries[j].value,&rule.src_ip,&rule.src_depth);
                 if(ret<0) printf("Failed to parse IP src\n");
                 ipsrc_ok = 1;
             }
@@ -308,7 +676,12 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
             if(ipdst_ok)
                 dup = -1;
             else{
-                ret = parse_ipv4(entries[j].value,&tuple.dst_ip);
+                dst_v6 = strchr(entries[j].value,':') != NULL;
+                if(dst_v6){
+                    ret = parse_ipv6(entries[j].value,rule.dst_ip6);
+                    rule.dst_depth = 128;
+                }else
+                    ret = parse_ipv4_prefix(entries[j].value,&rule.dst_ip,&rule.dst_depth);
                 if(ret<0) printf("Failed to parse IP dst\n");
                 ipdst_ok = 1;
             }
@@ -316,7 +689,7 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
             if(sport_ok)
                 dup = -1;
             else{
-                ret = parse_uint16(entries[j].value,&tuple.src_port,10);
+                ret = parse_port_range(entries[j].value,&rule.sport_lo,&rule.sport_hi);
                 if(ret<0) printf("Failed to parse source port\n");
                 sport_ok = 1;
             }
@@ -324,7 +697,7 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
             if(dport_ok)
                 dup = -1;
             else{
-                ret = parse_uint16(entries[j].value,&tuple.dst_port,10);
+                ret = parse_port_range(entries[j].value,&rule.dport_lo,&rule.dport_hi);
                 if(ret<0) printf("Failed to parse dest port\n");
                 dport_ok = 1;
             }
@@ -332,7 +705,12 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
             if(proto_ok)
                 dup = -1;
             else{
-                ret = parse_uint8(entries[j].value,&tuple.proto,10);
+                if(strcmp(entries[j].value,"*") == 0)
+                    rule.proto_mask = 0;
+                else{
+                    ret = parse_uint8(entries[j].value,&rule.proto,10);
+                    rule.proto_mask = 0xFF;
+                }
                 if(ret<0) printf("Failed to parse protocol\n");
                 proto_ok = 1;
             }
@@ -344,42 +722,64 @@ static void parse_flow_class_section(struct rte_cfgfile_entry *entries, int nb_e
                 if(ret<0) printf("Failed to parse sfp\n");
                 sfp_ok = 1;
             }
+        }else if(strcmp(entries[j].name,"priority") == 0){
+            if(prio_ok)
+                dup = -1;
+            else{
+                ret = parse_priority(entries[j].value,&rule.priority);
+                if(ret<0) printf("Failed to parse priority\n");
+                prio_ok = 1;
+            }
+        }else if(strcmp(entries[j].name,"tenant") == 0){
+            if(tenant_ok)
+                dup = -1;
+            else{
+                ret = parse_uint32(entries[j].value,&rule.tenant,10);
+                if(ret<0) printf("Failed to parse tenant\n");
+                tenant_ok = 1;
+            }
         }else{
-            rte_exit(EXIT_FAILURE,
-                "Entry %s unknown in section %s, please check config file.\n",
+            PARSE_FAIL("Entry %s unknown in section %s, please check config file.\n",
                 entries[j].name,SECTION_NAME); 
         }
 
-        if(ret < 0) rte_exit(EXIT_FAILURE,"Failed to parse params in %s section from config file\n",
+        if(ret < 0) PARSE_FAIL("Failed to parse params in %s section from config file\n",
             SECTION_NAME);    
-        if(dup < 0) rte_exit(EXIT_FAILURE,"Found duplicate entries in %s section from config file.\n",
+        if(dup < 0) PARSE_FAIL("Found duplicate entries in %s section from config file.\n",
             SECTION_NAME); 
     }
 
-    if(ipsrc_ok && ipdst_ok && sport_ok && dport_ok && proto_ok && sfp_ok){
+    /* Both addresses of a rule are of the same family */
+    if((src_v6 && ipdst_ok && !dst_v6) || (dst_v6 && ipsrc_ok && !src_v6))
+        PARSE_FAIL("IPv4 and IPv6 addresses mixed in %s section.\n",SECTION_NAME);
+    rule.ipv6 = src_v6 || dst_v6;
+
+    if(del){
+        if(sfcapp_cfg.type == SFC_CLASSIFIER)
+            return classifier_del_flow_class_rule(&rule);
+        else PARSE_FAIL("\"%s\" entries do not apply to this type of application.\n",
+                SECTION_NAME);
+    }
+
+    if(sfp_ok){
         if(sfcapp_cfg.type == SFC_CLASSIFIER){
             if(sfp <= 0xFFFFFF)
-                classifier_add_flow_class_entry(&tuple,sfp);
+                return classifier_add_flow_class_rule(&rule,sfp);
             else
-                rte_exit(EXIT_FAILURE,
-                    "SFP id too big. Maximum is 0xFFFFFF");
+                PARSE_FAIL("SFP id too big. Maximum is 0xFFFFFF\n");
         }
-        else rte_exit(EXIT_FAILURE,
-                "Config file parsing failed. \"%s\" sections do not" 
+        else PARSE_FAIL("Config file parsing failed. \"%s\" sections do not" 
                 " apply to this type of application.\n",SECTION_NAME);
     }else
-        rte_exit(EXIT_FAILURE,"Missing parameters in \"%s\" section from config file\n",SECTION_NAME);
+        PARSE_FAIL("Missing sfp parameter in \"%s\" section from config file\n",SECTION_NAME);
 
 }
 
-void parse_config_file(char* cfg_filename){
+void parse_global_config(char* cfg_filename){
 
     int nb_entries;
-    int i;
-    struct rte_cfgfile_entry entries[10];
+    struct rte_cfgfile_entry entries[CFG_SECTION_MAX_ENTRIES];
     struct rte_cfgfile *cfgfile;
-    char** sections;
-    int nb_sections;
     struct rte_cfgfile_parameters cfg_params = {.comment_character = '#'};
 
     cfgfile = rte_cfgfile_load_with_params(cfg_filename,CFG_FLAG_GLOBAL_SECTION,&cfg_params);
@@ -387,50 +787,237 @@ void parse_config_file(char* cfg_filename){
     if(cfgfile == NULL)
         rte_exit(EXIT_FAILURE,
             "Failed to load config file\n");
-    
+
+    if(rte_cfgfile_has_section(cfgfile,"GLOBAL")){
+        nb_entries = rte_cfgfile_section_entries(cfgfile,"GLOBAL",entries,
+                        CFG_SECTION_MAX_ENTRIES);
+        parse_global_section(entries,nb_entries);
+    }
+
+    rte_cfgfile_close(cfgfile);
+}
+
+/* Serializes reloads, which may come from several control paths */
+static pthread_mutex_t parse_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int config_begin(void){
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+            return classifier_config_begin();
+        case SFC_FORWARDER:
+            return forwarder_config_begin();
+        case SFC_PROXY:
+            return proxy_config_begin();
+        default:
+            return 0;
+    }
+}
+
+static int config_edit(void){
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+            return classifier_config_edit();
+        case SFC_FORWARDER:
+            return forwarder_config_edit();
+        case SFC_PROXY:
+            return proxy_config_edit();
+        default:
+            return 0;
+    }
+}
+
+static void config_abort(void){
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+            classifier_config_abort();
+            break;
+        case SFC_FORWARDER:
+            forwarder_config_abort();
+            break;
+        case SFC_PROXY:
+            proxy_config_abort();
+            break;
+        default:
+            break;
+    }
+}
+
+/* Compiles the new tables now that all SFs, paths and rules are
+ * known, and swaps them in */
+static int config_commit(void){
+    switch(sfcapp_cfg.type){
+        case SFC_CLASSIFIER:
+            return classifier_build_tables();
+        case SFC_FORWARDER:
+            return forwarder_build_tables();
+        case SFC_PROXY:
+            return proxy_build_tables();
+        default:
+            return 0;
+    }
+}
+
+static int parse_sections(struct rte_cfgfile *cfgfile){
+
+    int nb_entries;
+    int i, ret;
+    struct rte_cfgfile_entry entries[CFG_SECTION_MAX_ENTRIES];
+    char** sections;
+    int nb_sections;
+
     nb_sections = rte_cfgfile_num_sections(cfgfile,NULL,0);
 
-    if(nb_sections <= 0)
-        rte_exit(EXIT_FAILURE,
-            "Not enough sections in config file\n");
+    if(nb_sections <= 0){
+        RTE_LOG(ERR,USER1,"Not enough sections in config file\n");
+        return -1;
+    }
 
-    sections = (char**) malloc(nb_sections*sizeof(char*));
+    sections = (char**) calloc(nb_sections,sizeof(char*));
 
-    if(sections == NULL)
-        rte_exit(EXIT_FAILURE,
-            "Failed to allocate memory when parsing config file.\n");
+    if(sections == NULL){
+        RTE_LOG(ERR,USER1,"Failed to allocate memory when parsing config file.\n");
+        return -1;
+    }
     
-    for(i = 0 ; i < nb_sections ; i++){
+    ret = 0;
+    for(i = 0 ; i < nb_sections && ret == 0 ; i++){
         sections[i] = (char*) malloc(CFG_NAME_LEN*sizeof(char));    
      
-        if(sections[i] == NULL)
-            rte_exit(EXIT_FAILURE,
-                "Failed to allocate memory when parsing config file.\n");
+        if(sections[i] == NULL){
+            RTE_LOG(ERR,USER1,"Failed to allocate memory when parsing config file.\n");
+            ret = -1;
+        }
     }
 
-    rte_cfgfile_sections(cfgfile,sections,CFG_FILE_MAX_SECTIONS);
+    if(ret == 0)
+        rte_cfgfile_sections(cfgfile,sections,nb_sections);
     
     /* Parse sections */
-    for(i = 0 ; i < nb_sections ; i++){
+    for(i = 0 ; i < nb_sections && ret == 0 ; i++){
 
         nb_entries = rte_cfgfile_section_entries_by_index(cfgfile,i,sections[i],
-                        entries,10);
+                        entries,CFG_SECTION_MAX_ENTRIES);
 
         /* Parse SF Sections */
         if(strcmp(sections[i],"SF") == 0)
-            parse_sf_section(entries,nb_entries);
+            ret = parse_sf_section(entries,nb_entries);
         else if(strcmp(sections[i],"SFC_NODE") == 0)
-            parse_sfc_node_section(entries,nb_entries);
+            ret = parse_sfc_node_section(entries,nb_entries);
         else if(strcmp(sections[i],"FLOW_CLASS") == 0)
-            parse_flow_class_section(entries,nb_entries);
+            ret = parse_flow_class_section(entries,nb_entries,0);
         else if(strcmp(sections[i],"GLOBAL") == 0)
-            parse_global_section(entries,nb_entries);
-        else
-            rte_exit(EXIT_FAILURE,
-                "Section %s unknown, please check config file.\n",
-                sections[i]);  
+            continue; /* Already read by parse_global_config() */
+        else{
+            RTE_LOG(ERR,USER1,"Section %s unknown, please check config file.\n",
+                sections[i]);
+            ret = -1;
+        }
     }
 
+    for(i = 0 ; i < nb_sections ; i++)
+        free(sections[i]);
     free(sections);
+
+    return ret;
+}
+
+int parse_config_file(const char* cfg_filename){
+
+    struct rte_cfgfile *cfgfile;
+    struct rte_cfgfile_parameters cfg_params = {.comment_character = '#'};
+    int ret;
+
+    pthread_mutex_lock(&parse_config_lock);
+
+    cfgfile = rte_cfgfile_load_with_params(cfg_filename,CFG_FLAG_GLOBAL_SECTION,&cfg_params);
+    
+    if(cfgfile == NULL){
+        RTE_LOG(ERR,USER1,"Failed to load config file %s\n",cfg_filename);
+        pthread_mutex_unlock(&parse_config_lock);
+        return -1;
+    }
+
+    ret = config_begin();
+
+    if(ret == 0)
+        ret = parse_sections(cfgfile);
+
     rte_cfgfile_close(cfgfile);
-}
\ No newline at end of file
+
+    if(ret == 0)
+        ret = config_commit();
+    else
+        config_abort();
+
+    pthread_mutex_unlock(&parse_config_lock);
+
+    return ret;
+}
+
+int parse_update_begin(void){
+    int ret;
+
+    pthread_mutex_lock(&parse_config_lock);
+
+    ret = config_edit();
+    if(ret < 0)
+        pthread_mutex_unlock(&parse_config_lock);
+
+    return ret;
+}
+
+int parse_update(char *line){
+    struct rte_cfgfile_entry entries[CFG_SECTION_MAX_ENTRIES];
+    char *op, *section, *name, *value, *save;
+    int nb_entries, del;
+
+    op = strtok_r(line," \t",&save);
+    section = strtok_r(NULL," \t",&save);
+
+    PARSE_CHECK(op != NULL && section != NULL,
+        "Expected <add|del> <section> [name=value ...]\n");
+
+    if(strcmp(op,"add") == 0)
+        del = 0;
+    else if(strcmp(op,"del") == 0)
+        del = 1;
+    else
+        PARSE_FAIL("Unknown update %s, expected add or del.\n",op);
+
+    for(nb_entries = 0 ; (name = strtok_r(NULL," \t",&save)) != NULL ; nb_entries++){
+        value = strchr(name,'=');
+
+        PARSE_CHECK(value != NULL && value != name,"Expected name=value, found %s.\n",name);
+        PARSE_CHECK(nb_entries < CFG_SECTION_MAX_ENTRIES,"Too many entries in update.\n");
+
+        *value++ = '\0';
+
+        PARSE_CHECK(strlen(name) < CFG_NAME_LEN && strlen(value) < CFG_VALUE_LEN,
+            "Entry %s too long.\n",name);
+
+        strcpy(entries[nb_entries].name,name);
+        strcpy(entries[nb_entries].value,value);
+    }
+
+    if(strcmp(section,"SF") == 0)
+        return del ? parse_sf_del(entries,nb_entries) :
+            parse_sf_section(entries,nb_entries);
+
+    if(strcmp(section,"SFC_NODE") == 0)
+        return del ? parse_sfc_node_del(entries,nb_entries) :
+            parse_sfc_node_section(entries,nb_entries);
+
+    if(strcmp(section,"FLOW_CLASS") == 0)
+        return parse_flow_class_section(entries,nb_entries,del);
+
+    PARSE_FAIL("Section %s cannot be updated.\n",section);
+}
+
+int parse_update_commit(void){
+    int ret;
+
+    ret = config_commit();
+    pthread_mutex_unlock(&parse_config_lock);
+
+    return ret;
+}
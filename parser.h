@@ -17,6 +17,56 @@ int parse_ether(const char *str, struct ether_addr *eth_addr);
 
 int parse_ipv4(const char *str, uint32_t *ipv4);
 
-void parse_config_file(char* cfg_filename);
+/* Parses "a.b.c.d[/depth]" or "*" (any address, depth 0) */
+int parse_ipv4_prefix(const char *str, uint32_t *ipv4, uint8_t *depth);
+
+/* Parses an IPv6 address, optionally followed by "/128". Prefixes
+ * are not supported. */
+int parse_ipv6(const char *str, uint8_t *ipv6);
+
+/* Parses "port", "lo-hi" or "*" (any port) */
+int parse_port_range(const char *str, uint16_t *lo, uint16_t *hi);
+
+/* Parses a 24-bit VXLAN Network Identifier */
+int parse_vni(const char *str, uint32_t *vni);
+
+int parse_priority(const char *str, int32_t *priority);
+
+/* Sets the runtime parameter called name in sfcapp_cfg.params.
+ * Returns 0 on success, -ENOENT if there is no such parameter and
+ * -EINVAL if value is not a valid number. */
+int parse_param(const char *name, const char *value);
+
+/* Name of the idx-th runtime parameter, NULL past the last one */
+const char *parse_param_name(unsigned idx);
+
+/* Reads only the global section of the config file, which holds
+ * parameters needed before the tables are created. */
+void parse_global_config(char* cfg_filename);
+
+/* Reads the SF, SFC_NODE and FLOW_CLASS sections of the config file
+ * and replaces the current tables with the ones they describe. On
+ * error nothing is replaced and -1 is returned. May be called again
+ * while workers are running, but not from a worker. */
+int parse_config_file(const char* cfg_filename);
+
+/* Runtime updates, written like config file sections on one line:
+ *
+ *   add SF sfid=2 mac=00:00:00:00:00:02
+ *   del SFC_NODE sph=000001FF
+ *   del FLOW_CLASS ipsrc=10.0.0.0/8 proto=6
+ *
+ * "add" replaces an entry with the same key, "del" takes only the
+ * key (sfid, sph, or all fields of a FLOW_CLASS but sfp and
+ * priority). Updates are staged by parse_update() on a copy of the
+ * current configuration, between parse_update_begin() and
+ * parse_update_commit(), which swaps the new tables in at once. A
+ * failed update changes nothing, the others of the batch are kept.
+ * Same restrictions as parse_config_file(). line is modified. */
+int parse_update_begin(void);
+
+int parse_update(char *line);
+
+int parse_update_commit(void);
 
 #endif /* PARSER_H_ */
\ No newline at end of file
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#include "common.h"
+#include "rcu.h"
+#include "pipeline.h"
+
+extern struct sfcapp_config sfcapp_cfg;
+
+/* From RX lcores to each worker, one per port */
+static struct rte_ring *pipeline_rx_rings[RTE_MAX_LCORE][MAX_NB_PORTS];
+
+/* From workers to the TX lcore owning each port */
+static struct rte_ring *pipeline_tx_rings[MAX_NB_PORTS];
+
+static unsigned pipeline_nb_workers;
+static unsigned pipeline_nb_tx;
+
+/* Index among workers, by lcore id */
+static unsigned pipeline_worker_idx[RTE_MAX_LCORE];
+
+/* Index among TX lcores, by lcore id */
+static unsigned pipeline_tx_idx[RTE_MAX_LCORE];
+
+/* TX lcore sending on port_idx */
+static inline unsigned pipeline_tx_of(int port_idx){
+    return port_idx % pipeline_nb_tx;
+}
+
+static struct rte_ring *pipeline_ring_create(const char *name, unsigned socket,
+    unsigned flags){
+    struct rte_ring *r;
+
+    r = rte_ring_create(name,sfcapp_cfg.params.pipeline_ring_size,socket,flags);
+    if(r == NULL)
+        rte_exit(EXIT_FAILURE,"Failed to create ring %s.\n",name);
+
+    return r;
+}
+
+void pipeline_setup(void){
+    const unsigned nb_rx = sfcapp_cfg.nb_queues;
+    char name[RTE_RING_NAMESIZE];
+    struct lcore_cfg *lc;
+    unsigned lcore_id, n, w, t;
+    uint16_t i;
+
+    pipeline_nb_workers = sfcapp_cfg.params.pipeline_workers;
+    pipeline_nb_tx = sfcapp_cfg.params.pipeline_tx;
+
+    n = 0;
+    w = 0;
+    t = 0;
+    RTE_LCORE_FOREACH(lcore_id){
+        lc = &sfcapp_cfg.lcores[lcore_id];
+
+        if(n < nb_rx){
+            lc->role = LCORE_RX;
+        }else if(n < nb_rx + pipeline_nb_workers){
+            lc->role = LCORE_WORKER;
+            lc->queue_id = 0;
+            pipeline_worker_idx[lcore_id] = w;
+
+            /* Only read by this worker, written by every RX lcore */
+            for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+                snprintf(name,sizeof(name),"rx_ring_%u_%u",w,i);
+                pipeline_rx_rings[w][i] = pipeline_ring_create(name,
+                    rte_lcore_to_socket_id(lcore_id),
+                    RING_F_SC_DEQ | (nb_rx == 1 ? RING_F_SP_ENQ : 0));
+            }
+
+            w++;
+        }else{
+            lc->role = LCORE_TX;
+            lc->queue_id = 0;
+            pipeline_tx_idx[lcore_id] = t;
+
+            /* Only the rings of the ports it owns, on its socket */
+            for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+                if(pipeline_tx_of(i) != t)
+                    continue;
+
+                snprintf(name,sizeof(name),"tx_ring_%u",i);
+                pipeline_tx_rings[i] = pipeline_ring_create(name,
+                    rte_lcore_to_socket_id(lcore_id),
+                    RING_F_SC_DEQ | (pipeline_nb_workers == 1 ? RING_F_SP_ENQ : 0));
+            }
+
+            t++;
+        }
+
+        n++;
+    }
+
+    /* Workers stage packets for the TX lcores */
+    RTE_LCORE_FOREACH(lcore_id){
+        lc = &sfcapp_cfg.lcores[lcore_id];
+        if(lc->role != LCORE_WORKER)
+            continue;
+
+        for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+            lc->tx_ring[i] = rte_zmalloc_socket(NULL,sizeof(struct ring_buffer),0,
+                rte_lcore_to_socket_id(lcore_id));
+            if(lc->tx_ring[i] == NULL)
+                rte_exit(EXIT_FAILURE,"Failed to allocate ring buffer.\n");
+
+            lc->tx_ring[i]->ring = pipeline_tx_rings[i];
+            lc->tx_ring[i]->size = sfcapp_cfg.params.pipeline_batch;
+        }
+    }
+
+    printf("Pipeline of %u RX lcore(s), %u worker(s) and %u TX lcore(s)\n",
+        nb_rx,pipeline_nb_workers,pipeline_nb_tx);
+}
+
+/* Worker of a packet, by inner 5-tuple for VXLAN traffic and
+ * 5-tuple otherwise, so that a flow always goes to the same one
+ * whatever the NIC RSS hash saw of it */
+static inline unsigned pipeline_worker_of(struct rte_mbuf *mbuf){
+    return ((uint64_t) common_flow_hash(mbuf) * pipeline_nb_workers) >> 32;
+}
+
+static void pipeline_rx_loop(struct lcore_cfg *lcore, void (*periodic)(void)){
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+    struct rte_mbuf *out[RTE_MAX_LCORE][MAX_BURST_SIZE];
+    uint16_t nb_out[RTE_MAX_LCORE];
+    const uint16_t burst_size = sfcapp_cfg.params.burst_size;
+    const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
+    uint64_t prev_tsc, cur_tsc;
+    uint16_t i, nb_rx;
+    unsigned w, n;
+    int p;
+
+    prev_tsc = 0;
+    memset(nb_out,0,sizeof(nb_out));
+
+    /* periodic prints the stats of the tables on the master, which
+     * must then be a reader like the workers */
+    if(periodic != NULL)
+        rcu_online(rte_lcore_id());
+
+    for(;;){
+        cur_tsc = rte_rdtsc();
+        if(unlikely(periodic != NULL && cur_tsc - prev_tsc > drain_tsc)){
+            periodic();
+            prev_tsc = cur_tsc;
+        }
+
+        for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+            nb_rx = rte_eth_rx_burst(sfcapp_cfg.ports[p].id,lcore->queue_id,pkts,burst_size);
+            if(nb_rx == 0)
+                continue;
+
+            lcore->stats.port[p].rx_pkts += nb_rx;
+
+            common_prefetch_burst(pkts,nb_rx);
+
+            for(i = 0 ; i < nb_rx ; i++){
+                common_prefetch_next(pkts,i,nb_rx);
+                w = pipeline_worker_of(pkts[i]);
+                out[w][nb_out[w]++] = pkts[i];
+            }
+
+            for(w = 0 ; w < pipeline_nb_workers ; w++){
+                if(nb_out[w] == 0)
+                    continue;
+
+                n = rte_ring_enqueue_burst(pipeline_rx_rings[w][p],(void * const *) out[w],
+                    nb_out[w],NULL);
+
+                /* Worker falling behind */
+                for( ; n < nb_out[w] ; n++)
+                    common_drop_pkt(lcore,out[w][n],DROP_RING_FULL);
+
+                nb_out[w] = 0;
+            }
+        }
+
+        if(periodic != NULL)
+            rcu_quiescent(rte_lcore_id());
+    }
+}
+
+static void pipeline_worker_loop(struct lcore_cfg *lcore, void (*periodic)(void)){
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+    struct rte_ring **rings = pipeline_rx_rings[pipeline_worker_idx[rte_lcore_id()]];
+    const uint16_t batch = sfcapp_cfg.params.pipeline_batch;
+    const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
+    uint64_t prev_tsc, cur_tsc, start_tsc;
+    struct port_cfg *p_cfg;
+    unsigned i, nb_rx;
+    int p;
+
+    prev_tsc = 0;
+
+    rcu_online(rte_lcore_id());
+
+    for(;;){
+        cur_tsc = rte_rdtsc();
+
+        /* Partial batches go to the TX lcore too */
+        if(unlikely(cur_tsc - prev_tsc > drain_tsc)){
+            common_flush_tx_buffers(lcore);
+            prev_tsc = cur_tsc;
+
+            if(periodic != NULL)
+                periodic();
+        }
+
+        for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++){
+            p_cfg = &sfcapp_cfg.ports[p];
+
+            nb_rx = rte_ring_sc_dequeue_burst(rings[p],(void **) pkts,batch,NULL);
+
+            if(likely(nb_rx > 0 && p_cfg->handle_pkts != NULL)){
+                start_tsc = rte_rdtsc();
+                p_cfg->handle_pkts(lcore,pkts,nb_rx);
+                common_stats_burst(lcore,rte_rdtsc() - start_tsc);
+            }else{
+                for(i = 0 ; i < nb_rx ; i++)
+                    common_drop_pkt(lcore,pkts[i],DROP_NO_MATCH);
+            }
+        }
+
+        if(sfcapp_cfg.housekeeping != NULL)
+            sfcapp_cfg.housekeeping(lcore);
+
+        rcu_quiescent(rte_lcore_id());
+    }
+}
+
+static void pipeline_tx_loop(struct lcore_cfg *lcore, void (*periodic)(void)){
+    struct rte_mbuf *pkts[MAX_BURST_SIZE];
+    const uint16_t batch = sfcapp_cfg.params.pipeline_batch;
+    const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
+    const unsigned t = pipeline_tx_idx[rte_lcore_id()];
+    uint64_t prev_tsc, cur_tsc;
+    unsigned nb, sent;
+    int p;
+
+    prev_tsc = 0;
+
+    /* Same as pipeline_rx_loop() */
+    if(periodic != NULL)
+        rcu_online(rte_lcore_id());
+
+    for(;;){
+        cur_tsc = rte_rdtsc();
+        if(unlikely(periodic != NULL && cur_tsc - prev_tsc > drain_tsc)){
+            periodic();
+            prev_tsc = cur_tsc;
+        }
+
+        /* Ports p, p + T, ... are this lcore's alone */
+        for(p = t ; p < sfcapp_cfg.nb_ports ; p += pipeline_nb_tx){
+            nb = rte_ring_sc_dequeue_burst(pipeline_tx_rings[p],(void **) pkts,batch,NULL);
+            if(nb == 0)
+                continue;
+
+            sent = rte_eth_tx_burst(sfcapp_cfg.ports[p].id,lcore->queue_id,pkts,nb);
+            lcore->stats.port[p].tx_pkts += sent;
+
+            for( ; sent < nb ; sent++)
+                common_drop_pkt(lcore,pkts[sent],DROP_TX_FULL);
+        }
+
+        if(periodic != NULL)
+            rcu_quiescent(rte_lcore_id());
+    }
+}
+
+void pipeline_main_loop(struct lcore_cfg *lcore, void (*periodic)(void)){
+
+    switch(lcore->role){
+        case LCORE_RX:
+            pipeline_rx_loop(lcore,periodic);
+            break;
+        case LCORE_WORKER:
+            pipeline_worker_loop(lcore,periodic);
+            break;
+        case LCORE_TX:
+            pipeline_tx_loop(lcore,periodic);
+            break;
+        default:
+            rte_exit(EXIT_FAILURE,"Lcore %u has no pipeline stage.\n",rte_lcore_id());
+    }
+}
+
+void pipeline_print(FILE *f){
+    unsigned w;
+    int p;
+
+    if(pipeline_nb_workers == 0)
+        return;
+
+    for(w = 0 ; w < pipeline_nb_workers ; w++)
+        for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++)
+            fprintf(f,"Ring %s: %u/%u\n",pipeline_rx_rings[w][p]->name,
+                rte_ring_count(pipeline_rx_rings[w][p]),
+                rte_ring_count(pipeline_rx_rings[w][p]) +
+                rte_ring_free_count(pipeline_rx_rings[w][p]));
+
+    for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++)
+        fprintf(f,"Ring %s: %u/%u\n",pipeline_tx_rings[p]->name,
+            rte_ring_count(pipeline_tx_rings[p]),
+            rte_ring_count(pipeline_tx_rings[p]) + rte_ring_free_count(pipeline_tx_rings[p]));
+}
+
+static void pipeline_print_ring_json(FILE *f, const struct rte_ring *r, int first){
+    unsigned count = rte_ring_count(r);
+
+    fprintf(f,"%s{\"name\":\"%s\",\"count\":%u,\"capacity\":%u}",first ? "" : ",",
+        r->name,count,count + rte_ring_free_count(r));
+}
+
+void pipeline_print_json(FILE *f){
+    unsigned w;
+    int p;
+
+    fprintf(f,"\"pipeline\":{\"workers\":%u,\"tx\":%u,\"rings\":[",pipeline_nb_workers,
+        pipeline_nb_tx);
+
+    if(pipeline_nb_workers > 0){
+        for(w = 0 ; w < pipeline_nb_workers ; w++)
+            for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++)
+                pipeline_print_ring_json(f,pipeline_rx_rings[w][p],w == 0 && p == 0);
+
+        for(p = 0 ; p < sfcapp_cfg.nb_ports ; p++)
+            pipeline_print_ring_json(f,pipeline_tx_rings[p],0);
+    }
+
+    fprintf(f,"]}");
+}
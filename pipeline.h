@@ -0,0 +1,48 @@
+#ifndef SFCAPP_PIPELINE_
+#define SFCAPP_PIPELINE_
+
+#include <stdio.h>
+
+#include "common.h"
+
+/* Pipeline mode, enabled by the pipeline_workers parameter.
+ *
+ * Instead of every lcore polling its own queues, each lcore runs one
+ * stage, connected to the next one by rte_rings:
+ *
+ *   RX lcores      poll their RX queue of every port and spread the
+ *                  packets among workers by flow
+ *   worker lcores  run the role's handle_pkts and housekeeping
+ *   TX lcores      send what the workers handed them, on TX queue 0
+ *                  of the ports they own
+ *
+ * With N lcores, W pipeline_workers and T pipeline_tx, the first
+ * N-W-T lcores are RX lcores, the next W workers and the last T the
+ * TX lcores. Port p belongs to TX lcore p % T, so a TX queue is
+ * never shared and T cannot exceed the number of ports. This lets a
+ * NIC that cannot spread VXLAN traffic among many RX queues feed
+ * several workers. Packets of a flow, by inner 5-tuple for VXLAN
+ * traffic, always go to the same worker, so they stay in order and
+ * per-flow state stays on one lcore. Rings carry pipeline_batch
+ * packets at a time.
+ */
+
+#define PIPELINE_TX         1       /* Default pipeline_tx */
+#define PIPELINE_RING_SIZE  1024    /* Default pipeline_ring_size */
+#define PIPELINE_BATCH      32      /* Default pipeline_batch */
+
+/* Assigns lcore roles and creates the rings. Called once queues and
+ * TX buffers are set up. Exits on failure. */
+void pipeline_setup(void);
+
+/* Runs the stage of lcore, never returns. periodic, if not NULL, is
+ * called every BURST_TX_DRAIN_US. */
+void pipeline_main_loop(struct lcore_cfg *lcore, void (*periodic)(void));
+
+/* Prints the occupancy of every ring */
+void pipeline_print(FILE *f);
+
+/* Same as a JSON object member, for telemetry */
+void pipeline_print_json(FILE *f);
+
+#endif
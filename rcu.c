@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <sched.h>
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+
+#include "rcu.h"
+
+/* Starts above RCU_OFFLINE so that online slots are never offline */
+uint64_t rcu_token = RCU_OFFLINE + 1;
+
+struct rcu_lcore rcu_lcores[RTE_MAX_LCORE];
+
+void rcu_online(unsigned lcore_id){
+    rcu_quiescent(lcore_id);
+}
+
+void rcu_offline(unsigned lcore_id){
+    __atomic_store_n(&rcu_lcores[lcore_id].seen,RCU_OFFLINE,__ATOMIC_RELEASE);
+}
+
+void rcu_synchronize(void){
+    uint64_t token, seen;
+    unsigned lcore_id;
+
+    token = __atomic_add_fetch(&rcu_token,1,__ATOMIC_SEQ_CST);
+
+    RTE_LCORE_FOREACH(lcore_id){
+        for(;;){
+            seen = __atomic_load_n(&rcu_lcores[lcore_id].seen,__ATOMIC_ACQUIRE);
+
+            if(seen == RCU_OFFLINE || seen >= token)
+                break;
+
+            /* Might share a CPU with a worker */
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef SFCAPP_RCU_
+#define SFCAPP_RCU_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+
+/* Quiescent-state based reclamation of tables replaced at runtime.
+ *
+ * Workers only hold pointers to shared tables while handling a burst.
+ * Between bursts they report a quiescent state, copying the current
+ * token into their own slot. A writer publishes the new table with
+ * rcu_assign_pointer(), then calls rcu_synchronize(), which bumps the
+ * token and waits until every online worker has reported it. After
+ * that, no worker can still see the old table and it can be freed.
+ *
+ * This is what rte_rcu_qsbr provides in later DPDK releases.
+ */
+
+#define RCU_OFFLINE 0               /* Slot value of lcores not polling */
+
+struct rcu_lcore {
+    uint64_t seen;                  /* Last token seen, RCU_OFFLINE if none */
+} __rte_cache_aligned;
+
+extern uint64_t rcu_token;
+extern struct rcu_lcore rcu_lcores[RTE_MAX_LCORE];
+
+#define rcu_dereference(p) __atomic_load_n(&(p),__ATOMIC_ACQUIRE)
+
+#define rcu_assign_pointer(p,v) __atomic_store_n(&(p),(v),__ATOMIC_RELEASE)
+
+/* Called by a worker once it is done with all shared tables. Must
+ * be called regularly by every online worker. */
+static inline void
+rcu_quiescent(unsigned lcore_id){
+    __atomic_store_n(&rcu_lcores[lcore_id].seen,
+        __atomic_load_n(&rcu_token,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+}
+
+/* Makes lcore_id a reader, to be waited for by rcu_synchronize() */
+void rcu_online(unsigned lcore_id);
+
+void rcu_offline(unsigned lcore_id);
+
+/* Waits until all online workers went through a quiescent state.
+ * Must not be called by a worker. */
+void rcu_synchronize(void);
+
+#endif
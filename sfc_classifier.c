@@ -5,86 +5,760 @@
 #include <rte_ether.h>
 #include <rte_hash.h>
 #include <rte_jhash.h>
+#include <rte_acl.h>
+#include <rte_malloc.h>
+#include <rte_log.h>
 
 #include "sfc_classifier.h"
 #include "common.h"
 #include "nsh.h"
+#include "rcu.h"
 
 #define BURST_TX_DRAIN_US 100
 
 extern struct sfcapp_config sfcapp_cfg;
-extern long int n_rx, n_tx;
 
-static struct rte_hash* classifier_flow_path_lkp_table;
+enum {
+    CLASSIFIER_ACL_PROTO,
+    CLASSIFIER_ACL_SRC,
+    CLASSIFIER_ACL_DST,
+    CLASSIFIER_ACL_SPORT,
+    CLASSIFIER_ACL_DPORT,
+    CLASSIFIER_ACL_NB_FIELDS
+};
 
-static int classifier_init_flow_path_table(void){
+/* rte_acl expects fields in network order, grouped in 4B words */
+struct classifier_acl_key {
+    uint8_t  proto;
+    uint8_t  pad[3];
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+};
+
+static const struct rte_acl_field_def classifier_acl_defs[CLASSIFIER_ACL_NB_FIELDS] = {
+    {
+        .type = RTE_ACL_FIELD_TYPE_BITMASK,
+        .size = sizeof(uint8_t),
+        .field_index = CLASSIFIER_ACL_PROTO,
+        .input_index = 0,
+        .offset = offsetof(struct classifier_acl_key,proto),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_MASK,
+        .size = sizeof(uint32_t),
+        .field_index = CLASSIFIER_ACL_SRC,
+        .input_index = 1,
+        .offset = offsetof(struct classifier_acl_key,src_ip),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_MASK,
+        .size = sizeof(uint32_t),
+        .field_index = CLASSIFIER_ACL_DST,
+        .input_index = 2,
+        .offset = offsetof(struct classifier_acl_key,dst_ip),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_RANGE,
+        .size = sizeof(uint16_t),
+        .field_index = CLASSIFIER_ACL_SPORT,
+        .input_index = 3,
+        .offset = offsetof(struct classifier_acl_key,src_port),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_RANGE,
+        .size = sizeof(uint16_t),
+        .field_index = CLASSIFIER_ACL_DPORT,
+        .input_index = 3,
+        .offset = offsetof(struct classifier_acl_key,dst_port),
+    },
+};
+
+RTE_ACL_RULE_DEF(classifier_acl_rule,CLASSIFIER_ACL_NB_FIELDS);
+
+/* Tables used by the datapath, replaced as a whole on update */
+struct classifier_tables {
+    struct rte_hash *exact;
+    /* key = ipv4_5tuple ; value = CLASSIFIER_PATH(<SPI,SI>,tenant) */
+
+    uint32_t nb_exact;          /* Entries in exact */
+
+    struct rte_hash *exact6;
+    /* key = ipv6_5tuple ; same values as exact */
+
+    uint32_t nb_exact6;
+
+    struct rte_acl_ctx *acl;
+    /* Wildcard rules, looked up when the exact-match table misses.
+     * Input data is a struct classifier_acl_key, userdata is the rule
+     * index plus one (0 means no match). NULL if there are none. */
+
+    uint32_t nb_rules;
+    struct classifier_acl_rule rules[CLASSIFIER_MAX_RULES];
+    /* Rules acl was compiled from, copied by the next update. The
+     * userdata of rules[i] is i + 1. */
+
+    uint64_t rule_paths[CLASSIFIER_MAX_RULES];
+    /* Result of rules[i], same format as the exact-match values */
+};
+
+/* Exact-match values and rule results: <SPI,SI> in the low 32 bits,
+ * tenant in the high ones */
+#define CLASSIFIER_PATH(sph,tenant) (((uint64_t) (tenant) << 32) | (sph))
+#define CLASSIFIER_PATH_SPH(path) ((uint32_t) (path))
+#define CLASSIFIER_PATH_TENANT(path) ((uint32_t) ((path) >> 32))
+
+static struct classifier_tables *classifier_tables[RTE_MAX_NUMA_NODES];
+/* One copy per socket running workers, read with rcu_dereference().
+ * The master lcore's is the one edited by the next update. */
+
+static struct classifier_tables *classifier_new_tables;
+/* Being filled from config file or control socket */
+
+static uint32_t classifier_generation;
+/* Makes table names unique while old and new tables coexist */
+
+static void classifier_free_tables(struct classifier_tables *tables){
+    if(tables == NULL)
+        return;
+
+    rte_hash_free(tables->exact);
+    rte_hash_free(tables->exact6);
+    rte_acl_free(tables->acl);
+    rte_free(tables);
+}
+
+static inline unsigned classifier_master_socket(void){
+    return sfcapp_cfg.lcores[rte_get_master_lcore()].socket_id;
+}
+
+/* Creates empty tables on socket. Returns NULL in case of failure. */
+static struct classifier_tables *classifier_create_tables(unsigned socket){
+    struct classifier_tables *tables;
+    char name[RTE_HASH_NAMESIZE];
+    char name6[RTE_HASH_NAMESIZE];
+
+    tables = rte_zmalloc_socket("classifier_tables",
+        sizeof(struct classifier_tables),0,socket);
+    if(tables == NULL)
+        return NULL;
+
+    snprintf(name,sizeof(name),"classifier_flow_%" PRIu32 "_%u",classifier_generation,socket);
 
     const struct rte_hash_parameters hash_params = {
-        .name = "classifier_flow_path",
-        .entries = CLASSIFIER_MAX_FLOWS,
+        .name = name,
+        .entries = sfcapp_cfg.params.classifier_max_flows,
         .reserved = 0,
         .key_len = sizeof(struct ipv4_5tuple),
         .hash_func = rte_jhash,
         .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
+        .socket_id = socket
     };
 
-    classifier_flow_path_lkp_table = rte_hash_create(&hash_params);
+    tables->exact = rte_hash_create(&hash_params);
 
-    if(classifier_flow_path_lkp_table == NULL)
+    if(tables->exact == NULL){
+        RTE_LOG(ERR,USER1,"Failed to create classifier table.\n");
+        classifier_free_tables(tables);
+        return NULL;
+    }
+
+    snprintf(name6,sizeof(name6),"classifier_flow6_%" PRIu32 "_%u",classifier_generation,socket);
+
+    const struct rte_hash_parameters hash6_params = {
+        .name = name6,
+        .entries = sfcapp_cfg.params.classifier_max_flows6,
+        .reserved = 0,
+        .key_len = sizeof(struct ipv6_5tuple),
+        .hash_func = rte_jhash,
+        .hash_func_init_val = 0,
+        .socket_id = socket
+    };
+
+    tables->exact6 = rte_hash_create(&hash6_params);
+
+    if(tables->exact6 == NULL){
+        RTE_LOG(ERR,USER1,"Failed to create classifier IPv6 table.\n");
+        classifier_free_tables(tables);
+        return NULL;
+    }
+
+    return tables;
+}
+
+/* Copies the flows and rules of src into the empty tables dst. Rules
+ * are not compiled. */
+static int classifier_copy_entries(struct classifier_tables *dst,
+    const struct classifier_tables *src){
+    const void *key;
+    void *data;
+    uint32_t next;
+
+    next = 0;
+    while(rte_hash_iterate(src->exact,&key,&data,&next) >= 0){
+        if(rte_hash_add_key_data(dst->exact,key,data) < 0){
+            RTE_LOG(ERR,USER1,"Failed to copy classifier table.\n");
+            return -1;
+        }
+    }
+
+    next = 0;
+    while(rte_hash_iterate(src->exact6,&key,&data,&next) >= 0){
+        if(rte_hash_add_key_data(dst->exact6,key,data) < 0){
+            RTE_LOG(ERR,USER1,"Failed to copy classifier IPv6 table.\n");
+            return -1;
+        }
+    }
+
+    dst->nb_exact = src->nb_exact;
+    dst->nb_exact6 = src->nb_exact6;
+
+    memcpy(dst->rules,src->rules,src->nb_rules*sizeof(struct classifier_acl_rule));
+    memcpy(dst->rule_paths,src->rule_paths,src->nb_rules*sizeof(uint64_t));
+    dst->nb_rules = src->nb_rules;
+
+    return 0;
+}
+
+int classifier_config_begin(void){
+
+    classifier_config_abort();
+
+    classifier_new_tables = classifier_create_tables(classifier_master_socket());
+    if(classifier_new_tables == NULL)
         return -1;
-    
+
     return 0;
 }
 
-void classifier_add_flow_class_entry(struct ipv4_5tuple *tuple, uint32_t sfp){
-    int ret;
+int classifier_config_edit(void){
+    const struct classifier_tables *cur = classifier_tables[classifier_master_socket()];
+
+    if(classifier_config_begin() < 0)
+        return -1;
+
+    if(cur == NULL)
+        return 0;
+
+    if(classifier_copy_entries(classifier_new_tables,cur) < 0){
+        classifier_config_abort();
+        return -1;
+    }
+
+    return 0;
+}
+
+void classifier_config_abort(void){
+    classifier_free_tables(classifier_new_tables);
+    classifier_new_tables = NULL;
+}
+
+int classifier_add_flow_class_entry(struct ipv4_5tuple *tuple, uint32_t sfp, uint32_t tenant){
+    int ret, is_new;
     struct ipv4_5tuple local_tuple;
     memcpy(&local_tuple,tuple,sizeof(struct ipv4_5tuple));
 
     sfp = (sfp<<8) | 0xFF;
 
-    ret = rte_hash_add_key_data(classifier_flow_path_lkp_table,&local_tuple, 
-        (void *) ((uint64_t) sfp));
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to add entry to classifier table.\n");
+    is_new = rte_hash_lookup(classifier_new_tables->exact,&local_tuple) < 0;
+
+    ret = rte_hash_add_key_data(classifier_new_tables->exact,&local_tuple, 
+        (void *) (uintptr_t) CLASSIFIER_PATH(sfp,tenant));
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add entry to classifier table.\n");
+        return -1;
+    }
+
+    if(is_new)
+        classifier_new_tables->nb_exact++;
 
     printf("Added ");
     common_print_ipv4_5tuple(&local_tuple);
-    printf(" -> %" PRIx32 " to classifier flow table\n",sfp);
+    printf(" -> %" PRIx32 " (tenant %" PRIu32 ") to classifier flow table\n",sfp,tenant);
+
+    return 0;
 }
 
-static int classifier_handle_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
-    uint16_t i;
-    uint64_t path_info;
+static int classifier_add_flow_class_entry6(struct ipv6_5tuple *tuple, uint32_t sfp, uint32_t tenant){
+    int ret, is_new;
+
+    sfp = (sfp<<8) | 0xFF;
+
+    is_new = rte_hash_lookup(classifier_new_tables->exact6,tuple) < 0;
+
+    ret = rte_hash_add_key_data(classifier_new_tables->exact6,tuple,
+        (void *) (uintptr_t) CLASSIFIER_PATH(sfp,tenant));
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add entry to classifier IPv6 table.\n");
+        return -1;
+    }
+
+    if(is_new)
+        classifier_new_tables->nb_exact6++;
+
+    printf("Added ");
+    common_print_ipv6_5tuple(tuple);
+    printf(" -> %" PRIx32 " (tenant %" PRIu32 ") to classifier flow table\n",sfp,tenant);
+
+    return 0;
+}
+
+/* Same as classifier_rule_is_exact() for IPv6 rules, the only ones
+ * they can be */
+static int classifier_rule_is_exact6(const struct flow_class_rule *rule, struct ipv6_5tuple *tuple){
+
+    if(rule->src_depth != 128 || rule->dst_depth != 128 ||
+       rule->proto_mask != 0xFF ||
+       rule->sport_lo != rule->sport_hi ||
+       rule->dport_lo != rule->dport_hi){
+        RTE_LOG(ERR,USER1,"IPv6 rules must match a single flow.\n");
+        return 0;
+    }
+
+    tuple->proto = rule->proto;
+    memcpy(tuple->src_ip,rule->src_ip6,IPV6_ADDR_LEN);
+    memcpy(tuple->dst_ip,rule->dst_ip6,IPV6_ADDR_LEN);
+    tuple->src_port = rule->sport_lo;
+    tuple->dst_port = rule->dport_lo;
+
+    return 1;
+}
+
+/* Rules matching a single flow go to the exact-match table. Returns
+ * 1 if rule is one of them, its 5-tuple written to tuple. */
+static int classifier_rule_is_exact(const struct flow_class_rule *rule, struct ipv4_5tuple *tuple){
+
+    if(rule->src_depth != 32 || rule->dst_depth != 32 || 
+       rule->proto_mask != 0xFF ||
+       rule->sport_lo != rule->sport_hi ||
+       rule->dport_lo != rule->dport_hi)
+        return 0;
+
+    tuple->proto = rule->proto;
+    tuple->src_ip = rule->src_ip;
+    tuple->dst_ip = rule->dst_ip;
+    tuple->src_port = rule->sport_lo;
+    tuple->dst_port = rule->dport_lo;
+
+    return 1;
+}
+
+static void classifier_rule_to_acl(const struct flow_class_rule *rule,
+    struct classifier_acl_rule *acl_rule){
+
+    memset(acl_rule,0,sizeof(*acl_rule));
+
+    acl_rule->data.category_mask = 1;
+    acl_rule->data.priority = rule->priority;
+
+    acl_rule->field[CLASSIFIER_ACL_PROTO].value.u8 = rule->proto;
+    acl_rule->field[CLASSIFIER_ACL_PROTO].mask_range.u8 = rule->proto_mask;
+    acl_rule->field[CLASSIFIER_ACL_SRC].value.u32 = rule->src_ip;
+    acl_rule->field[CLASSIFIER_ACL_SRC].mask_range.u32 = rule->src_depth;
+    acl_rule->field[CLASSIFIER_ACL_DST].value.u32 = rule->dst_ip;
+    acl_rule->field[CLASSIFIER_ACL_DST].mask_range.u32 = rule->dst_depth;
+    acl_rule->field[CLASSIFIER_ACL_SPORT].value.u16 = rule->sport_lo;
+    acl_rule->field[CLASSIFIER_ACL_SPORT].mask_range.u16 = rule->sport_hi;
+    acl_rule->field[CLASSIFIER_ACL_DPORT].value.u16 = rule->dport_lo;
+    acl_rule->field[CLASSIFIER_ACL_DPORT].mask_range.u16 = rule->dport_hi;
+}
+
+/* Index of the staged wildcard rule with the same fields as acl_rule,
+ * -1 if there is none */
+static int classifier_find_acl_rule(const struct classifier_acl_rule *acl_rule){
+    uint32_t i;
+
+    for(i = 0 ; i < classifier_new_tables->nb_rules ; i++){
+        if(memcmp(classifier_new_tables->rules[i].field,acl_rule->field,
+            sizeof(acl_rule->field)) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int classifier_add_flow_class_rule(struct flow_class_rule *rule, uint32_t sfp){
+    struct ipv4_5tuple tuple;
+    struct ipv6_5tuple tuple6;
+    struct classifier_acl_rule acl_rule;
+    int idx;
+
+    if(rule->ipv6){
+        if(!classifier_rule_is_exact6(rule,&tuple6))
+            return -1;
+        return classifier_add_flow_class_entry6(&tuple6,sfp,rule->tenant);
+    }
+
+    /* Rules matching a single flow take the fast path */
+    if(classifier_rule_is_exact(rule,&tuple))
+        return classifier_add_flow_class_entry(&tuple,sfp,rule->tenant);
+
+    classifier_rule_to_acl(rule,&acl_rule);
+    sfp = (sfp<<8) | 0xFF;
+
+    /* A rule with the same fields is replaced */
+    idx = classifier_find_acl_rule(&acl_rule);
+
+    if(idx < 0){
+        if(classifier_new_tables->nb_rules >= CLASSIFIER_MAX_RULES){
+            RTE_LOG(ERR,USER1,"Too many wildcard rules in classifier. Maximum is %d.\n",
+                CLASSIFIER_MAX_RULES);
+            return -1;
+        }
+
+        idx = classifier_new_tables->nb_rules++;
+    }
+
+    acl_rule.data.userdata = idx + 1;
+    classifier_new_tables->rules[idx] = acl_rule;
+    classifier_new_tables->rule_paths[idx] = CLASSIFIER_PATH(sfp,rule->tenant);
+
+    printf("Added rule #%d (priority %" PRId32 ") -> %" PRIx32 " (tenant %" PRIu32 ")"
+        " to classifier rule table\n",idx + 1,
+        rule->priority,sfp,rule->tenant);
+
+    return 0;
+}
+
+int classifier_del_flow_class_rule(struct flow_class_rule *rule){
     struct ipv4_5tuple tuple;
+    struct ipv6_5tuple tuple6;
+    struct classifier_acl_rule acl_rule;
+    int idx;
+
+    if(rule->ipv6){
+        if(!classifier_rule_is_exact6(rule,&tuple6))
+            return -1;
+
+        if(rte_hash_del_key(classifier_new_tables->exact6,&tuple6) < 0){
+            RTE_LOG(ERR,USER1,"No such entry in classifier flow table.\n");
+            return -1;
+        }
+
+        classifier_new_tables->nb_exact6--;
+
+        printf("Removed ");
+        common_print_ipv6_5tuple(&tuple6);
+        printf(" from classifier flow table\n");
+
+        return 0;
+    }
+
+    if(classifier_rule_is_exact(rule,&tuple)){
+        if(rte_hash_del_key(classifier_new_tables->exact,&tuple) < 0){
+            RTE_LOG(ERR,USER1,"No such entry in classifier flow table.\n");
+            return -1;
+        }
+
+        classifier_new_tables->nb_exact--;
+
+        printf("Removed ");
+        common_print_ipv4_5tuple(&tuple);
+        printf(" from classifier flow table\n");
+
+        return 0;
+    }
+
+    classifier_rule_to_acl(rule,&acl_rule);
+    idx = classifier_find_acl_rule(&acl_rule);
+
+    if(idx < 0){
+        RTE_LOG(ERR,USER1,"No such rule in classifier rule table.\n");
+        return -1;
+    }
+
+    /* Rules are not ordered, priorities decide */
+    classifier_new_tables->nb_rules--;
+    classifier_new_tables->rules[idx] =
+        classifier_new_tables->rules[classifier_new_tables->nb_rules];
+    classifier_new_tables->rules[idx].data.userdata = idx + 1;
+    classifier_new_tables->rule_paths[idx] =
+        classifier_new_tables->rule_paths[classifier_new_tables->nb_rules];
+
+    printf("Removed rule #%d from classifier rule table\n",idx + 1);
+
+    return 0;
+}
+
+/* Compiles the wildcard rules added so far into tables->acl, on
+ * socket */
+static int classifier_build_acl(struct classifier_tables *tables, unsigned socket){
+    struct rte_acl_config acl_cfg;
+    char name[RTE_ACL_NAMESIZE];
+    int ret;
+
+    if(tables->nb_rules == 0)
+        return 0;
+
+    snprintf(name,sizeof(name),"classifier_acl_%" PRIu32 "_%u",classifier_generation,socket);
+
+    struct rte_acl_param acl_params = {
+        .name = name,
+        .socket_id = socket,
+        .rule_size = RTE_ACL_RULE_SZ(CLASSIFIER_ACL_NB_FIELDS),
+        .max_rule_num = tables->nb_rules
+    };
+
+    tables->acl = rte_acl_create(&acl_params);
+    if(tables->acl == NULL){
+        RTE_LOG(ERR,USER1,"Failed to create classifier rule table.\n");
+        return -1;
+    }
+
+    ret = rte_acl_add_rules(tables->acl,
+        (const struct rte_acl_rule *) tables->rules,tables->nb_rules);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add rules to classifier rule table.\n");
+        return -1;
+    }
+
+    memset(&acl_cfg,0,sizeof(acl_cfg));
+    acl_cfg.num_categories = 1;
+    acl_cfg.num_fields = CLASSIFIER_ACL_NB_FIELDS;
+    memcpy(acl_cfg.defs,classifier_acl_defs,sizeof(classifier_acl_defs));
+
+    ret = rte_acl_build(tables->acl,&acl_cfg);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to build classifier rule table.\n");
+        return -1;
+    }
+
+    printf("Compiled %" PRIu32 " classifier wildcard rules\n",tables->nb_rules);
+
+    return 0;
+}
+
+int classifier_build_tables(void){
+    struct classifier_tables *new_tables[RTE_MAX_NUMA_NODES], *old_tables[RTE_MAX_NUMA_NODES];
+    const unsigned master_socket = classifier_master_socket();
+    unsigned socket;
+    int replaced;
+
+    memset(new_tables,0,sizeof(new_tables));
+
+    if(classifier_build_acl(classifier_new_tables,master_socket) < 0)
+        goto fail;
+
+    new_tables[master_socket] = classifier_new_tables;
+
+    /* Workers of other sockets get their own copy */
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        if(!sfcapp_cfg.lcore_sockets[socket] || socket == master_socket)
+            continue;
+
+        new_tables[socket] = classifier_create_tables(socket);
+        if(new_tables[socket] == NULL ||
+           classifier_copy_entries(new_tables[socket],classifier_new_tables) < 0 ||
+           classifier_build_acl(new_tables[socket],socket) < 0)
+            goto fail;
+    }
+
+    /* Free the old tables once no worker can be using them */
+    replaced = 0;
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        old_tables[socket] = classifier_tables[socket];
+        replaced |= old_tables[socket] != NULL;
+        rcu_assign_pointer(classifier_tables[socket],new_tables[socket]);
+    }
+
+    classifier_new_tables = NULL;
+    classifier_generation++;
+
+    if(replaced){
+        rcu_synchronize();
+        for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++)
+            classifier_free_tables(old_tables[socket]);
+    }
+
+    return 0;
+
+fail:
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++)
+        if(new_tables[socket] != classifier_new_tables)
+            classifier_free_tables(new_tables[socket]);
+    classifier_config_abort();
+    return -1;
+}
+
+static void classifier_print_tables(FILE *f){
+    const struct classifier_tables *tables = classifier_tables[classifier_master_socket()];
+
+    fprintf(f,"\"flows\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},"
+        "\"flows6\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},"
+        "\"rules\":{\"used\":%" PRIu32 ",\"size\":%d}",
+        tables != NULL ? tables->nb_exact : 0,sfcapp_cfg.params.classifier_max_flows,
+        tables != NULL ? tables->nb_exact6 : 0,sfcapp_cfg.params.classifier_max_flows6,
+        tables != NULL ? tables->nb_rules : 0,CLASSIFIER_MAX_RULES);
+}
+
+/* Runs the packets of the burst that missed the exact-match table
+ * through the wildcard rules, in a single classify call. Matches are
+ * written to path_info and hit_mask. */
+static void classifier_acl_lookup(const struct classifier_tables *tables, struct ipv4_5tuple *tuples, uint16_t nb_pkts,
+    uint64_t miss_mask, uint64_t *hit_mask, void **path_info){
+    struct classifier_acl_key acl_keys[MAX_BURST_SIZE];
+    const uint8_t *acl_data[MAX_BURST_SIZE];
+    uint32_t results[MAX_BURST_SIZE];
+    uint16_t acl_pkt[MAX_BURST_SIZE];
+    uint16_t i, nb_acl;
+
+    for(i = 0, nb_acl = 0 ; i < nb_pkts ; i++){
+        if((miss_mask & (1ULL << i)) == 0)
+            continue;
+
+        acl_keys[nb_acl].proto = tuples[i].proto;
+        acl_keys[nb_acl].src_ip = rte_cpu_to_be_32(tuples[i].src_ip);
+        acl_keys[nb_acl].dst_ip = rte_cpu_to_be_32(tuples[i].dst_ip);
+        acl_keys[nb_acl].src_port = rte_cpu_to_be_16(tuples[i].src_port);
+        acl_keys[nb_acl].dst_port = rte_cpu_to_be_16(tuples[i].dst_port);
+        acl_data[nb_acl] = (const uint8_t *) &acl_keys[nb_acl];
+        acl_pkt[nb_acl] = i;
+        nb_acl++;
+    }
+
+    if(nb_acl == 0)
+        return;
+
+    rte_acl_classify(tables->acl,acl_data,results,nb_acl,1);
+
+    for(i = 0 ; i < nb_acl ; i++){
+        if(results[i] == 0) /* No rule matched */
+            continue;
+
+        path_info[acl_pkt[i]] = (void *) (uintptr_t) tables->rule_paths[results[i] - 1];
+        *hit_mask |= (1ULL << acl_pkt[i]);
+    }
+}
+
+/* Looks up the IPv6 packets of the burst, which the IPv4 lookups
+ * skipped, in their own table. Matches are written to path_info and
+ * hit_mask, by burst index. */
+static void classifier_lookup6(const struct classifier_tables *tables, const void **keys6,
+    const uint16_t *idx6, uint16_t nb_v6, uint64_t *hit_mask, void **path_info){
+    void *path_info6[MAX_BURST_SIZE];
+    uint64_t hit_mask6;
+    uint16_t j;
+
+    hit_mask6 = 0;
+    rte_hash_lookup_bulk_data(tables->exact6,keys6,nb_v6,&hit_mask6,path_info6);
+
+    for(j = 0 ; j < nb_v6 ; j++){
+        if(hit_mask6 & (1ULL << j)){
+            path_info[idx6[j]] = path_info6[j];
+            *hit_mask |= (1ULL << idx6[j]);
+        }
+    }
+}
+
+/* Fills md with the metadata of a packet of the given tenant and
+ * flow, and sets the MD type of nsh_header accordingly */
+static void classifier_stamp_md(struct nsh_hdr *nsh_header, struct nsh_md *md,
+    uint32_t tenant, uint32_t flow_id){
+    uint32_t ctx[NSH_MD1_CONTEXT_LEN / sizeof(uint32_t)];
+
+    md->len = 0;
+    tenant = rte_cpu_to_be_32(tenant);
+    flow_id = rte_cpu_to_be_32(flow_id);
+
+    if(sfcapp_cfg.params.classifier_md == NSH_MD_TYPE_1){
+        memset(ctx,0,sizeof(ctx));
+        ctx[0] = tenant;
+        ctx[1] = flow_id;
+        memcpy(md->data,ctx,sizeof(ctx));
+        md->len = sizeof(ctx);
+        nsh_header->md_type = NSH_MD_TYPE_1;
+        return;
+    }
+
+    if(tenant != 0)
+        nsh_md_add_tlv(md,NSH_MD_CLASS_SFCAPP,NSH_TLV_TENANT,&tenant,sizeof(tenant));
+    nsh_md_add_tlv(md,NSH_MD_CLASS_SFCAPP,NSH_TLV_FLOW_ID,&flow_id,sizeof(flow_id));
+}
+
+/* Packets are handled in three stages so that the hash table
+ * cache misses of the whole burst overlap:
+ *
+ * 1. Extract the 5-tuple of every packet
+ * 2. Look up all of them with a single bulk lookup, then classify
+ *    the misses against the wildcard rules in one call
+ * 3. Encapsulate matching packets and enqueue everything for TX
+ */
+static int classifier_handle_pkts(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts){
+    uint16_t i, nb_v6;
+    struct ipv4_5tuple tuples[MAX_BURST_SIZE];
+    struct ipv6_5tuple tuples6[MAX_BURST_SIZE];
+    const void *keys[MAX_BURST_SIZE];
+    const void *keys6[MAX_BURST_SIZE];
+    uint16_t idx6[MAX_BURST_SIZE];
+    void *path_info[MAX_BURST_SIZE];
+    uint64_t valid_mask, v6_mask, hit_mask;
     struct nsh_hdr nsh_header;
-    int lkp,ret,drop,nb_tx;
+    struct nsh_md md;
+    const struct classifier_tables *tables = rcu_dereference(classifier_tables[lcore->socket_id]);
+    const uint32_t md_type = sfcapp_cfg.params.classifier_md;
+    uint64_t path;
+    uint32_t flow_hash;
+    int nb_tx;
 
     nb_tx = 0;
+    hit_mask = 0;
+    v6_mask = 0;
+
+    /* Get 5-tuples */
+    valid_mask = common_ipv4_get_5tuple_bulk(mbufs,tuples,keys,nb_pkts,0);
+
+    /* Get matching SPHs from table */
+    rte_hash_lookup_bulk_data(tables->exact,keys,nb_pkts,
+        &hit_mask,path_info);
+
+    /* Try wildcard rules for the rest */
+    if(tables->acl != NULL && (valid_mask & ~hit_mask) != 0)
+        classifier_acl_lookup(tables,tuples,nb_pkts,valid_mask & ~hit_mask,
+            &hit_mask,path_info);
+
+    /* The rest may be IPv6. Their zeroed IPv4 keys must not match. */
+    if(unlikely(valid_mask != RTE_LEN2MASK(nb_pkts,uint64_t))){
+        hit_mask &= valid_mask;
+        nb_v6 = common_ipv6_get_5tuple_bulk(mbufs,tuples6,keys6,idx6,&v6_mask,nb_pkts,
+            ~valid_mask,0);
+        if(nb_v6 > 0)
+            classifier_lookup6(tables,keys6,idx6,nb_v6,&hit_mask,path_info);
+    }
 
     for(i = 0 ; i < nb_pkts ; i++){
-        drop = 0;
 
-        /* Get 5-tuple */
-        ret = common_ipv4_get_5tuple(mbufs[i],&tuple,0);
-        COND_MARK_DROP(ret,drop);
-    
-        /* Get matching SPH from table */
-        lkp = rte_hash_lookup_data(classifier_flow_path_lkp_table,&tuple,(void**) &path_info);
+        /* Neither IPv4 nor IPv6 */
+        if(unlikely(((valid_mask | v6_mask) & (1ULL << i)) == 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NOT_IPV4);
+            continue;
+        }
 
-        if(lkp >= 0){ /* Has entry in table */
+        if(hit_mask & (1ULL << i)){ /* Has entry in table */
+            path = (uintptr_t) path_info[i];
+            flow_hash = likely(valid_mask & (1ULL << i)) ?
+                common_ipv4_5tuple_hash(&tuples[i],0) :
+                common_ipv6_5tuple_hash(&tuples6[i],0);
 
-            /* Encapsulate with VXLAN */
-            common_vxlan_encap(mbufs[i]);
+            /* Encapsulate with VXLAN, outer MACs included. The
+             * source port gives every <SPI, flow> its own RSS hash. */
+            if(unlikely(common_vxlan_encap(mbufs[i],sfcapp_cfg.sff_port,
+                rte_hash_crc_4byte(CLASSIFIER_PATH_SPH(path) >> 8,flow_hash)) < 0)){
+                common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+                continue;
+            }
             
             nsh_init_header(&nsh_header);
-            nsh_header.serv_path = (uint32_t) path_info;
+            nsh_header.serv_path = CLASSIFIER_PATH_SPH(path);
+
+            if(unlikely(md_type != 0))
+                classifier_stamp_md(&nsh_header,&md,CLASSIFIER_PATH_TENANT(path),flow_hash);
 
             /* Encapsulate packet */
-            nsh_encap(mbufs[i],&nsh_header);
-            
-            common_mac_update(mbufs[i],&sfcapp_cfg.ports[1].mac,&sfcapp_cfg.sff_addr);
-            sfcapp_cfg.rx_pkts++;
+            if(unlikely(nsh_encap(mbufs[i],&nsh_header,md_type != 0 ? &md : NULL) < 0)){
+                common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+                continue;
+            }
         }
 
         /* No matching SFP, then just give back to network
@@ -92,22 +766,42 @@ static int classifier_handle_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
          */
 
         /* Enqueue packet for TX */
-        nb_tx += rte_eth_tx_buffer(sfcapp_cfg.ports[1].id,0,sfcapp_cfg.ports[1].tx_buffer,mbufs[i]);
+        nb_tx += common_tx_pkt(lcore,sfcapp_cfg.sff_port,mbufs[i]);
     }
 
     return nb_tx;
 }
 
 int classifier_setup(void){
+    uint16_t i;
 
-    int ret;
-    ret = classifier_init_flow_path_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to initialize Classifier table\n");
+    if(sfcapp_cfg.params.classifier_md != 0)
+        printf("Stamping NSH MD type %" PRIu32 " metadata\n",sfcapp_cfg.params.classifier_md);
 
-    sfcapp_cfg.ports[0].handle_pkts = classifier_handle_pkts;
+    /* Whole bursts are looked up at once */
+    RTE_BUILD_BUG_ON(MAX_BURST_SIZE > RTE_HASH_LOOKUP_BULK_MAX);
+
+    /* Classified packets all go to the SFF, behind the second port
+     * unless told otherwise */
+    if(sfcapp_cfg.sff_port == SFF_PORT_DEFAULT)
+        sfcapp_cfg.sff_port = 1;
+
+    common_vxlan_build_tmpl(sfcapp_cfg.sff_port,&sfcapp_cfg.sff_addr,
+        sfcapp_cfg.sff_ip != 0 ? sfcapp_cfg.sff_ip : VXLAN_DEFAULT_DST_IP,
+        sfcapp_cfg.sff_vni);
+
+    /* Tenant traffic comes in on every other port */
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        if(i == sfcapp_cfg.sff_port)
+            continue;
+
+        sfcapp_cfg.ports[i].handle_pkts = classifier_handle_pkts;
+
+        // Enable promiscuous mode for RX interface
+        rte_eth_promiscuous_enable(sfcapp_cfg.ports[i].id);
+    }
 
-    // Enable promiscuous mode for RX interface
-    rte_eth_promiscuous_enable(sfcapp_cfg.ports[0].id);
+    sfcapp_cfg.print_tables = classifier_print_tables;
 
     return 0;
 }
\ No newline at end of file
@@ -5,10 +5,71 @@
 #include "common.h"
 
 #define CLASSIFIER_TABLE_SZ 1024
-#define CLASSIFIER_MAX_FLOWS 1024
+#define CLASSIFIER_MAX_FLOWS 1024 /* Default exact-match table size */
+#define CLASSIFIER_MAX_FLOWS6 1024 /* Same for IPv6 flows */
+#define CLASSIFIER_MAX_RULES 1024
 #define CLASSIFIER_SFP_MAX_ENTRIES 64
 
-void classifier_add_flow_class_entry(struct ipv4_5tuple *tuple, uint32_t sfp);
+#define CLASSIFIER_DEFAULT_PRIORITY 1
+
+/* NSH metadata stamped on classified packets, see classifier_md:
+ *
+ *   0  none
+ *   1  MD type 1, context words <tenant, flow id, 0, 0>
+ *   2  MD type 2, tenant TLV if the rule has one and flow id TLV
+ *
+ * The flow id is a hash of the 5-tuple. */
+#define CLASSIFIER_MD_MAX 2
+
+/* A [FLOW_CLASS] entry. Addresses are matched by prefix, ports by
+ * range and the protocol either exactly or not at all. All values
+ * in host order. IPv6 rules only match single flows: both addresses
+ * with a depth of 128, exact protocol and ports. */
+struct flow_class_rule {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint8_t  ipv6;              /* src_ip6 and dst_ip6 are used instead */
+    uint8_t  src_ip6[IPV6_ADDR_LEN];    /* Network order */
+    uint8_t  dst_ip6[IPV6_ADDR_LEN];
+    uint8_t  src_depth;         /* Prefix length, 0 matches any */
+    uint8_t  dst_depth;
+    uint8_t  proto;
+    uint8_t  proto_mask;        /* 0xFF for exact match, 0 for any */
+    uint16_t sport_lo, sport_hi;
+    uint16_t dport_lo, dport_hi;
+    int32_t  priority;          /* Highest priority match wins */
+    uint32_t tenant;            /* Stamped as NSH metadata, 0 for none */
+};
+
+/* Starts a new set of rules, to replace the current one with
+ * classifier_build_tables(). Returns -1 in case of failure. */
+int classifier_config_begin(void);
+
+/* Same as classifier_config_begin(), starting from the current rules
+ * so that they can be updated one by one */
+int classifier_config_edit(void);
+
+/* Discards the changes made since classifier_config_begin() or
+ * classifier_config_edit() */
+void classifier_config_abort(void);
+
+int classifier_add_flow_class_entry(struct ipv4_5tuple *tuple, uint32_t sfp, uint32_t tenant);
+
+/* Adds a classification rule. Rules matching a single 5-tuple go to
+ * the exact-match table, which is checked first; other rules are
+ * compiled into a multi-field classifier by classifier_build_tables().
+ * A rule with the same match fields as a staged one replaces it. */
+int classifier_add_flow_class_rule(struct flow_class_rule *rule, uint32_t sfp);
+
+/* Removes the staged rule with the same match fields as rule, its
+ * priority is ignored. Returns -1 if there is none. */
+int classifier_del_flow_class_rule(struct flow_class_rule *rule);
+
+/* Compiles the wildcard rules added so far and swaps the new rules
+ * in, freeing the previous ones once no worker uses them. Must be
+ * called once all rules are added, not from a worker. Returns -1 in
+ * case of failure. */
+int classifier_build_tables(void);
 
 int classifier_setup(void);
 
@@ -1,137 +1,287 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <arpa/inet.h>
 
 #include <rte_ethdev.h>
 #include <rte_ether.h>
-#include <rte_hash.h>
-#include <rte_jhash.h>
+#include <rte_log.h>
 #include <rte_cycles.h>
 #include <rte_common.h>
 
 #include "sfc_forwarder.h"
 #include "common.h"
 #include "nsh.h"
+#include "nexthop.h"
+#include "rcu.h"
+#include "latency.h"
 
 extern struct sfcapp_config sfcapp_cfg;
 
-static struct rte_hash *forwarder_next_sf_lkp_table;
-/* key = spi-si ; value = next sf_id (uint16_t) */
+static struct nh_config *forwarder_nh_cfg;
+/* [SFC_NODE] and [SF] entries being staged for the next table */
 
-static struct rte_hash *forwarder_next_sf_address_lkp_table;
-/* key = sf_id (uint16_t) ; value = mac (48b in 64b) (uint64_t) */
+static struct nh_config *forwarder_nh_cfg_cur;
+/* Entries the current table was built from */
 
-static int forwarder_init_next_sf_table(void){
+static struct nh_table *forwarder_nh_tables[RTE_MAX_NUMA_NODES];
+/* index = <SPI,SI> ; value = action + next SF address. One copy per
+ * socket. Replaced on reload, read with rcu_dereference() */
 
-    const struct rte_hash_parameters hash_params = {
-        .name = "forwarder_next_sf",
-        .entries = FORWARDER_TABLE_SZ,
-        .reserved = 0,
-        .key_len = sizeof(uint32_t), /* <SPI,SI> */
-        .hash_func = rte_jhash,
-        .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
-    };
+/* Metadata of the packets leaving the chain, by worker */
+static struct {
+    uint64_t md_pkts;           /* Packets carrying metadata */
+    uint64_t tenant_pkts;       /* Packets with a tenant TLV */
+} __rte_cache_aligned forwarder_md_stats[RTE_MAX_LCORE];
 
-    forwarder_next_sf_lkp_table = rte_hash_create(&hash_params);
+int forwarder_add_sph_entry(uint32_t sph, uint16_t sfid, uint8_t port){
+    int ret;
 
-    if(forwarder_next_sf_lkp_table == NULL)
+    ret = nh_config_add_sph(forwarder_nh_cfg,sph,sfid,port);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add stub entry to Forwarder table.\n");
         return -1;
-    
+    }
+
+    printf("Added <sph=%" PRIx32 ",sfid=%" PRIx16 ">"
+            " to forwarder next sf table.\n",sph,sfid);
+
     return 0;
 }
 
-static int forwarder_init_sf_addr_table(void){
+int forwarder_add_sf_address_entry(uint16_t sfid, const struct nh_sf_pool *pool){
+    int ret;
+    char buf[ETHER_ADDR_FMT_SIZE + 1];
+    char ip[INET_ADDRSTRLEN];
+    const struct nh_sf_addr *addr;
+    uint32_t ip_be;
+    unsigned i;
+
+    ret = nh_config_add_sf(forwarder_nh_cfg,sfid,pool);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add SF entry to forwarder table.\n");
+        return -1;
+    }
+
+    for(i = 0 ; i < pool->nb_instances ; i++){
+        addr = &pool->addr[i];
+        ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,&addr->mac);
+        ip_be = rte_cpu_to_be_32(addr->ip);
+        inet_ntop(AF_INET,&ip_be,ip,sizeof(ip));
+        printf("Added <sfid=%" PRIx16 ",mac=%s,ip=%s,vni=%" PRIu32 ",weight=%" PRIu8
+            ",port=%" PRIu8 "> to forwarder SF address table.\n",sfid,buf,
+            addr->ip != 0 ? ip : "-",addr->vni,pool->weights[i],pool->port);
+    }
 
-    const struct rte_hash_parameters hash_params = {
-        .name = "forwarder_sf_addr",
-        .entries = FORWARDER_TABLE_SZ,
-        .reserved = 0,
-        .key_len = sizeof(uint16_t), /* SFID */
-        .hash_func = rte_jhash,
-        .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
-    };
+    return 0;
+}
 
-    forwarder_next_sf_address_lkp_table = rte_hash_create(&hash_params);
+int forwarder_del_sph_entry(uint32_t sph){
 
-    if(forwarder_next_sf_address_lkp_table == NULL)
+    if(nh_config_del_sph(forwarder_nh_cfg,sph) < 0){
+        RTE_LOG(ERR,USER1,"No <sph=%" PRIx32 "> in forwarder next sf table.\n",sph);
         return -1;
-    
+    }
+
+    printf("Removed <sph=%" PRIx32 "> from forwarder next sf table.\n",sph);
+
     return 0;
 }
 
-void forwarder_add_sph_entry(uint32_t sph, uint16_t sfid){
-    int ret;
+int forwarder_del_sf_address_entry(uint16_t sfid){
 
-    ret = rte_hash_add_key_data(forwarder_next_sf_lkp_table,&sph, 
-        (void *) ((uint64_t) sfid) );
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to add stub entry to Forwarder table.\n");
+    if(nh_config_del_sf(forwarder_nh_cfg,sfid) < 0){
+        RTE_LOG(ERR,USER1,"No <sfid=%" PRIx16 "> in forwarder SF address table.\n",sfid);
+        return -1;
+    }
 
-    printf("Added <sph=%" PRIx32 ",sfid=%" PRIx16 ">"
-            " to forwarder next sf table.\n",sph,sfid);
+    printf("Removed <sfid=%" PRIx16 "> from forwarder SF address table.\n",sfid);
+
+    return 0;
 }
 
-void forwarder_add_sf_address_entry(uint16_t sfid, struct ether_addr *sfmac){
-    int ret;
+int forwarder_config_begin(void){
 
-    ret = rte_hash_add_key_data(forwarder_next_sf_address_lkp_table,&sfid, 
-        (void *) common_mac_to_64(sfmac));
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to add SF entry to forwarder table.\n");
+    nh_config_free(forwarder_nh_cfg);
 
-    char buf[ETHER_ADDR_FMT_SIZE + 1];
-    ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,sfmac);
-    printf("Added <sfid=%" PRIx16 ",mac=%s> to forwarder" 
-        " SF-address table.\n",sfid,buf);
+    forwarder_nh_cfg = nh_config_create(sfcapp_cfg.params.forwarder_table_size);
+    if(forwarder_nh_cfg == NULL){
+        RTE_LOG(ERR,USER1,"Forwarder: Failed to create next-hop configuration.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int forwarder_config_edit(void){
+
+    if(forwarder_nh_cfg_cur == NULL)
+        return forwarder_config_begin();
+
+    nh_config_free(forwarder_nh_cfg);
+
+    forwarder_nh_cfg = nh_config_copy(forwarder_nh_cfg_cur);
+    if(forwarder_nh_cfg == NULL){
+        RTE_LOG(ERR,USER1,"Forwarder: Failed to create next-hop configuration.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void forwarder_config_abort(void){
+    nh_config_free(forwarder_nh_cfg);
+    forwarder_nh_cfg = NULL;
+}
+
+int forwarder_build_tables(void){
+    struct nh_table *new_tables[RTE_MAX_NUMA_NODES], *old_tables[RTE_MAX_NUMA_NODES];
+    unsigned socket;
+    int replaced;
+
+    if(nh_table_build_all(forwarder_nh_cfg,new_tables) < 0){
+        RTE_LOG(ERR,USER1,"Failed to build Forwarder next-hop table.\n");
+        forwarder_config_abort();
+        return -1;
+    }
+
+    /* Kept to be edited by the next update */
+    nh_config_free(forwarder_nh_cfg_cur);
+    forwarder_nh_cfg_cur = forwarder_nh_cfg;
+    forwarder_nh_cfg = NULL;
+
+    /* Free the old tables once no worker can be using them */
+    replaced = 0;
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        old_tables[socket] = forwarder_nh_tables[socket];
+        replaced |= old_tables[socket] != NULL;
+        rcu_assign_pointer(forwarder_nh_tables[socket],new_tables[socket]);
+    }
+
+    if(replaced){
+        rcu_synchronize();
+        nh_table_free_all(old_tables);
+    }
+
+    return 0;
 }
 
-static int forwarder_handle_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
-    int lkp, nb_tx, drop;
+static void forwarder_print_nh_tables(FILE *f){
+    uint32_t nb_sph, nb_sf, max_entries;
+
+    nb_sph = nb_sf = max_entries = 0;
+    if(forwarder_nh_cfg_cur != NULL)
+        nh_config_usage(forwarder_nh_cfg_cur,&nb_sph,&nb_sf,&max_entries);
+
+    fprintf(f,"\"sfc_nodes\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},"
+        "\"sfs\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},",
+        nb_sph,max_entries,nb_sf,max_entries);
+    nh_table_print_json(f,forwarder_nh_tables);
+}
+
+static void forwarder_sfcapp_tlv(__rte_unused struct rte_mbuf *mbuf, const struct nsh_tlv *tlv,
+    __rte_unused const uint8_t *value, __rte_unused void *arg){
+    if(tlv->type == NSH_TLV_TENANT)
+        forwarder_md_stats[rte_lcore_id()].tenant_pkts++;
+}
+
+/* Runs the TLVs of a packet leaving the chain through their class
+ * handlers */
+static void forwarder_read_md(struct rte_mbuf *mbuf, const struct nsh_hdr *nsh_header){
+    struct nsh_md md;
+
+    forwarder_md_stats[rte_lcore_id()].md_pkts++;
+
+    if(nsh_header->md_type == NSH_MD_TYPE_2 && nsh_get_md(mbuf,nsh_header,&md) == 0)
+        nsh_md_dispatch(mbuf,&md);
+}
+
+static void forwarder_print_stats(FILE *f){
+    uint64_t md_pkts, tenant_pkts;
+    unsigned lcore_id;
+
+    md_pkts = tenant_pkts = 0;
+    RTE_LCORE_FOREACH(lcore_id){
+        md_pkts += forwarder_md_stats[lcore_id].md_pkts;
+        tenant_pkts += forwarder_md_stats[lcore_id].tenant_pkts;
+    }
+
+    fprintf(f,"%" PRIu64 " packets left the chain with metadata\n"
+        "%" PRIu64 " packets left the chain with a tenant\n",
+        md_pkts,tenant_pkts);
+
+    nh_table_print_stats(f,forwarder_nh_tables);
+}
+
+/* Packets are handled in two stages: first the next hop of every
+ * packet is resolved, then packets are rewritten and sent. */
+static int forwarder_handle_pkts(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts){
+    int nb_tx;
     uint16_t i;
-    uint64_t data;
-    struct nsh_hdr nsh_header;
-    uint16_t sfid;
-    struct ether_addr sf_addr;
+    struct nsh_hdr nsh_headers[MAX_BURST_SIZE];
+    uint64_t bad_mask;
+    const struct nh_entry *nh[MAX_BURST_SIZE];
+    const struct nh_table *nh_table = rcu_dereference(forwarder_nh_tables[lcore->socket_id]);
+    const uint64_t now = sfcapp_cfg.params.latency ? rte_rdtsc() : 0;
 
     nb_tx = 0;
-    
-    for(i = 0, nb_tx = 0 ; i < nb_pkts ; i++){
-        drop = 0;
-
-        nsh_get_header(mbufs[i],&nsh_header);
-
-        /* Match SFP to SF in table */
-        lkp = rte_hash_lookup_data(forwarder_next_sf_lkp_table,
-                (void*) &nsh_header.serv_path,
-                (void **) &data);
-        COND_MARK_DROP(lkp,drop);
-
-        sfid = (uint16_t) data;
-       
-        if(sfid == 0){  /* End of chain */
-            nsh_decap(mbufs[i]);
-
-            /* Remove VXLAN encap! */
-            rte_pktmbuf_adj(mbufs[i],
-                sizeof(struct ether_hdr) +
-                sizeof(struct ipv4_hdr) +
-                sizeof(struct udp_hdr) +
-                sizeof(struct vxlan_hdr));
-        }else{
-            /* Match SFID to address in table */
-            lkp = rte_hash_lookup_data(forwarder_next_sf_address_lkp_table,
-                    (void*) &sfid,
-                    (void**) &data);
-            COND_MARK_DROP(lkp,drop);
-            /* Update MACs */
-            common_64_to_mac(data,&sf_addr);
-            common_mac_update(mbufs[i],&sfcapp_cfg.ports[1].mac,&sf_addr);
+    bad_mask = 0;
+
+    /* Match <SPI,SI> to next hop, loading the entries used by the
+     * rewrite below */
+    common_prefetch_burst(mbufs,nb_pkts);
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        common_prefetch_next(mbufs,i,nb_pkts);
+        if(unlikely(nsh_get_header(mbufs[i],&nsh_headers[i]) < 0))
+            bad_mask |= (1ULL << i);
+        nh[i] = nh_lookup(nh_table,nsh_headers[i].serv_path);
+        rte_prefetch0(nh[i]);
+    }
+
+    /* Rewrite and send */
+    for(i = 0 ; i < nb_pkts ; i++){
+
+        if(unlikely(bad_mask & (1ULL << i))){
+            common_drop_pkt(lcore,mbufs[i],DROP_BAD_NSH);
+            continue;
         }
 
-        /* Enqueue packet for TX */
-        nb_tx += rte_eth_tx_buffer(sfcapp_cfg.ports[1].id,0,sfcapp_cfg.ports[1].tx_buffer,mbufs[i]);
-    
-        if(unlikely(drop))
-            rte_pktmbuf_free(mbufs[i]);
+        switch(nh[i]->action){
+            case NH_ACTION_FORWARD:
+                /* Update MACs, and VTEP if the SF has one */
+                nh_rewrite(nh_table,nh[i],mbufs[i]);
+                break;
+
+            case NH_ACTION_DECAP:   /* End of chain */
+                if(unlikely(nsh_md_len(&nsh_headers[i]) != 0))
+                    forwarder_read_md(mbufs[i],&nsh_headers[i]);
+
+                if(unlikely(nsh_decap(mbufs[i]) < 0)){
+                    common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+                    continue;
+                }
+
+                /* Remove VXLAN encap! */
+                rte_pktmbuf_adj(mbufs[i],
+                    sizeof(struct ether_hdr) +
+                    sizeof(struct ipv4_hdr) +
+                    sizeof(struct udp_hdr) +
+                    sizeof(struct vxlan_hdr));
+
+                /* Packets from the generator carry their send time */
+                if(now != 0)
+                    latency_record_chain(mbufs[i],now);
+                break;
+
+            default:    /* No next hop for this <SPI,SI> */
+                common_drop_pkt(lcore,mbufs[i],DROP_NO_MATCH);
+                continue;
+        }
+
+        /* Enqueue packet for TX, on the port of its next hop.
+         * Packets are buffered by port, so each one still goes out
+         * in bursts. */
+        nb_tx += common_tx_pkt(lcore,nh[i]->port,mbufs[i]);
     }
 
     return nb_tx;
@@ -139,15 +289,18 @@ static int forwarder_handle_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
 }
 
 int forwarder_setup(void){
-    int ret;
+    int ret, i;
 
-    ret = forwarder_init_next_sf_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to initialize Forwarder Next-Func table.\n");
+    ret = nsh_register_tlv_class(NSH_MD_CLASS_SFCAPP,forwarder_sfcapp_tlv,NULL);
+    SFCAPP_CHECK_FAIL_LT(ret,0,
+        "Forwarder: Failed to register NSH TLV class.\n");
 
-    ret = forwarder_init_sf_addr_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to initialize Forwarder SF Address table.\n");
+    /* SFs may be behind any port */
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++)
+        sfcapp_cfg.ports[i].handle_pkts = forwarder_handle_pkts;
 
-    sfcapp_cfg.ports[0].handle_pkts = forwarder_handle_pkts;
+    sfcapp_cfg.print_stats = forwarder_print_stats;
+    sfcapp_cfg.print_tables = forwarder_print_nh_tables;
     
     return 0;
 }
\ No newline at end of file
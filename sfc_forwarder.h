@@ -1,14 +1,41 @@
 #ifndef SFCAPP_FORWARDER_
 #define SFCAPP_FORWARDER_
 
-#include <rte_hash.h>
 #include "common.h"
+#include "nexthop.h"
 
+/* Default maximum number of SFC_NODE and SF entries */
 #define FORWARDER_TABLE_SZ 1024
 
-void forwarder_add_sph_entry(uint32_t sph, uint16_t sfid);
+/* Starts a new set of SFC_NODE and SF entries, to replace the current
+ * one with forwarder_build_tables(). Returns -1 in case of failure. */
+int forwarder_config_begin(void);
 
-void forwarder_add_sf_address_entry(uint16_t sfid, struct ether_addr *eth_addr);
+/* Same as forwarder_config_begin(), starting from the entries of the
+ * current table so that they can be updated one by one */
+int forwarder_config_edit(void);
+
+/* Discards the changes made since forwarder_config_begin() or
+ * forwarder_config_edit() */
+void forwarder_config_abort(void);
+
+/* port is the egress of end-of-chain entries, sfid 0 */
+int forwarder_add_sph_entry(uint32_t sph, uint16_t sfid, uint8_t port);
+
+/* An instance ip of 0 means it is reached by MAC only, keeping the
+ * outer IP header of the packet */
+int forwarder_add_sf_address_entry(uint16_t sfid, const struct nh_sf_pool *pool);
+
+/* Remove a staged entry. Return -1 if there is none. */
+int forwarder_del_sph_entry(uint32_t sph);
+
+int forwarder_del_sf_address_entry(uint16_t sfid);
+
+/* Compiles the entries added so far into the lookup table used by the
+ * datapath and swaps it in, freeing the previous table once no worker
+ * uses it. Must be called once all entries are added, not from a
+ * worker. Returns -1 in case of failure. */
+int forwarder_build_tables(void);
 
 int forwarder_setup(void);
 
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_mbuf.h>
+#include <rte_memcpy.h>
+
+#include "common.h"
+#include "bench.h"
+#include "latency.h"
+#include "sfc_generator.h"
+
+extern struct sfcapp_config sfcapp_cfg;
+extern struct rte_mempool *sfcapp_pktmbuf_pools[RTE_MAX_NUMA_NODES];
+
+/* State of one worker. Only the owning lcore writes it. */
+struct gen_lcore {
+    uint64_t next_tsc;                  /* When the next burst is due */
+    uint32_t next_pkt;                  /* Next packet of gen_stream */
+    uint16_t nb_pending;                /* Built, not taken by the NIC yet */
+    struct rte_mbuf *pending[MAX_BURST_SIZE];
+    uint64_t nb_returned;               /* Generated packets received */
+    uint64_t nb_other;                  /* Other packets received */
+} __rte_cache_aligned;
+
+static struct gen_lcore gen_lcores[RTE_MAX_LCORE];
+
+static struct bench_stream gen_stream;
+
+static uint64_t gen_burst_tsc; /* Cycles between bursts of a worker, 0 for line rate */
+
+static int generator_handle_pkts(__rte_unused struct lcore_cfg *lcore, struct rte_mbuf **mbufs,
+    uint16_t nb_pkts){
+    struct gen_lcore *g = &gen_lcores[rte_lcore_id()];
+    uint64_t now;
+    uint16_t i;
+
+    now = rte_rdtsc();
+
+    /* Trailers are at the end of the first segment of our packets */
+    for(i = 0 ; i < nb_pkts ; i++)
+        rte_prefetch0(rte_pktmbuf_mtod_offset(mbufs[i],char *,
+            RTE_MAX(rte_pktmbuf_data_len(mbufs[i]),sizeof(struct latency_trailer)) -
+            sizeof(struct latency_trailer)));
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        if(latency_record_chain(mbufs[i],now) == 0)
+            g->nb_returned++;
+        else
+            g->nb_other++;
+
+        rte_pktmbuf_free(mbufs[i]);
+    }
+
+    return 0;
+}
+
+/* Copies the next packets of gen_stream into new mbufs */
+static int generator_build_burst(struct gen_lcore *g, uint16_t nb_pkts){
+    struct rte_mbuf **pkts = g->pending;
+    uint16_t i, len;
+
+    if(rte_pktmbuf_alloc_bulk(sfcapp_pktmbuf_pools[rte_socket_id()],pkts,nb_pkts) != 0)
+        return -1;
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        len = gen_stream.len[g->next_pkt];
+        rte_memcpy(rte_pktmbuf_mtod(pkts[i],void *),
+            gen_stream.data + gen_stream.off[g->next_pkt],len);
+        pkts[i]->data_len = pkts[i]->pkt_len = len;
+
+        if(++g->next_pkt == gen_stream.nb_pkts)
+            g->next_pkt = 0;
+    }
+
+    g->nb_pending = nb_pkts;
+
+    return 0;
+}
+
+/* Run as housekeeping between RX bursts. Packets not taken by the
+ * NIC are kept and sent again, with a new timestamp. */
+static void generator_send(struct lcore_cfg *lcore){
+    struct gen_lcore *g = &gen_lcores[rte_lcore_id()];
+    struct latency_trailer trailer;
+    uint64_t now;
+    uint16_t i, sent;
+
+    now = rte_rdtsc();
+
+    if(g->nb_pending == 0){
+        if(gen_burst_tsc != 0){
+            if(now < g->next_tsc)
+                return;
+
+            /* No catching up after falling behind */
+            g->next_tsc = RTE_MAX(g->next_tsc + gen_burst_tsc,now);
+        }
+
+        if(generator_build_burst(g,sfcapp_cfg.params.burst_size) < 0)
+            return;
+    }
+
+    trailer.magic = LATENCY_MAGIC;
+    trailer.tsc = rte_rdtsc();
+
+    for(i = 0 ; i < g->nb_pending ; i++)
+        memcpy(rte_pktmbuf_mtod_offset(g->pending[i],char *,
+            g->pending[i]->data_len - sizeof(trailer)),&trailer,sizeof(trailer));
+
+    sent = rte_eth_tx_burst(sfcapp_cfg.ports[0].id,lcore->queue_id,g->pending,
+        g->nb_pending);
+    lcore->stats.port[0].tx_pkts += sent;
+
+    g->nb_pending -= sent;
+    if(g->nb_pending > 0)
+        memmove(g->pending,&g->pending[sent],g->nb_pending*sizeof(g->pending[0]));
+}
+
+/* Latency percentiles are printed by latency_print() */
+void generator_print_stats(FILE *f){
+    uint64_t returned, other;
+    unsigned lcore_id;
+
+    returned = other = 0;
+    RTE_LCORE_FOREACH(lcore_id){
+        returned += gen_lcores[lcore_id].nb_returned;
+        other += gen_lcores[lcore_id].nb_other;
+    }
+
+    fprintf(f,"%" PRIu64 " generated packets returned, %" PRIu64 " other packets received\n",
+        returned,other);
+}
+
+int generator_setup(void){
+    const struct sfcapp_params *p = &sfcapp_cfg.params;
+    struct vxlan_tmpl tmpl;
+    uint32_t dst_ip;
+    unsigned lcore_id;
+    int i;
+
+    if(p->gen_encap){
+        dst_ip = sfcapp_cfg.sff_ip != 0 ? sfcapp_cfg.sff_ip : VXLAN_DEFAULT_DST_IP;
+        common_vxlan_tmpl_init(&tmpl,0,&sfcapp_cfg.sff_addr,dst_ip,sfcapp_cfg.sff_vni);
+        bench_generate(&gen_stream,&sfcapp_cfg.sff_addr,&tmpl,1,p->gen_paths);
+    }else{
+        bench_generate(&gen_stream,&sfcapp_cfg.sff_addr,NULL,0,1);
+    }
+
+    /* The rate is shared among workers */
+    if(p->gen_rate != 0)
+        gen_burst_tsc = (uint64_t) p->burst_size * sfcapp_cfg.nb_queues *
+            rte_get_tsc_hz() / p->gen_rate;
+
+    /* Workers start at different points of the stream */
+    RTE_LCORE_FOREACH(lcore_id){
+        gen_lcores[lcore_id].next_pkt = (uint64_t) sfcapp_cfg.lcores[lcore_id].queue_id *
+            gen_stream.nb_pkts / sfcapp_cfg.nb_queues;
+    }
+
+    /* Packets come back with whatever addresses the chain set */
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        sfcapp_cfg.ports[i].handle_pkts = generator_handle_pkts;
+        rte_eth_promiscuous_enable(sfcapp_cfg.ports[i].id);
+    }
+
+    sfcapp_cfg.housekeeping = generator_send;
+    sfcapp_cfg.print_stats = generator_print_stats;
+
+    if(p->gen_rate != 0)
+        printf("Generating %" PRIu32 " packets per second\n",p->gen_rate);
+    else
+        printf("Generating at line rate\n");
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef SFCAPP_GENERATOR_
+#define SFCAPP_GENERATOR_
+
+#include <stdio.h>
+
+#include "common.h"
+
+/* Traffic generator, to drive and measure a whole chain.
+ *
+ * Sends bench_flows UDP flows of bench_pkt_len bytes on port 0, to
+ * sff_mac from the config file: plain IPv4 frames as a classifier
+ * expects them or, if gen_encap is set, VXLAN-GPE+NSH frames to the
+ * SFF VTEP, spread among gen_paths SPIs starting at bench_sph's.
+ * Workers send gen_rate packets per second in total, or as many as
+ * port 0 takes if 0.
+ *
+ * Every packet ends with a struct latency_trailer, which gives the
+ * latency of those coming back on any port once through the chain.
+ */
+
+#define GEN_RATE    0   /* Default gen_rate, line rate */
+#define GEN_PATHS   1   /* Default gen_paths */
+
+int generator_setup(void);
+
+void generator_print_stats(FILE *f);
+
+#endif
@@ -11,14 +11,14 @@
 
 extern struct sfcapp_config sfcapp_cfg;
 
-static int loopback_handle_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
+static int loopback_handle_pkts(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts){
 
     uint16_t nb_tx = 0;
     int i;
     
     for(i = 0 ; i < nb_pkts ; i++){
         if(likely(nb_pkts > 0)){
-            nb_tx += rte_eth_tx_buffer(sfcapp_cfg.ports[1].id,0,sfcapp_cfg.ports[1].tx_buffer,mbufs[i]);
+            nb_tx += common_tx_pkt(lcore,1,mbufs[i]);
         }
     }
 
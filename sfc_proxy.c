@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <arpa/inet.h>
 
 #include <rte_hash.h>
 #include <rte_jhash.h>
@@ -6,105 +8,491 @@
 #include <rte_ethdev.h>
 #include <rte_cfgfile.h>
 #include <rte_ether.h>
+#include <rte_log.h>
+#include <rte_rwlock.h>
+#include <rte_malloc.h>
+#include <rte_cycles.h>
+#include <rte_per_lcore.h>
 
 #include "sfc_proxy.h"
 #include "nsh.h"
+#include "nexthop.h"
+#include "rcu.h"
 #include "common.h"
 
 #define VXLAN_NSH_INNER_OFFSET 58
 
 extern struct sfcapp_config sfcapp_cfg;
 
-static struct rte_hash *proxy_flow_lkp_table;
-/* key = ipv4_5tuple ; value = NSH base hdr + SPI + SI (4B) */
+/* Per-flow state, indexed by the position rte_hash gives to each
+ * key. The NSH header and the timestamp share a cache line, so a
+ * hit costs a single extra line. */
+struct proxy_flow_slot {
+    uint64_t nsh_header;        /* NSH base hdr + SPI + SI, see nsh_header_to_uint64() */
+    uint64_t last_seen;         /* TSC of last packet, 0 if slot is free */
+    struct ipv4_5tuple key;     /* Needed to delete the entry when aged */
+} __attribute__((__aligned__(32)));
+
+/* The NSH length of a stored header tells whether the flow has
+ * metadata, so that flows without any never touch it */
+#define PROXY_SLOT_HAS_MD(nsh_header) \
+    ((((nsh_header) >> 48) & NSH_LENGTH_MASK) != NSH_BASE_LENGHT_MD_TYPE_2)
+
+/* In pipeline mode each worker gets its own table: the RX stage
+ * sends both directions of a flow to the same worker, so no lock is
+ * needed. Otherwise flows may show up on any queue and all workers
+ * share one table.
+ *
+ * rte_hash does not support lookups concurrent with inserts, and
+ * every worker may learn new flows. In a shared table, lookups take
+ * the read side of the lock, inserts and deletes the write side. */
+struct proxy_flow_table {
+    struct rte_hash *hash;      /* key = ipv4_5tuple ; position = index in slots */
+    struct rte_hash *hash6;     /* key = ipv6_5tuple ; position + nb_slots = index in slots */
+    struct proxy_flow_slot *slots;
+    struct ipv6_5tuple *keys6;  /* Keys of hash6 by position, too long for the slots */
+    struct nsh_md *md;          /* Metadata restored on the way back, by slot */
+    uint32_t nb_slots;          /* IPv4 flows, IPv6 ones follow */
+    uint32_t nb_slots6;
+    int shared;
+    rte_rwlock_t lock;
+
+    /* Only updated by the owner, or with lock held for writing */
+    struct {
+        uint64_t evictions;     /* Flows removed after being idle */
+        uint64_t table_full;    /* New flows not learned, table was full */
+        uint32_t nb_flows;      /* Flows in the table */
+        uint32_t nb_flows6;
+    } stats;
+} __rte_cache_aligned;
+
+static struct proxy_flow_table *proxy_flow_tables[RTE_MAX_LCORE];
+/* Table used by each worker, by lcore id */
+
+static struct proxy_flow_table *proxy_flow_table_list[RTE_MAX_LCORE];
+static unsigned proxy_nb_flow_tables;
+
+static uint64_t proxy_flow_timeout_tsc; /* 0 disables aging */
+
+/* Next slot to be checked by this lcore's aging sweep */
+static RTE_DEFINE_PER_LCORE(uint32_t, proxy_aging_cursor);
+
+static struct nh_config *proxy_nh_cfg;
+/* [SFC_NODE] and [SF] entries being staged for the next table */
+
+static struct nh_config *proxy_nh_cfg_cur;
+/* Entries the current table was built from */
+
+static struct nh_table *proxy_nh_tables[RTE_MAX_NUMA_NODES];
+/* index = <spi,si> ; value = SF address. One copy per socket.
+ * Replaced on reload, read with rcu_dereference() */
+
+static inline void proxy_flow_read_lock(struct proxy_flow_table *t){
+    if(t->shared)
+        rte_rwlock_read_lock(&t->lock);
+}
 
-static struct rte_hash* proxy_sf_id_lkp_table;
-/* key = <spi,si> ; value = sfid (16b) */
+static inline void proxy_flow_read_unlock(struct proxy_flow_table *t){
+    if(t->shared)
+        rte_rwlock_read_unlock(&t->lock);
+}
 
-static struct rte_hash *proxy_sf_address_lkp_table;
-/* key = sfid (16b) ; value = ethernet (48b in 64b) */
+static inline void proxy_flow_write_lock(struct proxy_flow_table *t){
+    if(t->shared)
+        rte_rwlock_write_lock(&t->lock);
+}
 
-static int proxy_init_flow_table(void){
+static inline void proxy_flow_write_unlock(struct proxy_flow_table *t){
+    if(t->shared)
+        rte_rwlock_write_unlock(&t->lock);
+}
 
-    const struct rte_hash_parameters hash_params = {
-        .name = "proxy_flow",
-        .entries = PROXY_MAX_FLOWS,
+static struct proxy_flow_table *proxy_create_flow_table(uint32_t entries, uint32_t entries6,
+    int socket){
+    struct proxy_flow_table *t;
+    char name[RTE_HASH_NAMESIZE];
+    char name6[RTE_HASH_NAMESIZE];
+
+    struct rte_hash_parameters hash_params = {
+        .name = name,
+        .entries = entries,
         .reserved = 0,
         .key_len = sizeof(struct ipv4_5tuple),
         .hash_func = rte_jhash,
         .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
+        .socket_id = socket
     };
 
-    proxy_flow_lkp_table = rte_hash_create(&hash_params);
-
-    if(proxy_flow_lkp_table == NULL)
-        return -1;
-    
-    return 0;
-}
-
-static int proxy_init_sf_addr_table(void){
-    
-    const struct rte_hash_parameters hash_params = {
-        .name = "proxy_sf_addr",
-        .entries = PROXY_MAX_FUNCTIONS,
+    struct rte_hash_parameters hash6_params = {
+        .name = name6,
+        .entries = entries6,
         .reserved = 0,
-        .key_len = sizeof(uint16_t), /* SFID */
+        .key_len = sizeof(struct ipv6_5tuple),
         .hash_func = rte_jhash,
         .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
+        .socket_id = socket
     };
 
-    proxy_sf_address_lkp_table = rte_hash_create(&hash_params);
+    snprintf(name,sizeof(name),"proxy_flow_%u",proxy_nb_flow_tables);
+    snprintf(name6,sizeof(name6),"proxy_flow6_%u",proxy_nb_flow_tables);
 
-    if(proxy_sf_address_lkp_table == NULL)
-        return -1;
+    t = rte_zmalloc_socket(NULL,sizeof(*t),RTE_CACHE_LINE_SIZE,socket);
+    if(t == NULL)
+        return NULL;
 
-    return 0;
+    t->hash = rte_hash_create(&hash_params);
+    t->hash6 = rte_hash_create(&hash6_params);
+    if(t->hash == NULL || t->hash6 == NULL)
+        return NULL;
+
+    /* Positions returned by rte_hash are below the number of entries */
+    t->nb_slots = entries;
+    t->nb_slots6 = entries6;
+    t->slots = rte_zmalloc_socket("proxy_flow_slots",
+        (t->nb_slots + t->nb_slots6)*sizeof(struct proxy_flow_slot),
+        RTE_CACHE_LINE_SIZE,socket);
+
+    if(t->slots == NULL)
+        return NULL;
+
+    t->keys6 = rte_zmalloc_socket("proxy_flow_keys6",t->nb_slots6*sizeof(struct ipv6_5tuple),
+        RTE_CACHE_LINE_SIZE,socket);
+
+    if(t->keys6 == NULL)
+        return NULL;
+
+    t->md = rte_zmalloc_socket("proxy_flow_md",
+        (t->nb_slots + t->nb_slots6)*sizeof(struct nsh_md),
+        RTE_CACHE_LINE_SIZE,socket);
+
+    if(t->md == NULL)
+        return NULL;
+
+    rte_rwlock_init(&t->lock);
+    proxy_flow_table_list[proxy_nb_flow_tables++] = t;
+
+    return t;
 }
 
-static int proxy_init_sf_id_lkp_table(void){
-    const struct rte_hash_parameters hash_params = {
-        .name = "proxy_next_func",
-        .entries = PROXY_MAX_FUNCTIONS,
-        .reserved = 0,
-        .key_len = sizeof(uint32_t),  /* <SPI,SI> */
-        .hash_func = rte_jhash,
-        .hash_func_init_val = 0,
-        .socket_id = rte_socket_id()
-    };
+static int proxy_init_flow_table(void){
+    struct proxy_flow_table *t;
+    unsigned lcore_id, nb_workers;
+    uint32_t entries, entries6;
+
+    nb_workers = sfcapp_cfg.params.pipeline_workers;
+
+    if(nb_workers == 0){
+        t = proxy_create_flow_table(sfcapp_cfg.params.proxy_max_flows,
+            sfcapp_cfg.params.proxy_max_flows6,rte_socket_id());
+        if(t == NULL)
+            return -1;
+
+        t->shared = 1;
+        RTE_LCORE_FOREACH(lcore_id)
+            proxy_flow_tables[lcore_id] = t;
+    }else{
+        /* proxy_max_flows and proxy_max_flows6 are split among workers */
+        entries = RTE_MAX((sfcapp_cfg.params.proxy_max_flows + nb_workers - 1) / nb_workers,
+            PROXY_MIN_FLOWS);
+        entries6 = RTE_MAX((sfcapp_cfg.params.proxy_max_flows6 + nb_workers - 1) / nb_workers,
+            PROXY_MIN_FLOWS);
+
+        RTE_LCORE_FOREACH(lcore_id){
+            if(sfcapp_cfg.lcores[lcore_id].role != LCORE_WORKER)
+                continue;
 
-    proxy_sf_id_lkp_table = rte_hash_create(&hash_params);
+            t = proxy_create_flow_table(entries,entries6,rte_lcore_to_socket_id(lcore_id));
+            if(t == NULL)
+                return -1;
 
-    if(proxy_sf_id_lkp_table == NULL)
-        return -1;
+            proxy_flow_tables[lcore_id] = t;
+        }
+    }
+
+    proxy_flow_timeout_tsc = sfcapp_cfg.params.proxy_flow_timeout_ms *
+        (rte_get_tsc_hz() / MS_PER_S);
 
+    printf("Proxy flow table: %u x %" PRIu32 " + %" PRIu32 " IPv6 entries,"
+        " idle timeout %" PRIu32 " ms\n",
+        proxy_nb_flow_tables,proxy_flow_table_list[0]->nb_slots,
+        proxy_flow_table_list[0]->nb_slots6,sfcapp_cfg.params.proxy_flow_timeout_ms);
+    
     return 0;
 }
 
-void proxy_add_sph_entry(uint32_t sph, uint16_t sfid){
+/* Incremental aging sweep, run by every worker between bursts.
+ * Each worker checks at most PROXY_AGING_BATCH slots of its own
+ * table, or of its own share of the shared table, per call, and
+ * only takes the write lock when some flow actually expired. */
+static void proxy_age_flows(struct lcore_cfg *lcore){
+    struct proxy_flow_table *t = proxy_flow_tables[rte_lcore_id()];
+    const uint32_t nb_slots = t->nb_slots + t->nb_slots6;
+    uint32_t first, last, cursor, n, nb_expired;
+    uint32_t expired[PROXY_AGING_BATCH];
+    struct proxy_flow_slot *slot;
+    uint64_t now;
+
+    if(proxy_flow_timeout_tsc == 0)
+        return;
+
+    if(t->shared){
+        first = (uint64_t) nb_slots * lcore->queue_id / sfcapp_cfg.nb_queues;
+        last  = (uint64_t) nb_slots * (lcore->queue_id + 1) / sfcapp_cfg.nb_queues;
+    }else{
+        first = 0;
+        last  = nb_slots;
+    }
+
+    if(unlikely(first == last))
+        return;
+
+    cursor = RTE_PER_LCORE(proxy_aging_cursor);
+    if(unlikely(cursor < first || cursor >= last))
+        cursor = first;
+
+    now = rte_rdtsc();
+
+    for(n = 0, nb_expired = 0 ; n < PROXY_AGING_BATCH ; n++){
+        slot = &t->slots[cursor];
+
+        if(slot->last_seen != 0 && now - slot->last_seen > proxy_flow_timeout_tsc)
+            expired[nb_expired++] = cursor;
+
+        if(++cursor == last)
+            cursor = first;
+    }
+
+    RTE_PER_LCORE(proxy_aging_cursor) = cursor;
+
+    if(likely(nb_expired == 0))
+        return;
+
+    proxy_flow_write_lock(t);
+
+    for(n = 0 ; n < nb_expired ; n++){
+        slot = &t->slots[expired[n]];
+
+        /* Flow may have been seen since it was checked */
+        if(slot->last_seen == 0 || now - slot->last_seen <= proxy_flow_timeout_tsc)
+            continue;
+
+        if(expired[n] < t->nb_slots){
+            rte_hash_del_key(t->hash,&slot->key);
+            t->stats.nb_flows--;
+        }else{
+            rte_hash_del_key(t->hash6,&t->keys6[expired[n] - t->nb_slots]);
+            t->stats.nb_flows6--;
+        }
+
+        slot->last_seen = 0;
+        t->stats.evictions++;
+    }
+
+    proxy_flow_write_unlock(t);
+}
+
+void proxy_print_stats(FILE *f){
+    const struct proxy_flow_table *t;
+    uint64_t evictions, table_full;
+    uint32_t nb_flows;
+    unsigned i;
+
+    evictions = table_full = 0;
+    nb_flows = 0;
+    for(i = 0 ; i < proxy_nb_flow_tables ; i++){
+        t = proxy_flow_table_list[i];
+        evictions += t->stats.evictions;
+        table_full += t->stats.table_full;
+        nb_flows += t->stats.nb_flows + t->stats.nb_flows6;
+    }
+
+    fprintf(f,"%" PRIu32 " proxy flows in table\n"
+        "%" PRIu64 " proxy flows evicted\n"
+        "%" PRIu64 " proxy flows not learned (table full)\n",
+        nb_flows,evictions,table_full);
+
+    nh_table_print_stats(f,proxy_nh_tables);
+}
+
+int proxy_add_sph_entry(uint32_t sph, uint16_t sfid, uint8_t port){
+    const uint32_t spi = (sph & NSH_SPI_MASK) >> 8;
     int ret;
 
-    ret = rte_hash_add_key_data(proxy_sf_id_lkp_table,&sph, 
-        (void *) ((uint64_t) sfid) );
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to add stub entry 1.\n");
+    /* The SPI is the S-VID, neither 0 nor 0xFFF */
+    if(sfcapp_cfg.params.proxy_mode == PROXY_MODE_VLAN &&
+       (spi < PROXY_VLAN_MIN_SPI || spi > PROXY_VLAN_MAX_SPI)){
+        RTE_LOG(ERR,USER1,"SPI %" PRIu32 " of <sph=%" PRIx32 "> cannot be carried in a"
+            " QinQ tag, must be %d to %d.\n",spi,sph,PROXY_VLAN_MIN_SPI,PROXY_VLAN_MAX_SPI);
+        return -1;
+    }
+
+    ret = nh_config_add_sph(proxy_nh_cfg,sph,sfid,port);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add stub entry 1.\n");
+        return -1;
+    }
 
     printf("Added <sph=%" PRIx32 ",sfid=%" PRIx16 ">"
             " to proxy SF ID table.\n",sph,sfid);
+
+    return 0;
 }
 
-void proxy_add_sf_address_entry(uint16_t sfid, struct ether_addr *eth_addr){
+int proxy_add_sf_address_entry(uint16_t sfid, const struct nh_sf_pool *pool){
     int ret;
+    char buf[ETHER_ADDR_FMT_SIZE + 1];
+    char ip[INET_ADDRSTRLEN];
+    const struct nh_sf_addr *addr;
+    uint32_t ip_be;
+    unsigned i;
+
+    ret = nh_config_add_sf(proxy_nh_cfg,sfid,pool);
+    if(ret < 0){
+        RTE_LOG(ERR,USER1,"Failed to add SF entry to proxy table.\n");
+        return -1;
+    }
 
-    ret = rte_hash_add_key_data(proxy_sf_address_lkp_table,&sfid, 
-        (void *) common_mac_to_64(eth_addr));
-    SFCAPP_CHECK_FAIL_LT(ret,0,"Failed to add SF entry to proxy table.\n");
+    for(i = 0 ; i < pool->nb_instances ; i++){
+        addr = &pool->addr[i];
+        ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,&addr->mac);
+        ip_be = rte_cpu_to_be_32(addr->ip);
+        inet_ntop(AF_INET,&ip_be,ip,sizeof(ip));
+        printf("Added <sfid=%" PRIx16 ",mac=%s,ip=%s,vni=%" PRIu32 ",weight=%" PRIu8
+            ",port=%" PRIu8 "> to proxy SF address table.\n",sfid,buf,
+            addr->ip != 0 ? ip : "-",addr->vni,pool->weights[i],pool->port);
+    }
 
-    char buf[ETHER_ADDR_FMT_SIZE + 1];
-    ether_format_addr(buf,ETHER_ADDR_FMT_SIZE,eth_addr);
-    printf("Added <sfid=%" PRIx16 ",mac=%s> to proxy" 
-        " SF Address table.\n",sfid,buf);
+    return 0;
+}
+
+int proxy_del_sph_entry(uint32_t sph){
+
+    if(nh_config_del_sph(proxy_nh_cfg,sph) < 0){
+        RTE_LOG(ERR,USER1,"No <sph=%" PRIx32 "> in proxy SF ID table.\n",sph);
+        return -1;
+    }
+
+    printf("Removed <sph=%" PRIx32 "> from proxy SF ID table.\n",sph);
+
+    return 0;
+}
+
+int proxy_del_sf_address_entry(uint16_t sfid){
+
+    if(nh_config_del_sf(proxy_nh_cfg,sfid) < 0){
+        RTE_LOG(ERR,USER1,"No <sfid=%" PRIx16 "> in proxy SF address table.\n",sfid);
+        return -1;
+    }
+
+    printf("Removed <sfid=%" PRIx16 "> from proxy SF address table.\n",sfid);
+
+    return 0;
+}
+
+int proxy_config_begin(void){
+
+    nh_config_free(proxy_nh_cfg);
+
+    proxy_nh_cfg = nh_config_create(sfcapp_cfg.params.proxy_max_functions);
+    if(proxy_nh_cfg == NULL){
+        RTE_LOG(ERR,USER1,"Proxy: Failed to create next-hop configuration.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int proxy_config_edit(void){
+
+    if(proxy_nh_cfg_cur == NULL)
+        return proxy_config_begin();
+
+    nh_config_free(proxy_nh_cfg);
+
+    proxy_nh_cfg = nh_config_copy(proxy_nh_cfg_cur);
+    if(proxy_nh_cfg == NULL){
+        RTE_LOG(ERR,USER1,"Proxy: Failed to create next-hop configuration.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void proxy_config_abort(void){
+    nh_config_free(proxy_nh_cfg);
+    proxy_nh_cfg = NULL;
+}
+
+int proxy_build_tables(void){
+    struct nh_table *new_tables[RTE_MAX_NUMA_NODES], *old_tables[RTE_MAX_NUMA_NODES];
+    unsigned socket;
+    int replaced;
+
+    if(nh_table_build_all(proxy_nh_cfg,new_tables) < 0){
+        RTE_LOG(ERR,USER1,"Proxy: Failed to build SF lookup table.\n");
+        proxy_config_abort();
+        return -1;
+    }
+
+    /* Kept to be edited by the next update */
+    nh_config_free(proxy_nh_cfg_cur);
+    proxy_nh_cfg_cur = proxy_nh_cfg;
+    proxy_nh_cfg = NULL;
+
+    /* Free the old tables once no worker can be using them */
+    replaced = 0;
+    for(socket = 0 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        old_tables[socket] = proxy_nh_tables[socket];
+        replaced |= old_tables[socket] != NULL;
+        rcu_assign_pointer(proxy_nh_tables[socket],new_tables[socket]);
+    }
+
+    if(replaced){
+        rcu_synchronize();
+        nh_table_free_all(old_tables);
+    }
+
+    return 0;
+}
+
+static void proxy_print_tables(FILE *f){
+    uint32_t nb_sph, nb_sf, max_entries, nb_flows, nb_slots, nb_flows6, nb_slots6;
+    unsigned i;
+
+    nb_sph = nb_sf = max_entries = 0;
+    if(proxy_nh_cfg_cur != NULL)
+        nh_config_usage(proxy_nh_cfg_cur,&nb_sph,&nb_sf,&max_entries);
+
+    nb_flows = nb_slots = nb_flows6 = nb_slots6 = 0;
+    for(i = 0 ; i < proxy_nb_flow_tables ; i++){
+        nb_flows += proxy_flow_table_list[i]->stats.nb_flows;
+        nb_slots += proxy_flow_table_list[i]->nb_slots;
+        nb_flows6 += proxy_flow_table_list[i]->stats.nb_flows6;
+        nb_slots6 += proxy_flow_table_list[i]->nb_slots6;
+    }
+
+    fprintf(f,"\"flows\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 ",\"tables\":%u},"
+        "\"flows6\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},"
+        "\"sfc_nodes\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},"
+        "\"sfs\":{\"used\":%" PRIu32 ",\"size\":%" PRIu32 "},",
+        nb_flows,nb_slots,proxy_nb_flow_tables,nb_flows6,nb_slots6,
+        nb_sph,max_entries,nb_sf,max_entries);
+    nh_table_print_json(f,proxy_nh_tables);
+}
+
+/* Looks up the IPv6 packets of a burst in hash6, with the lock
+ * held. Their positions, turned into slot indexes, replace the ones
+ * the IPv4 lookup gave for their zeroed tuples. */
+static void proxy_flow_lookup6(struct proxy_flow_table *t, const void **keys6,
+    const uint16_t *idx6, uint16_t nb_v6, int32_t *positions){
+    int32_t positions6[MAX_BURST_SIZE];
+    uint16_t j;
+
+    rte_hash_lookup_bulk(t->hash6,keys6,nb_v6,positions6);
+
+    for(j = 0 ; j < nb_v6 ; j++)
+        positions[idx6[j]] = positions6[j] >= 0 ?
+            positions6[j] + (int32_t) t->nb_slots : positions6[j];
 }
 
 /* This function does all the processing on packets coming from 
@@ -114,121 +502,471 @@ void proxy_add_sf_address_entry(uint16_t sfid, struct ether_addr *eth_addr){
  * - Decapsulating the packet
  * - Adding the corresponding SF MAC address
  * 
- * It handles packets in bulks. This can be further optimized by
- * using other DPDK bulk operations.
+ * It handles packets in bulks: keys are extracted for the whole
+ * burst first, and then each table is queried with a single bulk
+ * lookup, so that the cache misses of all packets overlap.
  */ 
-static int proxy_handle_inbound_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
-
-    struct nsh_hdr nsh_header;
-    struct ipv4_5tuple tuple = { .proto = 0, .src_ip = 0, .dst_ip = 0, .src_port = 0, .dst_port = 0};
-    uint16_t sfid;
-    uint64_t data;
-    struct ether_addr sf_mac;
-    int i, lkp, drop, nb_tx;
-    uint16_t offset;
-    uint64_t sf_mac_64;
-    uint64_t nsh_header_64;
+static int proxy_handle_inbound_pkts(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts){
+
+    struct nsh_hdr nsh_headers[MAX_BURST_SIZE];
+    struct ipv4_5tuple tuples[MAX_BURST_SIZE];
+    struct ipv6_5tuple tuples6[MAX_BURST_SIZE];
+    const void *keys[MAX_BURST_SIZE];
+    const void *keys6[MAX_BURST_SIZE];
+    uint16_t idx6[MAX_BURST_SIZE];
+    int32_t positions[MAX_BURST_SIZE];
+    const struct nh_entry *nh[MAX_BURST_SIZE];
+    const struct nh_table *nh_table = rcu_dereference(proxy_nh_tables[lcore->socket_id]);
+    struct proxy_flow_table *t = proxy_flow_tables[rte_lcore_id()];
+    struct proxy_flow_slot *slot;
+    struct nsh_hdr learned;
+    int i, nb_tx;
+    int32_t pos;
+    uint16_t offset, md_len, nb_v6;
+    uint64_t drop_mask, miss_mask, bad_mask, v4_mask, v6_mask, ip_mask;
+    uint64_t now;
 
     nb_tx = 0;
+    nb_v6 = 0;
+    drop_mask = miss_mask = bad_mask = v6_mask = 0;
+    now = rte_rdtsc();
+
+    offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + 
+        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr) +
+        sizeof(struct nsh_hdr);
+
+    /* Get inner 5-tuples and NSH headers. IPv6 packets are looked
+     * up in their own table. Other packets are left with a zeroed
+     * IPv4 tuple, which must neither be learned nor matched. */
+    v4_mask = common_ipv4_get_5tuple_bulk(mbufs,tuples,keys,nb_pkts,offset);
 
     for(i = 0; i < nb_pkts ; i++){
-        drop = 0;
-        
-        nsh_get_header(mbufs[i],&nsh_header);
+        if(unlikely(nsh_get_header(mbufs[i],&nsh_headers[i]) < 0)){
+            bad_mask |= (1ULL << i);
+            continue;
+        }
+
+        /* Metadata moves the inner packet */
+        md_len = nsh_md_len(&nsh_headers[i]);
+        if(unlikely(md_len != 0)){
+            if(common_ipv4_get_5tuple(mbufs[i],&tuples[i],offset + md_len) == 0)
+                v4_mask |= (1ULL << i);
+            else{
+                memset(&tuples[i],0,sizeof(struct ipv4_5tuple));
+                v4_mask &= ~(1ULL << i);
+            }
+        }
+
+        if(unlikely((v4_mask & (1ULL << i)) == 0) &&
+           common_ipv6_get_5tuple(mbufs[i],&tuples6[i],offset + md_len) == 0){
+            keys6[nb_v6] = &tuples6[i];
+            idx6[nb_v6++] = i;
+            v6_mask |= (1ULL << i);
+        }
+    }
+
+    ip_mask = v4_mask | v6_mask;
+
+    /* Check which flows are already on table */
+    proxy_flow_read_lock(t);
+    rte_hash_lookup_bulk(t->hash,keys,nb_pkts,positions);
+    if(unlikely(nb_v6 > 0))
+        proxy_flow_lookup6(t,keys6,idx6,nb_v6,positions);
+
+    for(i = 0; i < nb_pkts ; i++){
+        if(unlikely((ip_mask & (1ULL << i)) == 0))
+            positions[i] = -ENOENT;
+        else if(likely(positions[i] >= 0))
+            rte_prefetch0(&t->slots[positions[i]]);
+    }
 
-        offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + 
-            sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr) +
-            sizeof(struct nsh_hdr);
+    for(i = 0; i < nb_pkts ; i++){
+        if(likely(positions[i] >= 0))
+            t->slots[positions[i]].last_seen = now;
+        else
+            miss_mask |= (1ULL << i);
+    }
+    proxy_flow_read_unlock(t);
 
-        common_ipv4_get_5tuple(mbufs[i],&tuple,offset);        
+    /* Learn new flows. The header stored is the one the packet
+     * should carry when coming back from the SF. */
+    if(unlikely(miss_mask != 0)){
+        proxy_flow_write_lock(t);
+
+        for(i = 0; i < nb_pkts ; i++){
+            if((miss_mask & ~bad_mask & ip_mask & (1ULL << i)) == 0)
+                continue;
 
-        lkp = rte_hash_lookup(proxy_flow_lkp_table,&tuple);
+            if( (nsh_headers[i].serv_path & 0x000000FF) == 0 ){
+                drop_mask |= (1ULL << i); /* SI exhausted */
+                continue;
+            }
 
-        if(unlikely(lkp < 0)){
-            if( (nsh_header.serv_path & 0x000000FF) != 0 ){
-                nsh_header.serv_path--;
-            }else{ /* Drop packet */
-                drop = 1;
+            if(unlikely(v6_mask & (1ULL << i))){
+                pos = rte_hash_add_key(t->hash6,&tuples6[i]);
+                if(pos >= 0){
+                    t->keys6[pos] = tuples6[i];
+                    pos += t->nb_slots;
+                }
+            }else
+                pos = rte_hash_add_key(t->hash,&tuples[i]);
+
+            /* Packet still goes to the SF, but its flow won't
+             * be recognized on the way back */
+            if(unlikely(pos < 0)){
+                t->stats.table_full++;
                 continue;
             }
 
-            nsh_header_64 = nsh_header_to_uint64(&nsh_header);
-            lkp = rte_hash_add_key_data(proxy_flow_lkp_table,
-                &tuple, (void *) nsh_header_64);
+            slot = &t->slots[pos];
+            if(slot->last_seen == 0){   /* Not learned earlier in the burst */
+                if(unlikely(v6_mask & (1ULL << i)))
+                    t->stats.nb_flows6++;
+                else
+                    t->stats.nb_flows++;
+            }
 
-            nsh_header.serv_path++;
+            /* Metadata too long to keep is not restored */
+            learned = nsh_headers[i];
+            learned.serv_path--;
+            if(unlikely(nsh_md_len(&learned) != 0) &&
+               nsh_get_md(mbufs[i],&learned,&t->md[pos]) < 0)
+                learned.basic_info = (learned.basic_info & ~NSH_LENGTH_MASK) |
+                    NSH_BASE_LENGHT_MD_TYPE_2;
+
+            slot->nsh_header = nsh_header_to_uint64(&learned);
+            slot->last_seen = now;
+            slot->key = tuples[i];
         }
 
-        nsh_decap(mbufs[i]);
-        
-        lkp = rte_hash_lookup_data(proxy_sf_id_lkp_table, 
-                (void *) &nsh_header.serv_path,
-                (void **) &data);
-        COND_MARK_DROP(lkp,drop);
+        proxy_flow_write_unlock(t);
+    }
+
+    /* Match <SPI,SI> to SF addresses */
+    for(i = 0; i < nb_pkts ; i++){
+        nh[i] = nh_lookup(nh_table,nsh_headers[i].serv_path);
+        rte_prefetch0(nh[i]);
+    }
 
-        sfid = (uint16_t) data;
+    for(i = 0; i < nb_pkts ; i++){
+        if(unlikely(bad_mask & (1ULL << i))){
+            common_drop_pkt(lcore,mbufs[i],DROP_BAD_NSH);
+            continue;
+        }
+
+        if(unlikely(drop_mask & (1ULL << i))){
+            common_drop_pkt(lcore,mbufs[i],DROP_SI_EXHAUSTED);
+            continue;
+        }
 
-        lkp = rte_hash_lookup_data(proxy_sf_address_lkp_table,
-                (void *) &sfid,
-                (void **) &sf_mac_64);
+        /* Neither IPv4 nor IPv6, never part of a chain */
+        if(unlikely((ip_mask & (1ULL << i)) == 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NOT_IPV4);
+            continue;
+        }
 
-        COND_MARK_DROP(lkp,drop);
+        /* Unknown <SPI,SI>, or end of chain which makes no
+         * sense for a proxy */
+        if(unlikely(nh[i]->action != NH_ACTION_FORWARD)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NO_MATCH);
+            continue;
+        }
 
-        // Convert hash data back to MAC
-        common_64_to_mac(sf_mac_64,&sf_mac);
+        if(unlikely(nsh_decap(mbufs[i]) < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+            continue;
+        }
 
-        common_mac_update(mbufs[i],&sfcapp_cfg.ports[1].mac,&sf_mac);
+        nh_rewrite(nh_table,nh[i],mbufs[i]);
 
         /* Enqueue packet for TX */
-        nb_tx += rte_eth_tx_buffer(sfcapp_cfg.ports[1].id,0,sfcapp_cfg.ports[1].tx_buffer,mbufs[i]);
-
-        if(unlikely(drop))
-            rte_pktmbuf_free(mbufs[i]);
+        nb_tx += common_tx_pkt(lcore,nh[i]->port,mbufs[i]);
     }
 
     return nb_tx;
 }
 
-static int proxy_handle_outbound_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts){
+/* Points the outer headers of mbuf, encapsulated again, to the SFF,
+ * through its VTEP if one is set. The source port is the one the
+ * classifier picks for the flow of flow_hash. */
+static inline void proxy_to_sff(struct rte_mbuf *mbuf, uint32_t sph, uint32_t flow_hash){
+
+    const uint16_t port_idx = sfcapp_cfg.sff_port;
+
+    if(sfcapp_cfg.sff_ip != 0)
+        common_vxlan_rewrite(mbuf,&sfcapp_cfg.ports[port_idx].vxlan_tmpl,port_idx);
+    else
+        common_mac_update(mbuf,&sfcapp_cfg.ports[port_idx].mac,&sfcapp_cfg.sff_addr);
+
+    common_vxlan_set_src_port(mbuf,rte_hash_crc_4byte(sph >> 8,flow_hash));
+}
+
+static int proxy_handle_outbound_pkts(struct lcore_cfg *lcore, struct rte_mbuf **mbufs, uint16_t nb_pkts){
     struct nsh_hdr nsh_header;
-    uint64_t nsh_header_64;
-    struct ipv4_5tuple tuple;
-    uint16_t offset;
-    int i,lkp,drop,nb_tx;
+    struct ipv4_5tuple tuples[MAX_BURST_SIZE];
+    struct ipv6_5tuple tuples6[MAX_BURST_SIZE];
+    const void *keys[MAX_BURST_SIZE];
+    const void *keys6[MAX_BURST_SIZE];
+    uint16_t idx6[MAX_BURST_SIZE];
+    int32_t positions[MAX_BURST_SIZE];
+    uint64_t nsh_headers_64[MAX_BURST_SIZE];
+    struct nsh_md md[MAX_BURST_SIZE];
+    struct proxy_flow_table *t = proxy_flow_tables[rte_lcore_id()];
+    uint16_t offset, nb_v6;
+    uint64_t now, md_mask, v4_mask, v6_mask;
+    uint32_t flow_hash;
+    int i,nb_tx;
 
     nb_tx = 0;
+    nb_v6 = 0;
+    md_mask = v6_mask = 0;
+    now = rte_rdtsc();
+
+    offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + 
+        sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr);
+
+    v4_mask = common_ipv4_get_5tuple_bulk(mbufs,tuples,keys,nb_pkts,offset);
+    if(unlikely(v4_mask != RTE_LEN2MASK(nb_pkts,uint64_t)))
+        nb_v6 = common_ipv6_get_5tuple_bulk(mbufs,tuples6,keys6,idx6,&v6_mask,nb_pkts,
+            ~v4_mask,offset);
+
+    /* Get packet headers from flow table */
+    proxy_flow_read_lock(t);
+    rte_hash_lookup_bulk(t->hash,keys,nb_pkts,positions);
+    if(unlikely(nb_v6 > 0))
+        proxy_flow_lookup6(t,keys6,idx6,nb_v6,positions);
 
+    /* The zeroed IPv4 tuple of non-IP packets must not match */
     for(i = 0 ; i < nb_pkts ; i++){
-        drop = 0;
+        if(unlikely(((v4_mask | v6_mask) & (1ULL << i)) == 0))
+            positions[i] = -ENOENT;
+        else if(likely(positions[i] >= 0))
+            rte_prefetch0(&t->slots[positions[i]]);
+    }
 
-        //common_dump_pkt(mbufs[i],"\n=== Received from SF ===\n");
+    for(i = 0 ; i < nb_pkts ; i++){
+        if(likely(positions[i] >= 0)){
+            t->slots[positions[i]].last_seen = now;
+            nsh_headers_64[i] = t->slots[positions[i]].nsh_header;
+
+            /* Copied, the slot may be reused once unlocked */
+            if(unlikely(PROXY_SLOT_HAS_MD(nsh_headers_64[i]))){
+                md[i] = t->md[positions[i]];
+                md_mask |= (1ULL << i);
+            }
+        }
+    }
+    proxy_flow_read_unlock(t);
+
+    for(i = 0 ; i < nb_pkts ; i++){
 
-        offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + 
-            sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr);
+        //common_dump_pkt(mbufs[i],"\n=== Received from SF ===\n");
 
-        common_ipv4_get_5tuple(mbufs[i],&tuple,offset);
+        /* Neither IPv4 nor IPv6, ARP from the SF included */
+        if(unlikely(((v4_mask | v6_mask) & (1ULL << i)) == 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NOT_IPV4);
+            continue;
+        }
 
-        /* Get packet header from hash table */
-        lkp = rte_hash_lookup_data(proxy_flow_lkp_table,
-                (void*) &tuple,(void**) &nsh_header_64);
-        COND_MARK_DROP(lkp,drop);
+        /* Unknown flow */
+        if(unlikely(positions[i] < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NO_MATCH);
+            continue;
+        }
         
-        nsh_uint64_to_header(nsh_header_64,&nsh_header);
+        nsh_uint64_to_header(nsh_headers_64[i],&nsh_header);
         
         /* Encapsulate packet */
-        nsh_encap(mbufs[i],&nsh_header);
+        if(unlikely(nsh_encap(mbufs[i],&nsh_header,
+            (md_mask & (1ULL << i)) ? &md[i] : NULL) < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+            continue;
+        }
 
-        /* Add SFF's MAC address */
-        common_mac_update(mbufs[i],&sfcapp_cfg.ports[0].mac,&sfcapp_cfg.sff_addr);
+        flow_hash = likely((v6_mask & (1ULL << i)) == 0) ?
+            common_ipv4_5tuple_hash(&tuples[i],0) :
+            common_ipv6_5tuple_hash(&tuples6[i],0);
+        proxy_to_sff(mbufs[i],nsh_header.serv_path,flow_hash);
 
         //printf("Sending to SFF...\n");
         //common_dump_pkt(mbufs[i],"\n=== Encapsulated packet ===\n");
 
         /* Enqueue packet for TX */
-        nb_tx += rte_eth_tx_buffer(sfcapp_cfg.ports[0].id,0,sfcapp_cfg.ports[0].tx_buffer,mbufs[i]);
+        nb_tx += common_tx_pkt(lcore,sfcapp_cfg.sff_port,mbufs[i]);
+    }
+
+    return nb_tx;
+}
+
+/* Writes <SPI,SI> sph into the inner Ethernet header of mbuf, NSH
+ * already removed, according to proxy_mode. Returns -1 if there is
+ * no room for it. */
+static int proxy_tag(struct rte_mbuf *mbuf, uint32_t sph){
+    const uint16_t macs_end = VXLAN_OUTER_HDR_LEN + 2*ETHER_ADDR_LEN;
+    const uint16_t tags_len = 2*sizeof(struct vlan_hdr);
+    struct ether_hdr *inner;
+    uint16_t *tags;
+    char *start;
+
+    if(unlikely(rte_pktmbuf_data_len(mbuf) < VXLAN_OUTER_HDR_LEN + sizeof(struct ether_hdr)))
+        return -1;
+
+    if(sfcapp_cfg.params.proxy_mode == PROXY_MODE_MAC){
+        inner = rte_pktmbuf_mtod_offset(mbuf,struct ether_hdr *,VXLAN_OUTER_HDR_LEN);
+        inner->s_addr.addr_bytes[0] = PROXY_MAC_PREFIX;
+        *(uint32_t *) &inner->s_addr.addr_bytes[1] = rte_cpu_to_be_32(sph);
+        inner->s_addr.addr_bytes[5] = PROXY_MAC_SUFFIX;
+        return 0;
+    }
 
-        if(unlikely(drop))
-            rte_pktmbuf_free(mbufs[i]);
+    /* Same as nsh_encap(), only the headers before the tags move */
+    start = rte_pktmbuf_prepend(mbuf,tags_len);
+    if(unlikely(start == NULL))
+        return -1;
+
+    memmove(start,start + tags_len,macs_end);
+    common_vxlan_adjust_len(mbuf,tags_len);
+
+    tags = (uint16_t *) (start + macs_end);
+    tags[0] = rte_cpu_to_be_16(ETHER_TYPE_QINQ);
+    tags[1] = rte_cpu_to_be_16((sph & NSH_SPI_MASK) >> 8);
+    tags[2] = rte_cpu_to_be_16(ETHER_TYPE_VLAN);
+    tags[3] = rte_cpu_to_be_16((sph & NSH_SI_MASK) + 1);
+
+    return 0;
+}
+
+/* Reads the <SPI,SI> written by proxy_tag() into sph, removing the
+ * QinQ tag. Returns -1 if mbuf carries none. */
+static int proxy_untag(struct rte_mbuf *mbuf, uint32_t *sph){
+    const uint16_t macs_end = VXLAN_OUTER_HDR_LEN + 2*ETHER_ADDR_LEN;
+    const uint16_t tags_len = 2*sizeof(struct vlan_hdr);
+    const struct ether_addr *mac;
+    const struct ether_hdr *inner;
+    const uint16_t *tags;
+    uint32_t spi, si;
+    char *start;
+
+    if(unlikely(rte_pktmbuf_data_len(mbuf) < macs_end + tags_len + sizeof(uint16_t)))
+        return -1;
+
+    if(sfcapp_cfg.params.proxy_mode == PROXY_MODE_MAC){
+        inner = rte_pktmbuf_mtod_offset(mbuf,const struct ether_hdr *,VXLAN_OUTER_HDR_LEN);
+        mac = &inner->s_addr;
+        if(mac->addr_bytes[0] != PROXY_MAC_PREFIX || mac->addr_bytes[5] != PROXY_MAC_SUFFIX)
+            mac = &inner->d_addr;
+        if(mac->addr_bytes[0] != PROXY_MAC_PREFIX || mac->addr_bytes[5] != PROXY_MAC_SUFFIX)
+            return -1;
+
+        *sph = rte_be_to_cpu_32(*(const uint32_t *) &mac->addr_bytes[1]);
+        return 0;
+    }
+
+    start = rte_pktmbuf_mtod(mbuf,char *);
+    tags = (const uint16_t *) (start + macs_end);
+
+    if(tags[0] != rte_cpu_to_be_16(ETHER_TYPE_QINQ) ||
+       tags[2] != rte_cpu_to_be_16(ETHER_TYPE_VLAN))
+        return -1;
+
+    spi = rte_be_to_cpu_16(tags[1]) & 0xFFF;
+    si = rte_be_to_cpu_16(tags[3]) & 0xFFF;
+    if(si == 0 || si > NSH_SI_MASK + 1)
+        return -1;
+
+    *sph = (spi << 8) | (si - 1);
+
+    memmove(start + tags_len,start,macs_end);
+    rte_pktmbuf_adj(mbuf,tags_len);
+    common_vxlan_adjust_len(mbuf,-tags_len);
+
+    return 0;
+}
+
+/* Stateless counterpart of proxy_handle_inbound_pkts(): the header
+ * the packet should carry when coming back from the SF goes along
+ * with it instead of into the flow table */
+static int proxy_handle_inbound_stateless(struct lcore_cfg *lcore, struct rte_mbuf **mbufs,
+    uint16_t nb_pkts){
+    struct nsh_hdr nsh_headers[MAX_BURST_SIZE];
+    const struct nh_entry *nh[MAX_BURST_SIZE];
+    const struct nh_table *nh_table = rcu_dereference(proxy_nh_tables[lcore->socket_id]);
+    uint64_t bad_mask;
+    int i, nb_tx;
+
+    nb_tx = 0;
+    bad_mask = 0;
+
+    common_prefetch_burst(mbufs,nb_pkts);
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        common_prefetch_next(mbufs,i,nb_pkts);
+        if(unlikely(nsh_get_header(mbufs[i],&nsh_headers[i]) < 0))
+            bad_mask |= (1ULL << i);
+        nh[i] = nh_lookup(nh_table,nsh_headers[i].serv_path);
+        rte_prefetch0(nh[i]);
+    }
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        if(unlikely(bad_mask & (1ULL << i))){
+            common_drop_pkt(lcore,mbufs[i],DROP_BAD_NSH);
+            continue;
+        }
+
+        if(unlikely((nsh_headers[i].serv_path & NSH_SI_MASK) == 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_SI_EXHAUSTED);
+            continue;
+        }
+
+        if(unlikely(nh[i]->action != NH_ACTION_FORWARD)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NO_MATCH);
+            continue;
+        }
+
+        if(unlikely(nsh_decap(mbufs[i]) < 0 ||
+                    proxy_tag(mbufs[i],nsh_headers[i].serv_path - 1) < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+            continue;
+        }
+
+        nh_rewrite(nh_table,nh[i],mbufs[i]);
+
+        nb_tx += common_tx_pkt(lcore,nh[i]->port,mbufs[i]);
+    }
+
+    return nb_tx;
+}
+
+static int proxy_handle_outbound_stateless(struct lcore_cfg *lcore, struct rte_mbuf **mbufs,
+    uint16_t nb_pkts){
+    struct nsh_hdr nsh_header;
+    uint32_t sph;
+    int i, nb_tx;
+
+    nb_tx = 0;
+
+    common_prefetch_burst(mbufs,nb_pkts);
+
+    for(i = 0 ; i < nb_pkts ; i++){
+        common_prefetch_next(mbufs,i,nb_pkts);
+
+        /* Tag lost by the SF */
+        if(unlikely(proxy_untag(mbufs[i],&sph) < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_NO_MATCH);
+            continue;
+        }
+
+        nsh_init_header(&nsh_header);
+        nsh_header.serv_path = sph;
+
+        if(unlikely(nsh_encap(mbufs[i],&nsh_header,NULL) < 0)){
+            common_drop_pkt(lcore,mbufs[i],DROP_ENCAP_ERROR);
+            continue;
+        }
+
+        proxy_to_sff(mbufs[i],sph,common_flow_hash(mbufs[i]));
+
+        nb_tx += common_tx_pkt(lcore,sfcapp_cfg.sff_port,mbufs[i]);
     }
 
     return nb_tx;
@@ -237,20 +975,44 @@ static int proxy_handle_outbound_pkts(struct rte_mbuf **mbufs, uint16_t nb_pkts)
 int proxy_setup(void){
 
     int ret = 0;
+    int (*inbound)(struct lcore_cfg *, struct rte_mbuf **, uint16_t);
+    int (*outbound)(struct lcore_cfg *, struct rte_mbuf **, uint16_t);
+    uint16_t i;
+
+    /* Whole bursts are looked up at once */
+    RTE_BUILD_BUG_ON(MAX_BURST_SIZE > RTE_HASH_LOOKUP_BULK_MAX);
+
+    if(sfcapp_cfg.params.proxy_mode != PROXY_MODE_FLOW_TABLE){
+        printf("Stateless proxy, <SPI,SI> carried in the %s\n",
+            sfcapp_cfg.params.proxy_mode == PROXY_MODE_VLAN ? "QinQ tag" : "source MAC");
+
+        inbound = proxy_handle_inbound_stateless;
+        outbound = proxy_handle_outbound_stateless;
+    }else{
+        ret = proxy_init_flow_table();
+        SFCAPP_CHECK_FAIL_LT(ret,0,
+            "Proxy: Failed to create flow lookup table.\n");
+
+        inbound = proxy_handle_inbound_pkts;
+        outbound = proxy_handle_outbound_pkts;
+        sfcapp_cfg.housekeeping = proxy_age_flows;
+    }
 
-    ret = proxy_init_flow_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,
-        "Proxy: Failed to create flow lookup table.\n");
-    ret = proxy_init_sf_addr_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,
-        "Proxy: Failed to create SF address lookup table.\n");
-    ret = proxy_init_sf_id_lkp_table();
-    SFCAPP_CHECK_FAIL_LT(ret,0,
-        "Proxy: Failed to create SF id lookup table.\n");
-    
-    sfcapp_cfg.ports[0].handle_pkts = proxy_handle_inbound_pkts;
-    sfcapp_cfg.ports[1].handle_pkts = proxy_handle_outbound_pkts;
+    /* The SFF is behind the first port unless told otherwise, the
+     * SFs behind the others */
+    if(sfcapp_cfg.sff_port == SFF_PORT_DEFAULT)
+        sfcapp_cfg.sff_port = 0;
 
-    return 0;
-}
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++)
+        sfcapp_cfg.ports[i].handle_pkts = i == sfcapp_cfg.sff_port ? inbound : outbound;
+
+    /* Packets from the SFs go back to the SFF */
+    if(sfcapp_cfg.sff_ip != 0)
+        common_vxlan_build_tmpl(sfcapp_cfg.sff_port,&sfcapp_cfg.sff_addr,sfcapp_cfg.sff_ip,
+            sfcapp_cfg.sff_vni);
 
+    sfcapp_cfg.print_stats = proxy_print_stats;
+    sfcapp_cfg.print_tables = proxy_print_tables;
+
+    return 0;
+}
\ No newline at end of file
@@ -3,18 +3,83 @@
 
 #include <rte_hash.h>
 
-#define PROXY_MAX_FLOWS 1024
-#define PROXY_MAX_FUNCTIONS 64
+#include "nexthop.h"
+
+#define PROXY_MAX_FLOWS 1024          /* Default flow table size */
+#define PROXY_MAX_FLOWS6 1024         /* Same for IPv6 flows */
+#define PROXY_MIN_FLOWS 64            /* Smallest per-worker table */
+#define PROXY_FLOW_TIMEOUT_MS 30000   /* Default idle flow timeout */
+#define PROXY_AGING_BATCH 32          /* Flow slots checked per sweep step */
+#define PROXY_MAX_FUNCTIONS 64        /* Default max SFC_NODE and SF entries */
 #define PROXY_CFG_MAX_ENTRIES 2
 
-void proxy_add_sph_entry(uint32_t sph, uint16_t sfid);
+/* How the proxy finds the NSH header of packets coming back from an
+ * SF, see proxy_mode.
+ *
+ * The flow table learns the header of each inner 5-tuple on the way
+ * to the SF. The stateless modes instead write <SPI,SI> into the
+ * inner Ethernet header sent to the SF and rebuild a default NSH
+ * header from it, without metadata, when the packet comes back:
+ *
+ *   VLAN  QinQ tag, S-VID the SPI and C-VID the SI plus one, so that
+ *         neither is 0 (priority tag) or 0xFFF (reserved). SPIs are
+ *         thus limited to 1-4094, larger ones are rejected.
+ *   MAC   Source MAC 02:<SPI,SI>:FC, replacing the original one.
+ *         Looked for in the source MAC first, then the destination
+ *         one for SFs that reply to the sender.
+ *
+ * They need no per-flow state and work through SFs that rewrite
+ * addresses, as long as the SF keeps the tag or MAC. */
+enum proxy_mode {
+    PROXY_MODE_FLOW_TABLE = 0,
+    PROXY_MODE_VLAN,
+    PROXY_MODE_MAC,
+    PROXY_MODE_MAX = PROXY_MODE_MAC
+};
+
+#define PROXY_VLAN_MIN_SPI 1       /* SPIs a QinQ tag can carry */
+#define PROXY_VLAN_MAX_SPI 0xFFE
+
+#define PROXY_MAC_PREFIX 0x02   /* Locally administered, unicast */
+#define PROXY_MAC_SUFFIX 0xFC
+
+/* Starts a new set of SFC_NODE and SF entries, to replace the current
+ * one with proxy_build_tables(). Returns -1 in case of failure. */
+int proxy_config_begin(void);
+
+/* Same as proxy_config_begin(), starting from the entries of the
+ * current table so that they can be updated one by one */
+int proxy_config_edit(void);
+
+/* Discards the changes made since proxy_config_begin() or
+ * proxy_config_edit() */
+void proxy_config_abort(void);
 
-void proxy_add_sf_address_entry(uint16_t sfid, struct ether_addr *eth_addr);
+/* port is the egress of end-of-chain entries, sfid 0 */
+int proxy_add_sph_entry(uint32_t sph, uint16_t sfid, uint8_t port);
+
+/* An instance ip of 0 means it is reached by MAC only, keeping the
+ * outer IP header of the packet */
+int proxy_add_sf_address_entry(uint16_t sfid, const struct nh_sf_pool *pool);
+
+/* Remove a staged entry. Return -1 if there is none. */
+int proxy_del_sph_entry(uint32_t sph);
+
+int proxy_del_sf_address_entry(uint16_t sfid);
+
+/* Compiles the SFC_NODE and SF entries added so far into the lookup
+ * table used by the datapath and swaps it in, freeing the previous
+ * table once no worker uses it. Learned flows are kept. Must be
+ * called once all entries are added, not from a worker. Returns -1
+ * in case of failure. */
+int proxy_build_tables(void);
 
 void proxy_parse_config_file(struct rte_cfgfile *cfgfile, char** sections, int nb_sections);
 
 int proxy_setup(void);
 
+void proxy_print_stats(FILE *f);
+
 void proxy_main_loop(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ethdev.h>
+#include <rte_mempool.h>
+
+#include "common.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "pipeline.h"
+
+extern struct sfcapp_config sfcapp_cfg;
+extern struct rte_mempool *sfcapp_pktmbuf_pools[RTE_MAX_NUMA_NODES];
+
+struct telemetry_sample {
+    uint64_t tsc;                       /* 0 if not taken yet */
+    uint64_t lcore_rx[RTE_MAX_LCORE];
+    uint64_t lcore_tx[RTE_MAX_LCORE];
+    struct rte_eth_stats port[MAX_NB_PORTS];
+};
+
+static const char *const telemetry_role_names[] = {
+    [LCORE_RUN_TO_COMPLETION] = "run_to_completion",
+    [LCORE_RX] = "rx",
+    [LCORE_WORKER] = "worker",
+    [LCORE_TX] = "tx",
+};
+
+/* Only used by the control thread */
+static struct telemetry_sample telemetry_samples[2];
+static unsigned telemetry_last;         /* Index of the latest sample */
+
+static void telemetry_take_sample(struct telemetry_sample *s, uint64_t tsc){
+    const volatile struct lcore_stats *st;
+    unsigned lcore_id;
+    int i;
+
+    s->tsc = tsc;
+
+    RTE_LCORE_FOREACH(lcore_id){
+        st = &sfcapp_cfg.lcores[lcore_id].stats;
+        s->lcore_rx[lcore_id] = s->lcore_tx[lcore_id] = 0;
+
+        for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+            s->lcore_rx[lcore_id] += st->port[i].rx_pkts;
+            s->lcore_tx[lcore_id] += st->port[i].tx_pkts;
+        }
+    }
+
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++)
+        rte_eth_stats_get(sfcapp_cfg.ports[i].id,&s->port[i]);
+}
+
+int telemetry_poll(void){
+    const uint64_t hz = rte_get_tsc_hz();
+    const uint64_t interval = hz * TELEMETRY_INTERVAL_MS / MS_PER_S;
+    uint64_t now, elapsed;
+
+    now = rte_rdtsc();
+    elapsed = now - telemetry_samples[telemetry_last].tsc;
+
+    if(elapsed >= interval){
+        telemetry_last ^= 1;
+        telemetry_take_sample(&telemetry_samples[telemetry_last],now);
+        return TELEMETRY_INTERVAL_MS;
+    }
+
+    return (interval - elapsed) * MS_PER_S / hz + 1;
+}
+
+/* Per second rate of a counter between the last two samples */
+static double telemetry_rate(uint64_t last, uint64_t prev){
+    const struct telemetry_sample *s = &telemetry_samples[telemetry_last];
+    const struct telemetry_sample *p = &telemetry_samples[telemetry_last ^ 1];
+
+    if(p->tsc == 0 || s->tsc == p->tsc)
+        return 0;
+
+    return (double) (last - prev) * rte_get_tsc_hz() / (s->tsc - p->tsc);
+}
+
+static void telemetry_print_xstats(FILE *f, uint8_t port_id){
+    struct rte_eth_xstat_name *names;
+    struct rte_eth_xstat *xstats;
+    int i, n;
+
+    fprintf(f,"\"xstats\":{");
+
+    n = rte_eth_xstats_get(port_id,NULL,0);
+    if(n <= 0){
+        fprintf(f,"}");
+        return;
+    }
+
+    names = calloc(n,sizeof(*names));
+    xstats = calloc(n,sizeof(*xstats));
+
+    if(names != NULL && xstats != NULL &&
+       rte_eth_xstats_get_names(port_id,names,n) == n &&
+       rte_eth_xstats_get(port_id,xstats,n) == n){
+        for(i = 0 ; i < n ; i++)
+            fprintf(f,"%s\"%s\":%" PRIu64,i > 0 ? "," : "",
+                names[i].name,xstats[i].value);
+    }
+
+    free(names);
+    free(xstats);
+
+    fprintf(f,"}");
+}
+
+static void telemetry_print_ports(FILE *f, const struct lcore_stats *total){
+    const struct telemetry_sample *s = &telemetry_samples[telemetry_last];
+    const struct telemetry_sample *p = &telemetry_samples[telemetry_last ^ 1];
+    int i;
+
+    fprintf(f,"\"ports\":[");
+
+    for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+        fprintf(f,"%s{\"port\":%" PRIu32 ",\"rx_pkts\":%" PRIu64 ",\"tx_pkts\":%" PRIu64
+            ",\"rx_pps\":%.0f,\"tx_pps\":%.0f,\"rx_bps\":%.0f,\"tx_bps\":%.0f"
+            ",\"nic\":{\"ipackets\":%" PRIu64 ",\"opackets\":%" PRIu64
+            ",\"ibytes\":%" PRIu64 ",\"obytes\":%" PRIu64 ",\"imissed\":%" PRIu64
+            ",\"ierrors\":%" PRIu64 ",\"oerrors\":%" PRIu64 ",\"rx_nombuf\":%" PRIu64 "},",
+            i > 0 ? "," : "",sfcapp_cfg.ports[i].id,
+            total->port[i].rx_pkts,total->port[i].tx_pkts,
+            telemetry_rate(s->port[i].ipackets,p->port[i].ipackets),
+            telemetry_rate(s->port[i].opackets,p->port[i].opackets),
+            8*telemetry_rate(s->port[i].ibytes,p->port[i].ibytes),
+            8*telemetry_rate(s->port[i].obytes,p->port[i].obytes),
+            s->port[i].ipackets,s->port[i].opackets,
+            s->port[i].ibytes,s->port[i].obytes,s->port[i].imissed,
+            s->port[i].ierrors,s->port[i].oerrors,s->port[i].rx_nombuf);
+
+        telemetry_print_xstats(f,sfcapp_cfg.ports[i].id);
+        fprintf(f,"}");
+    }
+
+    fprintf(f,"]");
+}
+
+static void telemetry_print_drops(FILE *f, const volatile uint64_t *drops){
+    int i;
+
+    fprintf(f,"\"drops\":{");
+    for(i = 0 ; i < DROP_NB_REASONS ; i++)
+        fprintf(f,"%s\"%s\":%" PRIu64,i > 0 ? "," : "",
+            common_drop_reason_names[i],drops[i]);
+    fprintf(f,"}");
+}
+
+static void telemetry_print_cycles(FILE *f, uint64_t nb_bursts, uint64_t busy_cycles,
+    const volatile uint64_t *hist){
+    int i;
+
+    fprintf(f,"\"bursts\":%" PRIu64 ",\"busy_cycles\":%" PRIu64 ",\"burst_cycles_log2\":[",
+        nb_bursts,busy_cycles);
+    for(i = 0 ; i < STATS_CYCLES_BUCKETS ; i++)
+        fprintf(f,"%s%" PRIu64,i > 0 ? "," : "",hist[i]);
+    fprintf(f,"]");
+}
+
+static void telemetry_print_lcores(FILE *f){
+    const struct telemetry_sample *s = &telemetry_samples[telemetry_last];
+    const struct telemetry_sample *p = &telemetry_samples[telemetry_last ^ 1];
+    const volatile struct lcore_stats *st;
+    uint64_t rx, tx;
+    unsigned lcore_id;
+    int i, first;
+
+    fprintf(f,"\"lcores\":[");
+
+    first = 1;
+    RTE_LCORE_FOREACH(lcore_id){
+        st = &sfcapp_cfg.lcores[lcore_id].stats;
+
+        rx = tx = 0;
+        for(i = 0 ; i < sfcapp_cfg.nb_ports ; i++){
+            rx += st->port[i].rx_pkts;
+            tx += st->port[i].tx_pkts;
+        }
+
+        fprintf(f,"%s{\"lcore\":%u,\"role\":\"%s\",\"queue\":%" PRIu16 ",\"rx_pkts\":%" PRIu64
+            ",\"tx_pkts\":%" PRIu64 ",\"rx_pps\":%.0f,\"tx_pps\":%.0f,",
+            first ? "" : ",",lcore_id,telemetry_role_names[sfcapp_cfg.lcores[lcore_id].role],
+            sfcapp_cfg.lcores[lcore_id].queue_id,rx,tx,
+            telemetry_rate(s->lcore_rx[lcore_id],p->lcore_rx[lcore_id]),
+            telemetry_rate(s->lcore_tx[lcore_id],p->lcore_tx[lcore_id]));
+        telemetry_print_drops(f,st->drops);
+        fprintf(f,",");
+        telemetry_print_cycles(f,st->nb_bursts,st->busy_cycles,st->burst_cycles);
+        fprintf(f,"}");
+
+        first = 0;
+    }
+
+    fprintf(f,"]");
+}
+
+void telemetry_print(FILE *f){
+    struct lcore_stats total;
+    const struct rte_mempool *mp;
+    unsigned socket;
+    int first;
+
+    common_stats_read(&total);
+
+    fprintf(f,"{\"tsc_hz\":%" PRIu64 ",\"sample_tsc\":%" PRIu64 ",",
+        rte_get_tsc_hz(),telemetry_samples[telemetry_last].tsc);
+
+    telemetry_print_ports(f,&total);
+    fprintf(f,",");
+    telemetry_print_lcores(f);
+    fprintf(f,",");
+    telemetry_print_drops(f,total.drops);
+    fprintf(f,",");
+    telemetry_print_cycles(f,total.nb_bursts,total.busy_cycles,total.burst_cycles);
+
+    /* One mbuf pool per socket in use */
+    fprintf(f,",\"mempools\":[");
+    for(socket = 0, first = 1 ; socket < RTE_MAX_NUMA_NODES ; socket++){
+        mp = sfcapp_pktmbuf_pools[socket];
+        if(mp == NULL)
+            continue;
+
+        fprintf(f,"%s{\"socket\":%u,\"name\":\"%s\",\"size\":%u,\"available\":%u,\"in_use\":%u}",
+            first ? "" : ",",socket,mp->name,mp->size,rte_mempool_avail_count(mp),
+            rte_mempool_in_use_count(mp));
+        first = 0;
+    }
+    fprintf(f,"]");
+
+    fprintf(f,",");
+    pipeline_print_json(f);
+
+    fprintf(f,",\"latency\":{");
+    latency_print_json(f);
+    fprintf(f,"}");
+
+    fprintf(f,",\"tables\":{");
+    if(sfcapp_cfg.print_tables != NULL)
+        sfcapp_cfg.print_tables(f);
+    fprintf(f,"}}\n");
+}
@@ -0,0 +1,22 @@
+#ifndef SFCAPP_TELEMETRY_
+#define SFCAPP_TELEMETRY_
+
+#include <stdio.h>
+
+/* Counters exported as a JSON document, for scraping over the
+ * control socket. Counters are totals since startup; rates are
+ * computed between the last two samples, taken every
+ * TELEMETRY_INTERVAL_MS by the control thread.
+ *
+ * DPDK 17.05 has no rte_telemetry, this stands in for it.
+ */
+
+#define TELEMETRY_INTERVAL_MS 1000
+
+/* Takes a sample if one is due. Returns the time in ms until the
+ * next one. */
+int telemetry_poll(void);
+
+void telemetry_print(FILE *f);
+
+#endif
@@ -0,0 +1,8 @@
+# Usage: run-bench.sh [TYPE [CONFIG [PARAMS...]]], e.g.
+# run-bench.sh proxy proxy1 --prefetch_distance 0
+cd $(dirname "$0")
+TYPE=${1:-forwarder}
+CFG=${2:-$TYPE}
+shift $(( $# < 2 ? $# : 2 ))
+../build/sfcapp -c 0x2 -n 2 -m 4096 --vdev net_ring0 --vdev net_ring1 -- -p 3 -t $TYPE -f ../config/$CFG.cfg --bench_pkts 100000000 "$@"
+cd -
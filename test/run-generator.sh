@@ -0,0 +1,3 @@
+cd $(dirname "$0")
+../build/sfcapp -c 0x2 -n 2 -m 4096 -- -p 3 -t generator -f ../config/generator.cfg
+cd -